@@ -0,0 +1,152 @@
+-- heapdiff.lua: compare two heap snapshots written by debug.heapsnapshot
+--
+-- usage: lua heapdiff.lua [-d depth] [-n lines] old.snapshot new.snapshot
+--
+-- Each object is attributed to the first path through which it is
+-- reached from the roots (breadth first), and its retained size is its
+-- own size plus the sizes of the objects attributed below it. Sizes are
+-- summed per path (with array indices collapsed into '[*]') up to the
+-- given depth, and the paths that grew the most are listed.
+
+local typenames = {
+  [4] = "string", [5] = "table", [6] = "function",
+  [7] = "userdata", [8] = "thread", [9] = "proto",
+}
+
+local function load (fname)
+  local f = assert(io.open(fname, "rb"))
+  local s = f:read("a")
+  f:close()
+  local sig = "\27LuaH"
+  assert(s:sub(1, #sig) == sig, fname .. ": not a heap snapshot")
+  assert(s:byte(#sig + 1) == 1, fname .. ": version mismatch")
+  local roots, objs = {}, {}
+  local pos = #sig + 2
+  while pos <= #s do
+    local tag = s:sub(pos, pos)
+    pos = pos + 1
+    if tag == "R" then
+      local label, id
+      label, id, pos = string.unpack("<s2c8", s, pos)
+      roots[#roots + 1] = {label = label, id = id}
+    elseif tag == "O" then
+      local t, id, size, desc, n
+      t, id, size, desc, n, pos = string.unpack("<Bc8I8s2I4", s, pos)
+      local edges = {}
+      for i = 1, n do
+        local to, label
+        to, label, pos = string.unpack("<c8s2", s, pos)
+        edges[i] = {id = to, label = label}
+      end
+      objs[id] = {type = t, size = size, desc = desc, edges = edges}
+    else
+      error(fname .. ": corrupted snapshot")
+    end
+  end
+  return roots, objs
+end
+
+local function normalize (label)
+  return (label:gsub("^%[%d+%]$", "[*]"))
+end
+
+-- compute total retained size per path, up to depth 'maxdepth'
+local function summarize (roots, objs, maxdepth)
+  local parent, path, depth, order = {}, {}, {}, {}
+  for _, r in ipairs(roots) do
+    if objs[r.id] and not path[r.id] then
+      path[r.id] = r.label; depth[r.id] = 1
+      order[#order + 1] = r.id
+    end
+  end
+  local i = 1
+  while i <= #order do   -- breadth-first traversal
+    local id = order[i]
+    for _, e in ipairs(objs[id].edges) do
+      if objs[e.id] and not path[e.id] then
+        parent[e.id] = id
+        path[e.id] = path[id] .. "." .. normalize(e.label)
+        depth[e.id] = depth[id] + 1
+        order[#order + 1] = e.id
+      end
+    end
+    i = i + 1
+  end
+  local retained = {}
+  for j = #order, 1, -1 do   -- children before parents
+    local id = order[j]
+    retained[id] = (retained[id] or 0) + objs[id].size
+    local p = parent[id]
+    if p then retained[p] = (retained[p] or 0) + retained[id] end
+  end
+  local total, count = {}, {}
+  for _, id in ipairs(order) do
+    if depth[id] <= maxdepth then
+      local p = path[id]
+      total[p] = (total[p] or 0) + retained[id]
+      count[p] = (count[p] or 0) + 1
+    end
+  end
+  return total, count
+end
+
+local function bytype (objs)
+  local count, bytes = {}, {}
+  for _, o in pairs(objs) do
+    local t = typenames[o.type] or "?"
+    count[t] = (count[t] or 0) + 1
+    bytes[t] = (bytes[t] or 0) + o.size
+  end
+  return count, bytes
+end
+
+
+local maxdepth, nlines = 4, 20
+local files = {}
+local i = 1
+while i <= #arg do
+  if arg[i] == "-d" then maxdepth = assert(math.tointeger(arg[i + 1])); i = i + 1
+  elseif arg[i] == "-n" then nlines = assert(math.tointeger(arg[i + 1])); i = i + 1
+  else files[#files + 1] = arg[i]
+  end
+  i = i + 1
+end
+if #files ~= 2 then
+  io.stderr:write("usage: lua heapdiff.lua [-d depth] [-n lines] ",
+                  "old.snapshot new.snapshot\n")
+  os.exit(1)
+end
+
+local oldroots, oldobjs = load(files[1])
+local newroots, newobjs = load(files[2])
+
+local oc, ob = bytype(oldobjs)
+local nc, nb = bytype(newobjs)
+print(string.format("%-10s %10s %10s %12s %12s", "type", "old#", "new#",
+                    "old bytes", "delta bytes"))
+for _, t in pairs(typenames) do
+  print(string.format("%-10s %10d %10d %12d %+12d", t, oc[t] or 0, nc[t] or 0,
+                      ob[t] or 0, (nb[t] or 0) - (ob[t] or 0)))
+end
+print()
+
+local oldtotal = summarize(oldroots, oldobjs, maxdepth)
+local newtotal, newcount = summarize(newroots, newobjs, maxdepth)
+local rows = {}
+for p, n in pairs(newtotal) do
+  rows[#rows + 1] = {path = p, new = n, delta = n - (oldtotal[p] or 0)}
+end
+for p, n in pairs(oldtotal) do
+  if not newtotal[p] then rows[#rows + 1] = {path = p, new = 0, delta = -n} end
+end
+table.sort(rows, function (a, b)
+  if a.delta ~= b.delta then return a.delta > b.delta end
+  return a.path < b.path
+end)
+print(string.format("%12s %12s %8s  %s", "delta", "retained", "objects",
+                    "path"))
+for j = 1, math.min(nlines, #rows) do
+  local r = rows[j]
+  print(string.format("%+12d %12d %8d  %s", r.delta, r.new,
+                      newcount[r.path] or 0, r.path))
+end
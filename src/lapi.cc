@@ -334,6 +334,22 @@ LUA_API int lua_compare (lua_State *L, int index1, int index2, int op) {
 }
 
 
+/*
+** Convert the number at 'idx' to a string in 'buff', as 'tostring'
+** would; returns the number of bytes written (including the final
+** zero) or 0 if the value is not a number
+*/
+LUA_API unsigned lua_numbertocstring (lua_State *L, int idx, char *buff) {
+  const TValue *o = index2addr(L, idx);
+  if (ttisnumber(o)) {
+    int len = luaO_tostringbuff(o, buff);
+    buff[len++] = '\0';
+    return cast(unsigned, len);
+  }
+  return 0;
+}
+
+
 LUA_API size_t lua_stringtonumber (lua_State *L, const char *s) {
   size_t sz = luaO_str2num(s, L->top);
   if (sz != 0)
@@ -426,13 +442,13 @@ LUA_API lua_State *lua_tothread (lua_State *L, int idx) {
 }
 
 
-LUA_API const void *lua_topointer (lua_State *L, int idx) {
-  StkId o = index2addr(L, idx);
+static const void *topointer (const TValue *o) {
   switch (ttype(o)) {
     case LUA_TTABLE: return hvalue(o);
     case LUA_TLCL: return clLvalue(o);
     case LUA_TCCL: return clCvalue(o);
-    case LUA_TLCF: return cast(void *, cast(size_t, fvalue(o)));
+    case LUA_TLCF: case LUA_TFCF:
+      return cast(void *, cast(size_t, fvalue(o)));
     case LUA_TTHREAD: return thvalue(o);
     case LUA_TUSERDATA: return getudatamem(uvalue(o));
     case LUA_TLIGHTUSERDATA: return pvalue(o);
@@ -441,6 +457,11 @@ LUA_API const void *lua_topointer (lua_State *L, int idx) {
 }
 
 
+LUA_API const void *lua_topointer (lua_State *L, int idx) {
+  return topointer(index2addr(L, idx));
+}
+
+
 
 /*
 ** push functions (C -> stack)
@@ -548,6 +569,19 @@ LUA_API void lua_pushcclosure (lua_State *L, lua_CFunction fn, int n) {
 }
 
 
+/*
+** Push a light C function that OP_CALL may call through a lighter
+** frame: no GC step or stack reallocation before the call and a direct
+** move of its results. 'fn' must not call Lua functions nor yield.
+*/
+LUA_API void lua_pushfastcfunction (lua_State *L, lua_CFunction fn) {
+  lua_lock(L);
+  setfastfvalue(L->top, fn);
+  api_incr_top(L);
+  lua_unlock(L);
+}
+
+
 LUA_API void lua_pushboolean (lua_State *L, int b) {
   lua_lock(L);
   setbvalue(L->top, (b != 0));  /* ensure that true is 1 */
@@ -663,6 +697,150 @@ LUA_API int lua_rawgetp (lua_State *L, int idx, const void *p) {
 }
 
 
+/*
+** {======================================================
+** Batch reads: copy several raw table entries straight into C memory,
+** without going through the stack
+** =======================================================
+*/
+
+static Table *gettable (lua_State *L, int idx) {
+  StkId t = index2addr(L, idx);
+  api_check(L, ttistable(t), "table expected");
+  return hvalue(t);
+}
+
+
+static void copyentry (const TValue *o, lua_Entry *e) {
+  e->type = ttnov(o);
+  e->isinteger = 0;
+  e->s = NULL;
+  e->len = 0;
+  switch (ttype(o)) {
+    case LUA_TNIL: e->v.p = NULL; break;
+    case LUA_TBOOLEAN: e->v.b = bvalue(o); break;
+    case LUA_TNUMINT: e->isinteger = 1; e->v.i = ivalue(o); break;
+    case LUA_TNUMFLT: e->v.n = fltvalue(o); break;
+    case LUA_TSHRSTR: case LUA_TLNGSTR: {
+      e->s = svalue(o);
+      e->len = vslen(o);
+      e->v.p = tsvalue(o);
+      break;
+    }
+    default: e->v.p = topointer(o); break;
+  }
+}
+
+
+LUA_API int lua_rawgetfields (lua_State *L, int idx, const char *const *keys,
+                              int n, lua_Entry *out) {
+  Table *t;
+  int i, found = 0;
+  lua_lock(L);
+  t = gettable(L, idx);
+  for (i = 0; i < n; i++) {
+    TString *key = luaS_new(L, keys[i]);
+    const TValue *o;
+    if (key->tt == LUA_TSHRSTR)
+      o = luaH_getstr(t, key);
+    else {
+      TValue k;
+      setsvalue(L, &k, key);
+      o = luaH_get(t, &k);
+    }
+    copyentry(o, &out[i]);
+    found += !ttisnil(o);
+  }
+  lua_unlock(L);
+  return found;
+}
+
+
+LUA_API lua_Integer lua_rawgetiv (lua_State *L, int idx, lua_Integer from,
+                                  lua_Integer to, lua_Entry *out) {
+  Table *t;
+  lua_Integer i, found = 0;
+  lua_lock(L);
+  t = gettable(L, idx);
+  for (i = from; i <= to; i++) {
+    const TValue *o = luaH_getint(t, i);
+    copyentry(o, out++);
+    found += !ttisnil(o);
+    if (i == LUA_MAXINTEGER) break;  /* avoid overflow */
+  }
+  lua_unlock(L);
+  return found;
+}
+
+
+/*
+** The typed variants below stop at the first entry without a value of
+** their type; they return the number of entries copied. Like the other
+** raw accesses, they do no coercions: strings are not converted to
+** numbers nor numbers to strings ('lua_rawgetintegers' accepts floats
+** with an exact integer value, as 'math.tointeger').
+*/
+
+LUA_API lua_Integer lua_rawgetnumbers (lua_State *L, int idx,
+                                       lua_Integer from, lua_Integer to,
+                                       lua_Number *out) {
+  Table *t;
+  lua_Integer n = 0;
+  lua_lock(L);
+  t = gettable(L, idx);
+  for (; from <= to; from++) {
+    const TValue *o = luaH_getint(t, from);
+    if (!ttisnumber(o)) break;
+    out[n] = nvalue(o);
+    n++;
+    if (from == LUA_MAXINTEGER) break;  /* avoid overflow */
+  }
+  lua_unlock(L);
+  return n;
+}
+
+
+LUA_API lua_Integer lua_rawgetintegers (lua_State *L, int idx,
+                                        lua_Integer from, lua_Integer to,
+                                        lua_Integer *out) {
+  Table *t;
+  lua_Integer n = 0;
+  lua_lock(L);
+  t = gettable(L, idx);
+  for (; from <= to; from++) {
+    const TValue *o = luaH_getint(t, from);
+    if (ttisinteger(o)) out[n] = ivalue(o);
+    else if (!ttisfloat(o) || !luaV_tointeger(o, &out[n], 0)) break;
+    n++;
+    if (from == LUA_MAXINTEGER) break;  /* avoid overflow */
+  }
+  lua_unlock(L);
+  return n;
+}
+
+
+LUA_API lua_Integer lua_rawgetstrings (lua_State *L, int idx,
+                                       lua_Integer from, lua_Integer to,
+                                       const char **out, size_t *len) {
+  Table *t;
+  lua_Integer n = 0;
+  lua_lock(L);
+  t = gettable(L, idx);
+  for (; from <= to; from++) {
+    const TValue *o = luaH_getint(t, from);
+    if (!ttisstring(o)) break;
+    out[n] = svalue(o);
+    if (len) len[n] = vslen(o);
+    n++;
+    if (from == LUA_MAXINTEGER) break;  /* avoid overflow */
+  }
+  lua_unlock(L);
+  return n;
+}
+
+/* }====================================================== */
+
+
 LUA_API void lua_createtable (lua_State *L, int narray, int nrec) {
   Table *t;
   lua_lock(L);
@@ -819,6 +997,57 @@ LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
 }
 
 
+/*
+** Sort t[1..n] in place with the primitive order, if they all are
+** numbers or all are strings in the array part; moving values inside
+** the table needs no barrier.
+*/
+LUA_API int lua_rawsort (lua_State *L, int idx, lua_Integer n) {
+  StkId o;
+  int res;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  if (n <= 1)
+    res = 1;  /* nothing to sort */
+  else if ((lua_Unsigned)n > UINT_MAX)
+    res = 0;
+  else
+    res = luaH_sortarray(L, hvalue(o), cast(unsigned int, n));
+  lua_unlock(L);
+  return res;
+}
+
+
+/*
+** Stable version of 'lua_rawsort'; if 'vidx' is not 0, elements 1..n
+** of the table at 'vidx' follow the moves of their keys at 'idx'.
+*/
+LUA_API int lua_rawstablesort (lua_State *L, int idx, lua_Integer n,
+                               int vidx) {
+  StkId o;
+  Table *v = NULL;
+  int res;
+  lua_lock(L);
+  o = index2addr(L, idx);
+  api_check(L, ttistable(o), "table expected");
+  if (vidx != 0) {
+    StkId ov = index2addr(L, vidx);
+    api_check(L, ttistable(ov), "table expected");
+    v = hvalue(ov);
+    api_check(L, v != hvalue(o), "tables must be different");
+  }
+  if (n <= 1)
+    res = 1;  /* nothing to sort */
+  else if ((lua_Unsigned)n > UINT_MAX)
+    res = 0;
+  else
+    res = luaH_stablesort(L, hvalue(o), cast(unsigned int, n), v);
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API int lua_setmetatable (lua_State *L, int objindex) {
   TValue *obj;
   Table *mt;
@@ -1043,7 +1272,9 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
     case LUA_GCSTEP: {
       l_mem debt = 1;  /* =1 to signal that it did an actual step */
       int oldrunning = g->gcrunning;
+      int oldslice = g->gcslice;
       g->gcrunning = 1;  /* allow GC to run */
+      g->gcslice = 0;  /* explicit steps are not time limited */
       if (data == 0) {
         luaE_setdebt(g, -GCSTEPSIZE);  /* to do a "small" step */
         luaC_step(L);
@@ -1054,6 +1285,7 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         luaC_checkGC(L);
       }
       g->gcrunning = oldrunning;  /* restore previous state */
+      g->gcslice = oldslice;
       if (debt > 0 && g->gcstate == GCSpause)  /* end of cycle? */
         res = 1;  /* signal it */
       break;
@@ -1073,6 +1305,53 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       res = g->gcrunning;
       break;
     }
+    case LUA_GCTARGET: {
+      res = g->gctarget;
+      if (data < 0) data = 0;  /* negative values turn the pacer off */
+      g->gctarget = data;
+      g->gcpacedmul = g->gcstepmul;
+      break;
+    }
+    case LUA_GCTARGETPAUSE: {
+      res = g->gctargetpause;
+      if (data < 0) data = 0;
+      g->gctargetpause = data;
+      if (data == 0)  /* back to fixed-size steps? */
+        g->GCstepsize = GCSTEPSIZE;
+      break;
+    }
+    case LUA_GCIDLE: {
+      if (data > 0)
+        res = luaC_idle(L, data);
+      break;
+    }
+    case LUA_GCSETSLICE: {
+      res = g->gcslice;
+      if (data < 0) data = 0;
+      g->gcslice = data;
+      break;
+    }
+    case LUA_GCDEFERFIN: {
+      res = g->gcdeferfin;
+      g->gcdeferfin = (data != 0);
+      break;
+    }
+    case LUA_GCRUNFINALIZERS: {
+      res = luaC_runfinalizers(L, data);
+      break;
+    }
+    case LUA_GCSAMPLE: {
+      res = g->gcsample;
+      if (data <= 0) {  /* turn sampler off (and forget its results) */
+        luaG_freeallocsites(L);
+        g->gcsample = 0;
+      }
+      else {
+        luaG_newallocsites(L);
+        g->gcsample = g->gcsamplecount = data;
+      }
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1081,6 +1360,23 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
 
 
 
+LUA_API void lua_heapstats (lua_State *L, lua_HeapStats *hs) {
+  lua_lock(L);
+  luaC_heapstats(L, hs);
+  lua_unlock(L);
+}
+
+
+LUA_API int lua_heapsnapshot (lua_State *L, lua_Writer writer, void *data) {
+  int status;
+  lua_lock(L);
+  status = luaC_heapsnapshot(L, writer, data);
+  lua_unlock(L);
+  return status;
+}
+
+
+
 /*
 ** miscellaneous functions
 */
@@ -1095,6 +1391,15 @@ LUA_API int lua_error (lua_State *L) {
 }
 
 
+LUA_API int lua_seterrormode (lua_State *L, int mode) {
+  int res;
+  lua_lock(L);
+  res = luaD_seterrormode(L, mode);
+  lua_unlock(L);
+  return res;
+}
+
+
 LUA_API int lua_next (lua_State *L, int idx) {
   StkId t;
   int more;
@@ -873,6 +873,18 @@ LUALIB_API void luaL_setfuncs (lua_State *L, const luaL_Reg *l, int nup) {
 }
 
 
+/*
+** set fast C functions (see 'lua_pushfastcfunction') from list 'l'
+** into table at the top
+*/
+LUALIB_API void luaL_setfastfuncs (lua_State *L, const luaL_Reg *l) {
+  for (; l->name != NULL; l++) {
+    lua_pushfastcfunction(L, l->func);
+    lua_setfield(L, -2, l->name);
+  }
+}
+
+
 /*
 ** ensure that stack[idx][fname] has a table and push that table
 ** into the stack
@@ -89,6 +89,7 @@ LUALIB_API const char *(luaL_gsub) (lua_State *L, const char *s, const char *p,
                                                   const char *r);
 
 LUALIB_API void (luaL_setfuncs) (lua_State *L, const luaL_Reg *l, int nup);
+LUALIB_API void (luaL_setfastfuncs) (lua_State *L, const luaL_Reg *l);
 
 LUALIB_API int (luaL_getsubtable) (lua_State *L, int idx, const char *fname);
 
@@ -170,23 +170,62 @@ static int luaB_rawset (lua_State *L) {
 }
 
 
+/* options of 'collectgarbage' that do not go through 'lua_gc' */
+#define GCSTATS		(-1)
+#define GCSITES		(-2)
+
+
+static int heapstats (lua_State *L) {
+  static const char *const kinds[LUA_NUMHS] = {"shortstring", "longstring",
+    "table", "tablearray", "tablehash", "luaclosure", "cclosure", "proto",
+    "userdata", "thread"};
+  lua_HeapStats hs;
+  int i;
+  lua_heapstats(L, &hs);
+  lua_createtable(L, 0, LUA_NUMHS);
+  for (i = 0; i < LUA_NUMHS; i++) {
+    lua_createtable(L, 0, 2);
+    lua_pushinteger(L, (lua_Integer)hs.count[i]);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, (lua_Integer)hs.bytes[i]);
+    lua_setfield(L, -2, "bytes");
+    lua_setfield(L, -2, kinds[i]);
+  }
+  lua_pushinteger(L, (lua_Integer)hs.poolbytes);
+  lua_setfield(L, -2, "pool");
+  return 1;
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", NULL};
+    "isrunning", "target", "targetpause", "idle", "setslice",
+    "deferfinalizers", "runfinalizers", "stats", "sample", "sites", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING};
+    LUA_GCISRUNNING, LUA_GCTARGET, LUA_GCTARGETPAUSE, LUA_GCIDLE,
+    LUA_GCSETSLICE, LUA_GCDEFERFIN, LUA_GCRUNFINALIZERS, GCSTATS,
+    LUA_GCSAMPLE, GCSITES};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
-  int ex = (int)luaL_optinteger(L, 2, 0);
-  int res = lua_gc(L, o, ex);
+  int ex, res;
+  if (o == GCSTATS)
+    return heapstats(L);
+  else if (o == GCSITES) {
+    lua_allocsites(L);
+    return 1;
+  }
+  ex = (o == LUA_GCDEFERFIN) ? lua_toboolean(L, 2)
+                             : (int)luaL_optinteger(L, 2, 0);
+  res = lua_gc(L, o, ex);
   switch (o) {
     case LUA_GCCOUNT: {
       int b = lua_gc(L, LUA_GCCOUNTB, 0);
       lua_pushnumber(L, (lua_Number)res + ((lua_Number)b/1024));
       return 1;
     }
-    case LUA_GCSTEP: case LUA_GCISRUNNING: {
+    case LUA_GCSTEP: case LUA_GCISRUNNING: case LUA_GCIDLE:
+    case LUA_GCDEFERFIN: {
       lua_pushboolean(L, res);
       return 1;
     }
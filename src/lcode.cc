@@ -347,11 +347,12 @@ int luaK_stringK (FuncState *fs, TString *s) {
 /*
 ** Integers use userdata as keys to avoid collision with floats with same
 ** value; conversion to 'void*' used only for hashing, no "precision"
-** problems
+** problems. (Going through 'lua_Unsigned' keeps pointers small when
+** integers are smaller than pointers, as needed by LUA_NANTRICK.)
 */
 int luaK_intK (FuncState *fs, lua_Integer n) {
   TValue k, o;
-  setpvalue(&k, cast(void*, cast(size_t, n)));
+  setpvalue(&k, cast(void*, cast(size_t, l_castS2U(n))));
   setivalue(&o, n);
   return addk(fs, &k, &o);
 }
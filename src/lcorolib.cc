@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <limits.h>
 #include <stdlib.h>
 
 #include "lua.h"
@@ -25,6 +26,122 @@ static lua_State *getco (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Coroutine pool: when enabled ('coroutine.pool'), threads of wrapped
+** coroutines that finished are reset and kept in the table at
+** registry[&POOLKEY], to be reused by 'create' and 'wrap'. Index 0 of
+** that table keeps its capacity. Only threads that no Lua code can
+** reach are recycled: the thread of a 'wrap' is known only to its
+** function, unless its body called 'coroutine.running', which records
+** the thread in the weak set at registry[&SEENKEY]. (Neither table is
+** an upvalue, so that 'debug.getupvalue' cannot reach pooled threads.)
+** =======================================================
+*/
+
+static const int POOLKEY = 0;
+static const int SEENKEY = 0;
+
+#define POOLLIMIT	0
+
+
+/* push the pool and return its stack index */
+static int getpool (lua_State *L) {
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &POOLKEY);
+  return lua_gettop(L);
+}
+
+
+static lua_Integer poollimit (lua_State *L, int pool) {
+  lua_Integer limit;
+  lua_rawgeti(L, pool, POOLLIMIT);
+  limit = lua_tointeger(L, -1);  /* nil (no pool) converts to 0 */
+  lua_pop(L, 1);
+  return limit;
+}
+
+
+/*
+** pop a thread from the pool (leaving it on the stack) or return NULL
+*/
+static lua_State *getpooled (lua_State *L, int pool) {
+  lua_Integer n = lua_rawlen(L, pool);
+  lua_State *co;
+  if (n == 0) return NULL;
+  lua_rawgeti(L, pool, n);
+  lua_pushnil(L);
+  lua_rawseti(L, pool, n);
+  co = lua_tothread(L, -1);
+  /* a new thread would get the hooks of its creator */
+  lua_sethook(co, lua_gethook(L), lua_gethookmask(L), lua_gethookcount(L));
+  return co;
+}
+
+
+/*
+** reset thread 'co', which must not be running nor reachable by Lua
+** code, and put it in the pool if there is room
+*/
+static void recycle (lua_State *L, int pool, lua_State *co) {
+  lua_Integer n = lua_rawlen(L, pool);
+  if (n < poollimit(L, pool)) {
+    lua_resetthread(co);
+    lua_pushthread(co);
+    lua_xmove(co, L, 1);
+    lua_rawseti(L, pool, n + 1);
+  }
+}
+
+
+/* true if Lua code may hold a reference to thread 'co' */
+static int isseen (lua_State *L, lua_State *co) {
+  int seen;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &SEENKEY);
+  lua_pushthread(co);
+  lua_xmove(co, L, 1);
+  seen = (lua_rawget(L, -2) != LUA_TNIL);
+  lua_pop(L, 2);
+  return seen;
+}
+
+/* }====================================================== */
+
+
+/*
+** Coroutine statuses
+*/
+#define COS_RUN		0
+#define COS_DEAD	1
+#define COS_YIELD	2
+#define COS_NORM	3
+
+
+static const char *const statname[] =
+  {"running", "dead", "suspended", "normal"};
+
+
+static int auxstatus (lua_State *L, lua_State *co) {
+  if (L == co) return COS_RUN;
+  else {
+    switch (lua_status(co)) {
+      case LUA_YIELD:
+        return COS_YIELD;
+      case LUA_OK: {
+        lua_Debug ar;
+        if (lua_getstack(co, 0, &ar) > 0)  /* does it have frames? */
+          return COS_NORM;  /* it is running */
+        else if (lua_gettop(co) == 0)
+            return COS_DEAD;
+        else
+          return COS_YIELD;  /* initial state */
+      }
+      default:  /* some error occurred */
+        return COS_DEAD;
+    }
+  }
+}
+
+
 static int auxresume (lua_State *L, lua_State *co, int narg) {
   int status;
   if (!lua_checkstack(co, narg)) {
@@ -73,7 +190,23 @@ static int luaB_coresume (lua_State *L) {
 
 static int luaB_auxwrap (lua_State *L) {
   lua_State *co = lua_tothread(L, lua_upvalueindex(1));
-  int r = auxresume(L, co, lua_gettop(L));
+  int r;
+  if (co == NULL) {  /* coroutine went back to the pool? */
+    lua_pushliteral(L, "cannot resume dead coroutine");
+    r = -1;
+  }
+  else {
+    r = auxresume(L, co, lua_gettop(L));
+    if (auxstatus(L, co) == COS_DEAD && lua_checkstack(L, 3)) {
+      int pool = getpool(L);
+      if (poollimit(L, pool) > 0 && !isseen(L, co)) {
+        recycle(L, pool, co);
+        lua_pushboolean(L, 0);  /* this function no longer owns 'co' */
+        lua_replace(L, lua_upvalueindex(1));
+      }
+      lua_remove(L, pool);
+    }
+  }
   if (r < 0) {
     if (lua_isstring(L, -1)) {  /* error object is a string? */
       luaL_where(L, 1);  /* add extra info */
@@ -88,8 +221,15 @@ static int luaB_auxwrap (lua_State *L) {
 
 static int luaB_cocreate (lua_State *L) {
   lua_State *NL;
+  lua_Integer size = luaL_optinteger(L, 2, 0);
   luaL_checktype(L, 1, LUA_TFUNCTION);
-  NL = lua_newthread(L);
+  luaL_argcheck(L, 0 <= size && size <= INT_MAX, 2, "invalid stack size");
+  if (size != 0) NL = lua_newthreadsize(L, (int)size);
+  else {
+    int pool = getpool(L);
+    if ((NL = getpooled(L, pool)) == NULL) NL = lua_newthread(L);
+    lua_remove(L, pool);
+  }
   lua_pushvalue(L, 1);  /* move function to top */
   lua_xmove(L, NL, 1);  /* move function from L to NL */
   return 1;
@@ -110,27 +250,42 @@ static int luaB_yield (lua_State *L) {
 
 static int luaB_costatus (lua_State *L) {
   lua_State *co = getco(L);
-  if (L == co) lua_pushliteral(L, "running");
-  else {
-    switch (lua_status(co)) {
-      case LUA_YIELD:
-        lua_pushliteral(L, "suspended");
-        break;
-      case LUA_OK: {
-        lua_Debug ar;
-        if (lua_getstack(co, 0, &ar) > 0)  /* does it have frames? */
-          lua_pushliteral(L, "normal");  /* it is running */
-        else if (lua_gettop(co) == 0)
-            lua_pushliteral(L, "dead");
-        else
-          lua_pushliteral(L, "suspended");  /* initial state */
-        break;
-      }
-      default:  /* some error occurred */
-        lua_pushliteral(L, "dead");
-        break;
+  lua_pushstring(L, statname[auxstatus(L, co)]);
+  return 1;
+}
+
+
+static int luaB_close (lua_State *L) {
+  lua_State *co = getco(L);
+  int status = auxstatus(L, co);
+  switch (status) {
+    case COS_DEAD: case COS_YIELD: {
+      lua_pushboolean(L, lua_resetthread(co) == LUA_OK);
+      return 1;
+    }
+    default:  /* normal or running coroutine */
+      return luaL_error(L, "cannot close a %s coroutine", statname[status]);
+  }
+}
+
+
+static int luaB_copool (lua_State *L) {
+  int pool;
+  lua_settop(L, 1);
+  pool = getpool(L);
+  lua_Integer old = poollimit(L, pool);
+  if (!lua_isnoneornil(L, 1)) {
+    lua_Integer limit = luaL_checkinteger(L, 1);
+    lua_Integer n = lua_rawlen(L, pool);
+    luaL_argcheck(L, limit >= 0, 1, "negative pool size");
+    lua_pushinteger(L, limit);
+    lua_rawseti(L, pool, POOLLIMIT);
+    for (; n > limit; n--) {  /* drop threads over the new limit */
+      lua_pushnil(L);
+      lua_rawseti(L, pool, n);
     }
   }
+  lua_pushinteger(L, old);
   return 1;
 }
 
@@ -143,13 +298,22 @@ static int luaB_yieldable (lua_State *L) {
 
 static int luaB_corunning (lua_State *L) {
   int ismain = lua_pushthread(L);
+  if (!ismain) {  /* thread is now visible to Lua code */
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &SEENKEY);
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
   lua_pushboolean(L, ismain);
   return 2;
 }
 
 
 static const luaL_Reg co_funcs[] = {
+  {"close", luaB_close},
   {"create", luaB_cocreate},
+  {"pool", luaB_copool},
   {"resume", luaB_coresume},
   {"running", luaB_corunning},
   {"status", luaB_costatus},
@@ -162,6 +326,15 @@ static const luaL_Reg co_funcs[] = {
 
 
 LUAMOD_API int luaopen_coroutine (lua_State *L) {
+  luaL_checkversion(L);
+  lua_newtable(L);  /* pool of reset threads */
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &POOLKEY);
+  lua_newtable(L);  /* set of threads seen by 'running' */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &SEENKEY);
   luaL_newlib(L, co_funcs);
   return 1;
 }
@@ -428,10 +428,36 @@ static int db_traceback (lua_State *L) {
 }
 
 
+static int writer (lua_State *L, const void *b, size_t size, void *B) {
+  (void)L;
+  luaL_addlstring((luaL_Buffer *) B, (const char *)b, size);
+  return 0;
+}
+
+
+static int db_heapsnapshot (lua_State *L) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  if (lua_heapsnapshot(L, writer, &b) != 0)
+    return luaL_error(L, "unable to build heap snapshot");
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+static int db_seterrormode (lua_State *L) {
+  static const char *const modes[] = {"throw", "jump", NULL};
+  int mode = luaL_checkoption(L, 1, NULL, modes);
+  lua_pushboolean(L, lua_seterrormode(L, mode));
+  return 1;
+}
+
+
 static const luaL_Reg dblib[] = {
   {"debug", db_debug},
   {"getuservalue", db_getuservalue},
   {"gethook", db_gethook},
+  {"heapsnapshot", db_heapsnapshot},
   {"getinfo", db_getinfo},
   {"getlocal", db_getlocal},
   {"getregistry", db_getregistry},
@@ -441,6 +467,7 @@ static const luaL_Reg dblib[] = {
   {"upvalueid", db_upvalueid},
   {"setuservalue", db_setuservalue},
   {"sethook", db_sethook},
+  {"seterrormode", db_seterrormode},
   {"setlocal", db_setlocal},
   {"setmetatable", db_setmetatable},
   {"setupvalue", db_setupvalue},
@@ -637,6 +637,163 @@ l_noret luaG_runerror (lua_State *L, const char *fmt, ...) {
 }
 
 
+/*
+** {======================================================
+** Heap sampler
+** =======================================================
+*/
+
+
+/* number of hash chains for allocation sites (must be a power of 2) */
+#define SITEHASHSIZE	256
+
+#define sitehash(p,line)  \
+	(((point2uint(p) >> 4) + cast(unsigned int, line) * 2654435761u) & \
+	 (SITEHASHSIZE - 1))
+
+
+/*
+** Record one sampled allocation of 'size' bytes, attributing it to the
+** line being executed by the innermost active Lua function. Each sample
+** stands for 'gcsample' objects. Sites are found through a hash of
+** (function, line); forgotten sites stay in their old chains, where
+** they never match a live function.
+*/
+void luaG_sampleallocation (lua_State *L, size_t size) {
+  global_State *g = G(L);
+  const Proto *p = NULL;
+  int line = -1;
+  int i;
+  CallInfo *ci;
+  AllocSite *site;
+  g->gcsamplecount = g->gcsample;
+  for (ci = L->ci; ci != NULL; ci = ci->previous) {
+    if (isLua(ci)) {
+      p = ci_func(ci)->p;
+      line = currentline(ci);
+      break;
+    }
+  }
+  for (i = g->allocsitehash[sitehash(p, line)]; i >= 0; i = site->next) {
+    site = &g->allocsites[i];
+    if (site->p == p && site->line == line)
+      goto found;
+  }
+  if (g->nallocsites >= LUAI_MAXALLOCSITES - 1 && p != NULL) {
+    /* table is full; use the unknown site (always the last slot) */
+    site = &g->allocsites[LUAI_MAXALLOCSITES - 1];
+    if (g->nallocsites < LUAI_MAXALLOCSITES) {
+      g->nallocsites = LUAI_MAXALLOCSITES;
+      site->p = NULL; site->line = -1;
+      site->count = site->bytes = 0;
+      site->next = g->allocsitehash[sitehash(NULL, -1)];
+      g->allocsitehash[sitehash(NULL, -1)] = LUAI_MAXALLOCSITES - 1;
+    }
+    goto found;
+  }
+  i = g->nallocsites++;  /* new site */
+  site = &g->allocsites[i];
+  site->p = p;
+  site->line = line;
+  site->count = site->bytes = 0;
+  site->next = g->allocsitehash[sitehash(p, line)];
+  g->allocsitehash[sitehash(p, line)] = i;
+ found:
+  site->count += g->gcsample;
+  site->bytes += size * g->gcsample;
+}
+
+
+/*
+** Proto 'p' is being freed: move its sites into the unknown one.
+*/
+void luaG_forgetproto (lua_State *L, const Proto *p) {
+  global_State *g = G(L);
+  int i;
+  for (i = 0; i < g->nallocsites; i++) {
+    if (g->allocsites[i].p == p) {
+      g->allocsites[i].p = NULL;
+      g->allocsites[i].line = -1;
+    }
+  }
+}
+
+
+/*
+** Create the (empty) table of allocation sites, if not created yet.
+*/
+void luaG_newallocsites (lua_State *L) {
+  global_State *g = G(L);
+  int i;
+  if (g->allocsitehash == NULL)
+    g->allocsitehash = luaM_newvector(L, SITEHASHSIZE, int);
+  if (g->allocsites == NULL) {
+    g->allocsites = luaM_newvector(L, LUAI_MAXALLOCSITES, AllocSite);
+    for (i = 0; i < SITEHASHSIZE; i++)
+      g->allocsitehash[i] = -1;
+  }
+}
+
+
+void luaG_freeallocsites (lua_State *L) {
+  global_State *g = G(L);
+  luaM_freearray(L, g->allocsites, LUAI_MAXALLOCSITES);
+  luaM_freearray(L, g->allocsitehash, SITEHASHSIZE);
+  g->allocsites = NULL;
+  g->allocsitehash = NULL;
+  g->nallocsites = 0;
+}
+
+
+/*
+** Push a table with the results of the heap sampler: for each
+** "source:line", a table with the estimated 'count' and 'bytes' of the
+** objects created there. The sampler keeps running while the result is
+** built, so it works on a copy of the sites (kept in a userdata, which
+** does not leak if building the result raises an error).
+*/
+LUA_API void lua_allocsites (lua_State *L) {
+  global_State *g = G(L);
+  int n = g->nallocsites;
+  int i;
+  AllocSite *sites =
+      cast(AllocSite *, lua_newuserdata(L, n * sizeof(AllocSite)));
+  if (n > 0)
+    memcpy(sites, g->allocsites, n * sizeof(AllocSite));
+  lua_createtable(L, 0, n);
+  for (i = 0; i < n; i++) {
+    const AllocSite *site = &sites[i];
+    if (site->p != NULL && site->p->source != NULL) {
+      char buff[LUA_IDSIZE];
+      luaO_chunkid(buff, getstr(site->p->source), LUA_IDSIZE);
+      lua_pushfstring(L, "%s:%d", buff, site->line);
+    }
+    else
+      lua_pushliteral(L, "?");
+    lua_pushvalue(L, -1);
+    if (lua_rawget(L, -3) == LUA_TNIL) {  /* first entry for this key? */
+      lua_pop(L, 1);
+      lua_createtable(L, 0, 2);
+      lua_pushinteger(L, 0); lua_setfield(L, -2, "count");
+      lua_pushinteger(L, 0); lua_setfield(L, -2, "bytes");
+      lua_pushvalue(L, -2);
+      lua_pushvalue(L, -2);
+      lua_rawset(L, -5);  /* result[key] = new entry */
+    }
+    lua_getfield(L, -1, "count");
+    lua_pushinteger(L, lua_tointeger(L, -1) + cast(lua_Integer, site->count));
+    lua_setfield(L, -3, "count");
+    lua_getfield(L, -2, "bytes");
+    lua_pushinteger(L, lua_tointeger(L, -1) + cast(lua_Integer, site->bytes));
+    lua_setfield(L, -4, "bytes");
+    lua_pop(L, 4);  /* entry, key, and the two old values */
+  }
+  lua_remove(L, -2);  /* remove copy of the sites */
+}
+
+/* }====================================================== */
+
+
 void luaG_traceexec (lua_State *L) {
   CallInfo *ci = L->ci;
   lu_byte mask = L->hookmask;
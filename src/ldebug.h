@@ -18,6 +18,26 @@
 #define resethookcount(L)	(L->hookcount = L->basehookcount)
 
 
+/* maximum number of allocation sites recorded by the heap sampler */
+#if !defined(LUAI_MAXALLOCSITES)
+#define LUAI_MAXALLOCSITES	1024
+#endif
+
+
+/*
+** An allocation site found by the heap sampler: a line of a function
+** ('p' is NULL for allocations outside Lua functions, in functions
+** already collected, or when the table of sites is full)
+*/
+typedef struct AllocSite {
+  const Proto *p;
+  int line;
+  int next;  /* next site in the same hash chain (-1 ends it) */
+  lu_mem count;  /* estimated number of objects created */
+  lu_mem bytes;  /* estimated number of bytes allocated */
+} AllocSite;
+
+
 LUAI_FUNC l_noret luaG_typeerror (lua_State *L, const TValue *o,
                                                 const char *opname);
 LUAI_FUNC l_noret luaG_concaterror (lua_State *L, const TValue *p1,
@@ -34,6 +54,10 @@ LUAI_FUNC const char *luaG_addinfo (lua_State *L, const char *msg,
                                                   TString *src, int line);
 LUAI_FUNC l_noret luaG_errormsg (lua_State *L);
 LUAI_FUNC void luaG_traceexec (lua_State *L);
+LUAI_FUNC void luaG_sampleallocation (lua_State *L, size_t size);
+LUAI_FUNC void luaG_forgetproto (lua_State *L, const Proto *p);
+LUAI_FUNC void luaG_newallocsites (lua_State *L);
+LUAI_FUNC void luaG_freeallocsites (lua_State *L);
 
 
 #endif
@@ -48,36 +48,52 @@
 ** LUAI_THROW/LUAI_TRY define how Lua does exception handling. By
 ** default, Lua handles errors with exceptions when compiling as
 ** C++ code, with _longjmp/_setjmp when asked to use them, and with
-** longjmp/setjmp otherwise.
+** longjmp/setjmp otherwise. When compiling as C++, each state can
+** also choose long jumps instead of exceptions ('lua_seterrormode');
+** every handler records the mechanism it was set up with, so the
+** mode can change while handlers are active. LUAI_ERRMODE is the only
+** mechanism available when there is no choice.
 */
 #if !defined(LUAI_THROW)				/* { */
 
+#if defined(LUA_USE_POSIX)
+/* in POSIX, try _longjmp/_setjmp (more efficient) */
+#define l_longjmp(b)		_longjmp(b, 1)
+#define l_setjmp(b)		_setjmp(b)
+#else
+#define l_longjmp(b)		longjmp(b, 1)
+#define l_setjmp(b)		setjmp(b)
+#endif
+
 #if defined(__cplusplus) && !defined(LUA_USE_LONGJMP)	/* { */
 
-/* C++ exceptions */
-#define LUAI_THROW(L,c)		throw(c)
+/* C++ exceptions or long jumps, as chosen by the state */
+#define LUAI_THROW(L,c) \
+	{ if ((c)->jump) l_longjmp((c)->b); else throw(c); }
 #define LUAI_TRY(L,c,a) \
-	try { a } catch(...) { if ((c)->status == 0) (c)->status = -1; }
-#define luai_jmpbuf		int  /* dummy variable */
-
-#elif defined(LUA_USE_POSIX)				/* }{ */
-
-/* in POSIX, try _longjmp/_setjmp (more efficient) */
-#define LUAI_THROW(L,c)		_longjmp((c)->b, 1)
-#define LUAI_TRY(L,c,a)		if (_setjmp((c)->b) == 0) { a }
+	if (((c)->jump = (G(L)->errmode == LUA_ERRMODE_JUMP))) { \
+	  if (l_setjmp((c)->b) == 0) { a } } \
+	else { \
+	  try { a } catch(...) { if ((c)->status == 0) (c)->status = -1; } }
 #define luai_jmpbuf		jmp_buf
+#define LUAI_ERRMODES
 
 #else							/* }{ */
 
-/* ISO C handling with long jumps */
-#define LUAI_THROW(L,c)		longjmp((c)->b, 1)
-#define LUAI_TRY(L,c,a)		if (setjmp((c)->b) == 0) { a }
+/* long jumps */
+#define LUAI_THROW(L,c)		l_longjmp((c)->b)
+#define LUAI_TRY(L,c,a)		if (l_setjmp((c)->b) == 0) { a }
 #define luai_jmpbuf		jmp_buf
+#define LUAI_ERRMODE		LUA_ERRMODE_JUMP
 
 #endif							/* } */
 
 #endif							/* } */
 
+#if !defined(LUAI_ERRMODES) && !defined(LUAI_ERRMODE)
+#define LUAI_ERRMODE		(-1)  /* custom mechanism */
+#endif
+
 
 
 /* chain list of long jump buffers */
@@ -85,9 +101,28 @@ struct lua_longjmp {
   struct lua_longjmp *previous;
   luai_jmpbuf b;
   volatile int status;  /* error code */
+  int jump;  /* true if 'b' is a jump buffer (otherwise, an exception) */
 };
 
 
+/*
+** Select the mechanism used by error handlers created from now on.
+** Returns 1 if it is available.
+*/
+int luaD_seterrormode (lua_State *L, int mode) {
+#if defined(LUAI_ERRMODES)
+  if (mode == LUA_ERRMODE_THROW || mode == LUA_ERRMODE_JUMP) {
+    G(L)->errmode = cast_byte(mode);
+    return 1;
+  }
+  return 0;
+#else
+  UNUSED(L);
+  return (mode == LUAI_ERRMODE);
+#endif
+}
+
+
 static void seterrorobj (lua_State *L, int errcode, StkId oldtop) {
   switch (errcode) {
     case LUA_ERRMEM: {  /* memory error? */
@@ -179,7 +214,8 @@ void luaD_reallocstack (lua_State *L, int newsize) {
     setnilvalue(L->stack + lim); /* erase new segment */
   L->stacksize = newsize;
   L->stack_last = L->stack + newsize - EXTRA_STACK;
-  correctstack(L, oldstack);
+  if (L->stack != oldstack)  /* not resized in place? */
+    correctstack(L, oldstack);
 }
 
 
@@ -199,6 +235,7 @@ void luaD_growstack (lua_State *L, int n) {
     else
       luaD_reallocstack(L, newsize);
   }
+  L->idlecycles = 0;
 }
 
 
@@ -213,12 +250,24 @@ static int stackinuse (lua_State *L) {
 }
 
 
+/*
+** Called once per GC cycle. Unless recovering from a stack overflow, the
+** stack and the 'ci' list only shrink after LUAI_SHRINKDELAY cycles
+** without growing, so that code oscillating in call depth does not
+** reallocate them over and over.
+*/
 void luaD_shrinkstack (lua_State *L) {
   int inuse = stackinuse(L);
   int goodsize = inuse + (inuse / 8) + 2*EXTRA_STACK;
+  if (goodsize < L->minstacksize) goodsize = L->minstacksize;
   if (goodsize > LUAI_MAXSTACK) goodsize = LUAI_MAXSTACK;
   if (L->stacksize > LUAI_MAXSTACK)  /* was handling stack overflow? */
     luaE_freeCI(L);  /* free all CIs (list grew because of an error) */
+  else if (L->idlecycles < LUAI_SHRINKDELAY) {  /* grew recently? */
+    L->idlecycles++;
+    condmovestack(L);  /* don't change stack (change only for debugging) */
+    return;
+  }
   else
     luaE_shrinkCI(L);  /* shrink list */
   if (inuse > LUAI_MAXSTACK ||  /* still handling stack overflow? */
@@ -305,9 +354,6 @@ static void tryfuncTM (lua_State *L, StkId func) {
 
 
 
-#define next_ci(L) (L->ci = (L->ci->next ? L->ci->next : luaE_extendCI(L)))
-
-
 /*
 ** returns true if function has been executed (C function)
 */
@@ -318,6 +364,7 @@ int luaD_precall (lua_State *L, StkId func, int nresults) {
   ptrdiff_t funcr = savestack(L, func);
   switch (ttype(func)) {
     case LUA_TLCF:  /* light C function */
+    case LUA_TFCF:  /* fast light C function (called here with hooks on) */
       f = fvalue(func);
       goto Cfunc;
     case LUA_TCCL: {  /* C closure */
@@ -14,6 +14,7 @@
 
 #include "lua.h"
 
+#include "ldebug.h"
 #include "lfunc.h"
 #include "lgc.h"
 #include "lmem.h"
@@ -123,13 +124,15 @@ Proto *luaF_newproto (lua_State *L) {
 
 
 void luaF_freeproto (lua_State *L, Proto *f) {
+  if (G(L)->nallocsites > 0)
+    luaG_forgetproto(L, f);
   luaM_freearray(L, f->code, f->sizecode);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
-  luaM_free(L, f);
+  luaM_freegcobject(L, f, sizeof(Proto));
 }
 
 
@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <stdio.h>
 #include <string.h>
 
 #include "lua.h"
@@ -59,6 +60,54 @@
 #define PAUSEADJ		100
 
 
+/*
+** fraction of the allowed heap overhead that the pacer plans to use
+** during a cycle; the rest is a safety margin for its estimates
+*/
+#define PACERSLACK		0.9
+
+/* maximum step multiplier the pacer may choose */
+#define MAXPACEDMUL		100000
+
+
+/* step multiplier in use (chosen by the pacer when it is active) */
+#define getstepmul(g)	((g)->gctarget > 0 ? (g)->gcpacedmul : (g)->gcstepmul)
+
+
+/*
+** bytes in free blocks of the pool, which total bytes count (as they
+** count whole chunks) but which are not in use; 'GCestimate' and the
+** pacer measure memory in use
+*/
+#if defined(LUAI_GCPOOL)
+#define gcpoolfree(g)	((g)->pool.nfree)
+#else
+#define gcpoolfree(g)	0
+#endif
+
+#define gcinuse(g)	(gettotalbytes(g) - gcpoolfree(g))
+
+
+/*
+** a monotonic clock, in microseconds, used by the pacer to measure
+** the speed of the collector. Only differences between readings are
+** used, so it may wrap around.
+*/
+#if !defined(luai_gcclock)
+#include <time.h>
+#if defined(LUA_USE_POSIX) && defined(CLOCK_MONOTONIC)
+static lu_mem luai_gcclock (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(lu_mem, ts.tv_sec) * 1000000u + cast(lu_mem, ts.tv_nsec / 1000);
+}
+#else
+#define luai_gcclock()  \
+	cast(lu_mem, cast_num(clock()) * (1000000.0 / CLOCKS_PER_SEC))
+#endif
+#endif
+
+
 /*
 ** 'makewhite' erases all color bits then sets only the current white
 ** bit
@@ -72,8 +121,13 @@
 
 
 #define valiswhite(x)   (iscollectable(x) && iswhite(gcvalue(x)))
+#define keyiswhite(n)   (keyiscollectable(n) && iswhite(gckey(n)))
+
+#define checkdeadkey(n)	lua_assert(!keyisdead(n) || ttisnil(gval(n)))
 
-#define checkdeadkey(n)	lua_assert(!ttisdeadkey(gkey(n)) || ttisnil(gval(n)))
+/* collectable object in a value or key, or NULL */
+#define gcvalueN(o)     (iscollectable(o) ? gcvalue(o) : NULL)
+#define gckeyN(n)	(keyiscollectable(n) ? gckey(n) : NULL)
 
 
 #define checkconsistency(obj)  \
@@ -83,6 +137,8 @@
 #define markvalue(g,o) { checkconsistency(o); \
   if (valiswhite(o)) reallymarkobject(g,gcvalue(o)); }
 
+#define markkey(g,n)	{ if (keyiswhite(n)) reallymarkobject(g,gckey(n)); }
+
 #define markobject(g,t)	{ if (iswhite(t)) reallymarkobject(g, obj2gco(t)); }
 
 /*
@@ -92,6 +148,8 @@
 #define markobjectN(g,t)	{ if (t) markobject(g,t); }
 
 static void reallymarkobject (global_State *g, GCObject *o);
+static void keymarked (global_State *g, GCObject *o);
+static void addephpair (global_State *g, GCObject *k, GCObject *v);
 
 
 /*
@@ -119,8 +177,8 @@ static void reallymarkobject (global_State *g, GCObject *o);
 */
 static void removeentry (Node *n) {
   lua_assert(ttisnil(gval(n)));
-  if (valiswhite(gkey(n)))
-    setdeadvalue(wgkey(n));  /* unused and unmarked key; remove it */
+  if (keyiswhite(n))
+    setdeadkey(n);  /* unused and unmarked key; remove it */
 }
 
 
@@ -131,13 +189,13 @@ static void removeentry (Node *n) {
 ** other objects: if really collected, cannot keep them; for objects
 ** being finalized, keep them in keys, but not in values
 */
-static int iscleared (global_State *g, const TValue *o) {
-  if (!iscollectable(o)) return 0;
-  else if (ttisstring(o)) {
-    markobject(g, tsvalue(o));  /* strings are 'values', so are never weak */
+static int iscleared (global_State *g, GCObject *o) {
+  if (o == NULL) return 0;  /* non-collectable value */
+  else if (novariant(o->tt) == LUA_TSTRING) {
+    markobject(g, o);  /* strings are 'values', so are never weak */
     return 0;
   }
-  else return iswhite(gcvalue(o));
+  else return iswhite(o);
 }
 
 
@@ -202,11 +260,13 @@ void luaC_fix (lua_State *L, GCObject *o) {
 */
 GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
   global_State *g = G(L);
-  GCObject *o = cast(GCObject *, luaM_newobject(L, novariant(tt), sz));
+  GCObject *o = cast(GCObject *, luaM_newgcobject(L, novariant(tt), sz));
   o->marked = luaC_white(g);
   o->tt = tt;
   o->next = g->allgc;
   g->allgc = o;
+  if (g->gcsample > 0 && --g->gcsamplecount <= 0)  /* time to sample? */
+    luaG_sampleallocation(L, sz);
   return o;
 }
 
@@ -230,6 +290,8 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 static void reallymarkobject (global_State *g, GCObject *o) {
  reentry:
   white2gray(o);
+  if (testbit(o->marked, EPHKEYBIT))  /* key of pending ephemeron entries? */
+    keymarked(g, o);
   switch (o->tt) {
     case LUA_TSHRSTR: {
       gray2black(o);
@@ -341,12 +403,106 @@ static void restartcollection (global_State *g) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** Edges of objects
+** =======================================================
+*/
+
+/*
+** The references held by tables, prototypes, closures, and threads are
+** walked by the macros below, shared by the collector and by heap
+** snapshots. Each walk takes the state 'c' of its user (the global
+** state when marking) and the macros to apply to what it finds:
+** 'V(c,v,l)' for a value 'v' and 'O(c,o,l)' for an object 'o' that
+** can be NULL, where 'l' is the label of the edge in snapshots. The
+** collector's visitors ignore labels, so labels are not even computed
+** while marking.
+*/
+
+/* visitors used by the collector */
+#define markedge(g,v,l)		markvalue(g,v)
+#define markedgeN(g,o,l)	markobjectN(g,o)
+
+
+/*
+** Table: 'A(c,v,i)' is applied to each slot 'v' (with index 'i') of
+** the array part, 'E(c,n)' to each entry 'n' of the hash part holding
+** a value, and 'D(c,n)' to each empty entry. (The metatable is left to
+** the caller.)
+*/
+#define tableedges(c,h,A,E,D)  { \
+	unsigned int i_; Node *n_, *limit_ = gnodelast(h); \
+	for (i_ = 0; i_ < (h)->sizearray; i_++) A(c, &(h)->array[i_], i_); \
+	for (n_ = gnode(h, 0); n_ < limit_; n_++) { \
+	  if (ttisnil(gval(n_))) { D(c, n_); } else { E(c, n_); } } }
+
+
+/*
+** Prototype. (While a prototype is being build, its arrays can be
+** larger than needed; the extra slots are filled with NULL.)
+*/
+#define protoedges(c,f,V,O)  { int i_; \
+	O(c, (f)->source, "source"); \
+	for (i_ = 0; i_ < (f)->sizek; i_++) \
+	  V(c, &(f)->k[i_], "constant"); \
+	for (i_ = 0; i_ < (f)->sizeupvalues; i_++) \
+	  O(c, (f)->upvalues[i_].name, "(debug info)"); \
+	for (i_ = 0; i_ < (f)->sizep; i_++) \
+	  O(c, (f)->p[i_], "proto"); \
+	for (i_ = 0; i_ < (f)->sizelocvars; i_++) \
+	  O(c, (f)->locvars[i_].varname, "(debug info)"); }
+
+
+/* C closure: its upvalues */
+#define cclosureedges(c,cl,V)  { int i_; \
+	for (i_ = 0; i_ < (cl)->nupvalues; i_++) \
+	  V(c, &(cl)->upvalue[i_], "upvalue"); }
+
+
+/* Lua closure: 'U(c,cl,i)' is applied to each upvalue 'i' in use */
+#define lclosureedges(c,cl,O,U)  { int i_; \
+	O(c, (cl)->p, "proto"); \
+	for (i_ = 0; i_ < (cl)->nupvalues; i_++) \
+	  if ((cl)->upvals[i_] != NULL) U(c, cl, i_); }
+
+
+/* thread: the live part of its stack */
+#define threadedges(c,th,V)  { StkId o_; \
+	for (o_ = (th)->stack; o_ < (th)->top; o_++) \
+	  V(c, o_, slotlabel(c, th, o_)); }
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** Traverse functions
 ** =======================================================
 */
 
+/* remove an empty entry from a table being traversed */
+#define clearentry(g,n)		{ checkdeadkey(n); removeentry(n); }
+
+#define skiparray(g,v,i)	((void)0)
+
+#define markarray(g,v,i)	markvalue(g,v)
+
+#define markentry(g,n)  { checkdeadkey(n); \
+	lua_assert(!keyisnil(n)); \
+	markkey(g, n); markvalue(g, gval(n)); }
+
+
+/*
+** mark the key of an entry of a table with weak values; set 'hasclears'
+** if its value is white
+*/
+#define weakvalueentry(g,n)  { checkdeadkey(n); \
+	lua_assert(!keyisnil(n)); \
+	markkey(g, n); \
+	if (!hasclears && iscleared(g, gcvalueN(gval(n)))) hasclears = 1; }
+
+
 /*
 ** Traverse a table with weak values and link it to proper list. During
 ** propagate phase, keep it in 'grayagain' list, to be revisited in the
@@ -354,21 +510,10 @@ static void restartcollection (global_State *g) {
 ** put it in 'weak' list, to be cleared.
 */
 static void traverseweakvalue (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
   /* if there is array part, assume it may have white values (it is not
      worth traversing it now just to check) */
   int hasclears = (h->sizearray > 0);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      if (!hasclears && iscleared(g, gval(n)))  /* is there a white value? */
-        hasclears = 1;  /* table will have to be cleared */
-    }
-  }
+  tableedges(g, h, skiparray, weakvalueentry, clearentry);
   if (g->gcstate == GCSpropagate)
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
   else if (hasclears)
@@ -376,6 +521,27 @@ static void traverseweakvalue (global_State *g, Table *h) {
 }
 
 
+/* mark a white value of an ephemeron table, setting 'marked' */
+#define ephemeronarray(g,v,i)  \
+	{ if (valiswhite(v)) { marked = 1; reallymarkobject(g, gcvalue(v)); } }
+
+/*
+** entry of an ephemeron table: mark its value if the key is marked;
+** otherwise, set 'hasclears' and, if the value is also white, 'hasww'
+** (recording the pair when converging)
+*/
+#define ephemeronentry(g,n)  { checkdeadkey(n); \
+	if (iscleared(g, gckeyN(n))) {  /* key is not marked (yet)? */ \
+	  hasclears = 1;  /* table must be cleared */ \
+	  if (valiswhite(gval(n))) {  /* value not marked yet? */ \
+	    hasww = 1;  /* white-white entry */ \
+	    if (g->ephdeps)  /* converging? */ \
+	      addephpair(g, gckey(n), gcvalue(gval(n))); \
+	  } \
+	} \
+	else ephemeronarray(g, gval(n), 0); }
+
+
 /*
 ** Traverse an ephemeron table and link it to proper list. Returns true
 ** iff any object was marked during this traversal (which implies that
@@ -390,30 +556,7 @@ static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
   int hasclears = 0;  /* true if table has white keys */
   int hasww = 0;  /* true if table has entry "white-key -> white-value" */
-  Node *n, *limit = gnodelast(h);
-  unsigned int i;
-  /* traverse array part */
-  for (i = 0; i < h->sizearray; i++) {
-    if (valiswhite(&h->array[i])) {
-      marked = 1;
-      reallymarkobject(g, gcvalue(&h->array[i]));
-    }
-  }
-  /* traverse hash part */
-  for (n = gnode(h, 0); n < limit; n++) {
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else if (iscleared(g, gkey(n))) {  /* key is not marked (yet)? */
-      hasclears = 1;  /* table must be cleared */
-      if (valiswhite(gval(n)))  /* value not marked yet? */
-        hasww = 1;  /* white-white entry */
-    }
-    else if (valiswhite(gval(n))) {  /* value not marked yet? */
-      marked = 1;
-      reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
-    }
-  }
+  tableedges(g, h, ephemeronarray, ephemeronentry, clearentry);
   /* link table into proper list */
   if (g->gcstate == GCSpropagate)
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
@@ -426,35 +569,37 @@ static int traverseephemeron (global_State *g, Table *h) {
 
 
 static void traversestrongtable (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
-  unsigned int i;
-  for (i = 0; i < h->sizearray; i++)  /* traverse array part */
-    markvalue(g, &h->array[i]);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    checkdeadkey(n);
-    if (ttisnil(gval(n)))  /* entry is empty? */
-      removeentry(n);  /* remove it */
-    else {
-      lua_assert(!ttisnil(gkey(n)));
-      markvalue(g, gkey(n));  /* mark key */
-      markvalue(g, gval(n));  /* mark value */
-    }
+  tableedges(g, h, markarray, markentry, clearentry);
+}
+
+
+/*
+** Weakness of a table, given by the '__mode' field of its metatable:
+** a combination of WEAKKEY and WEAKVALUE (0 for a strong table). Used
+** by both the collector and heap snapshots.
+*/
+#define WEAKKEY		1
+#define WEAKVALUE	2
+
+static int weakmode (global_State *g, Table *h) {
+  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  int wm = 0;
+  if (mode && ttisstring(mode)) {
+    if (strchr(svalue(mode), 'k')) wm |= WEAKKEY;
+    if (strchr(svalue(mode), 'v')) wm |= WEAKVALUE;
   }
+  return wm;
 }
 
 
 static lu_mem traversetable (global_State *g, Table *h) {
-  const char *weakkey, *weakvalue;
-  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  int wm = weakmode(g, h);
   markobjectN(g, h->metatable);
-  if (mode && ttisstring(mode) &&  /* is there a weak mode? */
-      ((weakkey = strchr(svalue(mode), 'k')),
-       (weakvalue = strchr(svalue(mode), 'v')),
-       (weakkey || weakvalue))) {  /* is really weak? */
+  if (wm != 0) {  /* is really weak? */
     black2gray(h);  /* keep table gray */
-    if (!weakkey)  /* strong keys? */
+    if (!(wm & WEAKKEY))  /* strong keys? */
       traverseweakvalue(g, h);
-    else if (!weakvalue)  /* strong values? */
+    else if (!(wm & WEAKVALUE))  /* strong values? */
       traverseephemeron(g, h);
     else  /* all weak */
       linkgclist(h, g->allweak);  /* nothing to traverse now */
@@ -466,24 +611,8 @@ static lu_mem traversetable (global_State *g, Table *h) {
 }
 
 
-/*
-** Traverse a prototype. (While a prototype is being build, its
-** arrays can be larger than needed; the extra slots are filled with
-** NULL, so the use of 'markobjectN')
-*/
-static int traverseproto (global_State *g, Proto *f) {
-  int i;
-  if (f->cache && iswhite(f->cache))
-    f->cache = NULL;  /* allow cache to be collected */
-  markobjectN(g, f->source);
-  for (i = 0; i < f->sizek; i++)  /* mark literals */
-    markvalue(g, &f->k[i]);
-  for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
-    markobjectN(g, f->upvalues[i].name);
-  for (i = 0; i < f->sizep; i++)  /* mark nested protos */
-    markobjectN(g, f->p[i]);
-  for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
-    markobjectN(g, f->locvars[i].varname);
+/* memory used by a prototype and its arrays */
+static size_t protosize (Proto *f) {
   return sizeof(Proto) + sizeof(Instruction) * f->sizecode +
                          sizeof(Proto *) * f->sizep +
                          sizeof(TValue) * f->sizek +
@@ -493,46 +622,51 @@ static int traverseproto (global_State *g, Proto *f) {
 }
 
 
+/*
+** Traverse a prototype, letting its cache be collected.
+*/
+static int traverseproto (global_State *g, Proto *f) {
+  if (f->cache && iswhite(f->cache))
+    f->cache = NULL;  /* allow cache to be collected */
+  protoedges(g, f, markedge, markedgeN);
+  return protosize(f);
+}
+
+
 static lu_mem traverseCclosure (global_State *g, CClosure *cl) {
-  int i;
-  for (i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
-    markvalue(g, &cl->upvalue[i]);
+  cclosureedges(g, cl, markedge);
   return sizeCclosure(cl->nupvalues);
 }
 
+
 /*
 ** open upvalues point to values in a thread, so those values should
 ** be marked when the thread is traversed except in the atomic phase
 ** (because then the value cannot be changed by the thread and the
 ** thread may not be traversed again)
 */
+#define markupval(g,cl,i)  { UpVal *uv = (cl)->upvals[i]; \
+	if (upisopen(uv) && g->gcstate != GCSinsideatomic) \
+	  uv->u.open.touched = 1;  /* can be marked in 'remarkupvals' */ \
+	else \
+	  markvalue(g, uv->v); }
+
 static lu_mem traverseLclosure (global_State *g, LClosure *cl) {
-  int i;
-  markobjectN(g, cl->p);  /* mark its prototype */
-  for (i = 0; i < cl->nupvalues; i++) {  /* mark its upvalues */
-    UpVal *uv = cl->upvals[i];
-    if (uv != NULL) {
-      if (upisopen(uv) && g->gcstate != GCSinsideatomic)
-        uv->u.open.touched = 1;  /* can be marked in 'remarkupvals' */
-      else
-        markvalue(g, uv->v);
-    }
-  }
+  lclosureedges(g, cl, markedgeN, markupval);
   return sizeLclosure(cl->nupvalues);
 }
 
 
 static lu_mem traversethread (global_State *g, lua_State *th) {
-  StkId o = th->stack;
-  if (o == NULL)
+  StkId o;
+  if (th->stack == NULL)
     return 1;  /* stack not completely built yet */
   lua_assert(g->gcstate == GCSinsideatomic ||
              th->openupval == NULL || isintwups(th));
-  for (; o < th->top; o++)  /* mark live elements in the stack */
-    markvalue(g, o);
+  threadedges(g, th, markedge);  /* mark live elements in the stack */
   if (g->gcstate == GCSinsideatomic) {  /* final traversal? */
     StkId lim = th->stack + th->stacksize;  /* real end of stack */
-    for (; o < lim; o++)  /* clear not-marked stack slice */
+    for (o = th->top; o < lim; o++)  /* clear not-marked stack slice */
       setnilvalue(o);
     /* 'remarkupvals' may have removed thread from 'twups' list */ 
     if (!isintwups(th) && th->openupval != NULL) {
@@ -599,7 +733,150 @@ static void propagateall (global_State *g) {
 }
 
 
-static void convergeephemerons (global_State *g) {
+/*
+** Convergence of ephemerons. Instead of traversing all ephemeron tables
+** again and again until nothing changes (which is quadratic for chains
+** of ephemerons), each table is traversed once and every white-white
+** entry is recorded as a dependency "key -> value", indexed by key. Keys
+** with pending dependencies have EPHKEYBIT set; when one of them is
+** marked, 'reallymarkobject' queues it in 'ready' and its values are
+** marked in turn. So, each entry is visited a bounded number of times.
+** If memory for this bookkeeping cannot be allocated, the collector
+** falls back to the simple fixed-point iteration.
+*/
+
+typedef struct EphPair {
+  GCObject *key;
+  GCObject *value;
+  size_t next;  /* next pair with the same key (+1; 0 ends the chain) */
+} EphPair;
+
+
+struct EphemeronDeps {
+  EphPair *pairs;
+  size_t npairs;
+  size_t szpairs;
+  size_t *slots;  /* hash of keys: index (+1) of last pair for a key */
+  size_t nkeys;
+  size_t szslots;  /* always a power of 2 */
+  GCObject **ready;  /* marked keys whose values must be marked */
+  size_t nready;
+  size_t szready;
+  int failed;  /* true if some allocation failed */
+};
+
+
+#define ephslot(d,k)	(((point2uint(k) >> 4) * 2654435761u) & ((d)->szslots - 1))
+
+
+/*
+** (Re)allocate a bookkeeping array with the raw allocation function:
+** the collector cannot run (or raise errors) here. Returns NULL on
+** failure, keeping the old block.
+*/
+static void *ephrealloc (global_State *g, void *block, size_t osize,
+                                                       size_t nsize) {
+  void *newblock = (*g->frealloc)(g->ud, block, osize, nsize);
+  return (newblock == NULL && nsize > 0) ? NULL : newblock;
+}
+
+
+static int growephslots (global_State *g, EphemeronDeps *d) {
+  size_t i;
+  size_t oldsize = d->szslots;
+  size_t *old = d->slots;
+  size_t newsize = (oldsize == 0) ? 64 : oldsize * 2;
+  size_t *slots = cast(size_t *, ephrealloc(g, NULL, 0,
+                                            newsize * sizeof(size_t)));
+  if (slots == NULL) return 0;
+  for (i = 0; i < newsize; i++) slots[i] = 0;
+  d->slots = slots;
+  d->szslots = newsize;
+  for (i = 0; i < oldsize; i++) {  /* reinsert old chains */
+    if (old[i] != 0) {
+      size_t j = ephslot(d, d->pairs[old[i] - 1].key);
+      while (slots[j] != 0) j = (j + 1) & (newsize - 1);
+      slots[j] = old[i];
+    }
+  }
+  ephrealloc(g, old, oldsize * sizeof(size_t), 0);
+  return 1;
+}
+
+
+/*
+** find the slot for key 'k' (either holding its chain or empty)
+*/
+static size_t *findephslot (EphemeronDeps *d, GCObject *k) {
+  size_t j = ephslot(d, k);
+  while (d->slots[j] != 0 && d->pairs[d->slots[j] - 1].key != k)
+    j = (j + 1) & (d->szslots - 1);
+  return &d->slots[j];
+}
+
+
+static void addephpair (global_State *g, GCObject *k, GCObject *v) {
+  EphemeronDeps *d = g->ephdeps;
+  size_t *slot;
+  if (d->failed) return;
+  if (d->npairs == d->szpairs) {  /* grow pair array */
+    size_t newsize = (d->szpairs == 0) ? 64 : d->szpairs * 2;
+    EphPair *p = cast(EphPair *, ephrealloc(g, d->pairs,
+                     d->szpairs * sizeof(EphPair), newsize * sizeof(EphPair)));
+    if (p == NULL) { d->failed = 1; return; }
+    d->pairs = p;
+    d->szpairs = newsize;
+  }
+  if (2 * (d->nkeys + 1) > d->szslots && !growephslots(g, d)) {
+    d->failed = 1;
+    return;
+  }
+  slot = findephslot(d, k);
+  if (*slot == 0) d->nkeys++;  /* new key */
+  d->pairs[d->npairs].key = k;
+  d->pairs[d->npairs].value = v;
+  d->pairs[d->npairs].next = *slot;
+  *slot = ++d->npairs;
+  l_setbit(k->marked, EPHKEYBIT);
+}
+
+
+/*
+** key 'o' with pending ephemeron entries was marked; queue it so that
+** its values get marked too
+*/
+static void keymarked (global_State *g, GCObject *o) {
+  EphemeronDeps *d = g->ephdeps;
+  resetbit(o->marked, EPHKEYBIT);
+  lua_assert(d != NULL);
+  if (d->failed) return;  /* tables are still in 'ephemeron' list */
+  if (d->nready == d->szready) {
+    size_t newsize = (d->szready == 0) ? 64 : d->szready * 2;
+    GCObject **r = cast(GCObject **, ephrealloc(g, d->ready,
+               d->szready * sizeof(GCObject *), newsize * sizeof(GCObject *)));
+    if (r == NULL) { d->failed = 1; return; }
+    d->ready = r;
+    d->szready = newsize;
+  }
+  d->ready[d->nready++] = o;
+}
+
+
+static void freeephdeps (global_State *g, EphemeronDeps *d) {
+  size_t i;
+  for (i = 0; i < d->npairs; i++)  /* clear marks of still pending keys */
+    resetbit(d->pairs[i].key->marked, EPHKEYBIT);
+  ephrealloc(g, d->pairs, d->szpairs * sizeof(EphPair), 0);
+  ephrealloc(g, d->slots, d->szslots * sizeof(size_t), 0);
+  ephrealloc(g, d->ready, d->szready * sizeof(GCObject *), 0);
+}
+
+
+/*
+** Simple fixed-point iteration: traverse all ephemeron tables until
+** no more values are marked.
+*/
+static void iterateephemerons (global_State *g) {
   int changed;
   do {
     GCObject *w;
@@ -616,6 +893,33 @@ static void convergeephemerons (global_State *g) {
   } while (changed);
 }
 
+
+static void convergeephemerons (global_State *g) {
+  EphemeronDeps d;
+  GCObject *w;
+  GCObject *next = g->ephemeron;  /* get ephemeron list */
+  memset(&d, 0, sizeof(d));
+  g->ephemeron = NULL;  /* tables return to this list when traversed */
+  g->ephdeps = &d;
+  while ((w = next) != NULL) {  /* traverse each table once */
+    next = gco2t(w)->gclist;
+    traverseephemeron(g, gco2t(w));
+  }
+  for (;;) {
+    GCObject *k;
+    size_t p;
+    propagateall(g);  /* may mark keys and find new ephemeron tables */
+    if (d.failed || d.nready == 0) break;
+    k = d.ready[--d.nready];
+    for (p = *findephslot(&d, k); p != 0; p = d.pairs[p - 1].next)
+      markobject(g, d.pairs[p - 1].value);
+  }
+  g->ephdeps = NULL;
+  freeephdeps(g, &d);
+  if (d.failed)
+    iterateephemerons(g);
+}
+
 /* }====================================================== */
 
 
@@ -635,7 +939,7 @@ static void clearkeys (global_State *g, GCObject *l, GCObject *f) {
     Table *h = gco2t(l);
     Node *n, *limit = gnodelast(h);
     for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && (iscleared(g, gkey(n)))) {
+      if (!ttisnil(gval(n)) && (iscleared(g, gckeyN(n)))) {
         setnilvalue(gval(n));  /* remove value ... */
         removeentry(n);  /* and remove entry from table */
       }
@@ -655,11 +959,11 @@ static void clearvalues (global_State *g, GCObject *l, GCObject *f) {
     unsigned int i;
     for (i = 0; i < h->sizearray; i++) {
       TValue *o = &h->array[i];
-      if (iscleared(g, o))  /* value was collected? */
+      if (iscleared(g, gcvalueN(o)))  /* value was collected? */
         setnilvalue(o);  /* remove value */
     }
     for (n = gnode(h, 0); n < limit; n++) {
-      if (!ttisnil(gval(n)) && iscleared(g, gval(n))) {
+      if (!ttisnil(gval(n)) && iscleared(g, gcvalueN(gval(n)))) {
         setnilvalue(gval(n));  /* remove value ... */
         removeentry(n);  /* and remove entry from table */
       }
@@ -683,7 +987,7 @@ static void freeLclosure (lua_State *L, LClosure *cl) {
     if (uv)
       luaC_upvdeccount(L, uv);
   }
-  luaM_freemem(L, cl, sizeLclosure(cl->nupvalues));
+  luaM_freegcobject(L, cl, sizeLclosure(cl->nupvalues));
 }
 
 
@@ -695,18 +999,18 @@ static void freeobj (lua_State *L, GCObject *o) {
       break;
     }
     case LUA_TCCL: {
-      luaM_freemem(L, o, sizeCclosure(gco2ccl(o)->nupvalues));
+      luaM_freegcobject(L, o, sizeCclosure(gco2ccl(o)->nupvalues));
       break;
     }
     case LUA_TTABLE: luaH_free(L, gco2t(o)); break;
     case LUA_TTHREAD: luaE_freethread(L, gco2th(o)); break;
-    case LUA_TUSERDATA: luaM_freemem(L, o, sizeudata(gco2u(o))); break;
+    case LUA_TUSERDATA: luaM_freegcobject(L, o, sizeudata(gco2u(o))); break;
     case LUA_TSHRSTR:
       luaS_remove(L, gco2ts(o));  /* remove it from hash table */
-      luaM_freemem(L, o, sizelstring(gco2ts(o)->shrlen));
+      luaM_freegcobject(L, o, sizelstring(gco2ts(o)->shrlen));
       break;
     case LUA_TLNGSTR: {
-      luaM_freemem(L, o, sizelstring(gco2ts(o)->u.lnglen));
+      luaM_freegcobject(L, o, sizelstring(gco2ts(o)->u.lnglen));
       break;
     }
     default: lua_assert(0);
@@ -834,11 +1138,14 @@ static void GCTM (lua_State *L, int propagateerrors) {
 
 
 /*
-** call a few (up to 'g->gcfinnum') finalizers
+** call a few (up to 'g->gcfinnum') finalizers, unless finalizers are
+** deferred to explicit calls to 'luaC_runfinalizers'
 */
 static int runafewfinalizers (lua_State *L) {
   global_State *g = G(L);
   unsigned int i;
+  if (g->gcdeferfin)
+    return 0;
   lua_assert(!g->tobefnz || g->gcfinnum > 0);
   for (i = 0; g->tobefnz && i < g->gcfinnum; i++)
     GCTM(L, 1);  /* call one finalizer */
@@ -858,6 +1165,19 @@ static void callallpendingfinalizers (lua_State *L, int propagateerrors) {
 }
 
 
+/*
+** call up to 'max' pending finalizers (all of them if 'max' <= 0).
+** Returns how many were called.
+*/
+int luaC_runfinalizers (lua_State *L, int max) {
+  global_State *g = G(L);
+  int i;
+  for (i = 0; g->tobefnz && (max <= 0 || i < max); i++)
+    GCTM(L, 1);  /* call one finalizer */
+  return i;
+}
+
+
 /*
 ** find last 'next' field in list 'p' list (to add elements in its end)
 */
@@ -919,6 +1239,481 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 
 
 
+/*
+** {======================================================
+** Heap statistics
+** =======================================================
+*/
+
+
+#define addstat(hs,k,b)	((hs)->count[k]++, (hs)->bytes[k] += (b))
+
+
+static size_t threadsize (lua_State *th) {
+  CallInfo *ci;
+  size_t size = LUA_EXTRASPACE + sizeof(lua_State) +
+                sizeof(TValue) * th->stacksize;
+  for (ci = th->base_ci.next; ci != NULL; ci = ci->next)
+    size += sizeof(CallInfo);
+  return size;
+}
+
+
+static void countobject (lua_HeapStats *hs, GCObject *o) {
+  switch (o->tt) {
+    case LUA_TSHRSTR:
+      addstat(hs, LUA_HSSHRSTR, sizelstring(gco2ts(o)->shrlen));
+      break;
+    case LUA_TLNGSTR:
+      addstat(hs, LUA_HSLNGSTR, sizelstring(gco2ts(o)->u.lnglen));
+      break;
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      addstat(hs, LUA_HSTABLE, sizeof(Table));
+      if (h->sizearray > 0)
+        addstat(hs, LUA_HSTABARRAY, sizeof(TValue) * h->sizearray);
+      if (!luaH_isdummy(h->node))
+        addstat(hs, LUA_HSTABHASH, sizeof(Node) * cast(size_t, sizenode(h)));
+      break;
+    }
+    case LUA_TLCL:
+      addstat(hs, LUA_HSLCL, sizeLclosure(gco2lcl(o)->nupvalues));
+      break;
+    case LUA_TCCL:
+      addstat(hs, LUA_HSCCL, sizeCclosure(gco2ccl(o)->nupvalues));
+      break;
+    case LUA_TPROTO:
+      addstat(hs, LUA_HSPROTO, protosize(gco2p(o)));
+      break;
+    case LUA_TUSERDATA:
+      addstat(hs, LUA_HSUDATA, sizeudata(gco2u(o)));
+      break;
+    case LUA_TTHREAD:
+      addstat(hs, LUA_HSTHREAD, threadsize(gco2th(o)));
+      break;
+    default: lua_assert(0);
+  }
+}
+
+
+static void countlist (lua_HeapStats *hs, GCObject *o) {
+  for (; o != NULL; o = o->next)
+    countobject(hs, o);
+}
+
+
+/*
+** Collect statistics about all objects in the heap, including garbage
+** not yet collected.
+*/
+void luaC_heapstats (lua_State *L, lua_HeapStats *hs) {
+  global_State *g = G(L);
+  memset(hs, 0, sizeof(*hs));
+  countobject(hs, obj2gco(g->mainthread));
+  countlist(hs, g->allgc);
+  countlist(hs, g->finobj);
+  countlist(hs, g->tobefnz);
+  countlist(hs, g->fixedgc);
+#if defined(LUAI_GCPOOL)
+  hs->poolbytes = luaM_poolsize(L);
+#endif
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Heap snapshots
+** =======================================================
+*/
+
+/*
+** A snapshot lists every object reachable from the roots through
+** strong references, with its size and its outgoing edges. Format
+** (all integers little endian):
+**   header: LUA_SNAPSHOTSIG version(1 byte)
+**   root:   'R' label id
+**   object: 'O' type(1) id(8) size(8) description nedges(4) {id label}
+** where 'id' is the object address in 8 bytes and strings ('label',
+** 'description') are a 2-byte length followed by their bytes. The
+** whole snapshot is built in a private buffer (not accounted in the
+** Lua heap, so that building it cannot trigger a collection) and
+** handed to the writer at the end.
+*/
+
+#define SNAPSHOTVERSION	1
+#define MAXSNAPLABEL	64	/* maximum length for labels */
+
+typedef struct SnapState {
+  global_State *g;
+  char *buff;  /* output */
+  size_t n, size;
+  GCObject **seen;  /* hash set with objects already queued */
+  size_t nseen, sizeseen;
+  GCObject **stack;  /* objects queued but not yet written */
+  size_t nstack, sizestack;
+  size_t nedges;  /* number of edges of current object */
+  int wm;  /* weakness of the table being walked */
+  CallInfo *ci;  /* frame of the stack slot being walked */
+  char label[MAXSNAPLABEL + 50];  /* buffer for edge labels */
+  int status;
+} SnapState;
+
+
+static void *snaprealloc (SnapState *ss, void *block, size_t osize,
+                                                      size_t nsize) {
+  void *nb = (*ss->g->frealloc)(ss->g->ud, block, osize, nsize);
+  if (nb == NULL && nsize > 0)
+    ss->status = LUA_ERRMEM;
+  return nb;
+}
+
+
+static void snapbytes (SnapState *ss, const void *b, size_t size) {
+  if (ss->status != LUA_OK) return;
+  if (ss->n + size > ss->size) {
+    size_t nsize = (ss->size == 0) ? 1024 : ss->size * 2;
+    char *nb;
+    while (nsize < ss->n + size) nsize *= 2;
+    nb = cast(char *, snaprealloc(ss, ss->buff, ss->size, nsize));
+    if (nb == NULL) return;
+    ss->buff = nb;
+    ss->size = nsize;
+  }
+  memcpy(ss->buff + ss->n, b, size);
+  ss->n += size;
+}
+
+
+static void snapint (SnapState *ss, size_t x, int size) {
+  char b[8];
+  int i;
+  for (i = 0; i < size; i++) {
+    b[i] = cast(char, x & 0xff);
+    x >>= 8;
+  }
+  snapbytes(ss, b, size);
+}
+
+
+static void snaplabel (SnapState *ss, const char *s, size_t l) {
+  if (l > MAXSNAPLABEL) l = MAXSNAPLABEL;
+  snapint(ss, l, 2);
+  snapbytes(ss, s, l);
+}
+
+
+#define snapid(ss,o)	snapint(ss, cast(size_t, o), 8)
+
+#define snaphash(o,size)  ((cast(size_t, o) >> 4) & ((size) - 1))
+
+
+static void seeninsert (GCObject **seen, size_t size, GCObject *o) {
+  size_t i = snaphash(o, size);
+  while (seen[i] != NULL)
+    i = (i + 1) & (size - 1);
+  seen[i] = o;
+}
+
+
+/*
+** Add 'o' to the set of seen objects; return true if it was not there
+** (so that it must be queued).
+*/
+static int markseen (SnapState *ss, GCObject *o) {
+  size_t i;
+  if (2 * (ss->nseen + 1) > ss->sizeseen) {  /* keep load below 1/2 */
+    size_t nsize = (ss->sizeseen == 0) ? 256 : ss->sizeseen * 2;
+    GCObject **ns = cast(GCObject **,
+                         snaprealloc(ss, NULL, 0, nsize * sizeof(GCObject *)));
+    if (ns == NULL) return 0;
+    memset(ns, 0, nsize * sizeof(GCObject *));
+    for (i = 0; i < ss->sizeseen; i++) {
+      if (ss->seen[i] != NULL)
+        seeninsert(ns, nsize, ss->seen[i]);
+    }
+    snaprealloc(ss, ss->seen, ss->sizeseen * sizeof(GCObject *), 0);
+    ss->seen = ns;
+    ss->sizeseen = nsize;
+  }
+  for (i = snaphash(o, ss->sizeseen); ss->seen[i] != NULL;
+       i = (i + 1) & (ss->sizeseen - 1)) {
+    if (ss->seen[i] == o) return 0;
+  }
+  ss->seen[i] = o;
+  ss->nseen++;
+  return 1;
+}
+
+
+static void queueobject (SnapState *ss, GCObject *o) {
+  if (ss->status != LUA_OK || !markseen(ss, o)) return;
+  if (ss->nstack == ss->sizestack) {
+    size_t nsize = (ss->sizestack == 0) ? 64 : ss->sizestack * 2;
+    GCObject **ns = cast(GCObject **,
+        snaprealloc(ss, ss->stack, ss->sizestack * sizeof(GCObject *),
+                                   nsize * sizeof(GCObject *)));
+    if (ns == NULL) return;
+    ss->stack = ns;
+    ss->sizestack = nsize;
+  }
+  ss->stack[ss->nstack++] = o;
+}
+
+
+static void snapedge (SnapState *ss, GCObject *o, const char *label) {
+  if (o == NULL) return;
+  snapid(ss, o);
+  snaplabel(ss, label, strlen(label));
+  ss->nedges++;
+  queueobject(ss, o);
+}
+
+
+/* visitors used by snapshots ('l' is only computed for real edges) */
+#define snapvalue(ss,v,l)  \
+	{ if (iscollectable(v)) snapedge(ss, gcvalue(v), l); }
+
+#define snapobjectN(ss,o,l)	{ if (o) snapedge(ss, obj2gco(o), l); }
+
+
+static void snaproot (SnapState *ss, GCObject *o, const char *label) {
+  if (o == NULL) return;
+  snapbytes(ss, "R", 1);
+  snaplabel(ss, label, strlen(label));
+  snapid(ss, o);
+  queueobject(ss, o);
+}
+
+
+/*
+** Label for a table entry with key 'key': the key itself if it is a
+** string, its value between brackets for other non-collectable keys,
+** and its type between brackets for other keys.
+*/
+static const char *keylabel (const TValue *key, char *buff) {
+  if (ttisstring(key)) {
+    TString *ts = tsvalue(key);
+    size_t l = tsslen(ts);
+    if (l > MAXSNAPLABEL) l = MAXSNAPLABEL;
+    memcpy(buff, getstr(ts), l);
+    buff[l] = '\0';
+  }
+  else if (ttisinteger(key))
+    sprintf(buff, "[" LUA_INTEGER_FMT "]", ivalue(key));
+  else if (ttisfloat(key))
+    sprintf(buff, "[" LUA_NUMBER_FMT "]", fltvalue(key));
+  else if (ttisboolean(key))
+    strcpy(buff, bvalue(key) ? "[true]" : "[false]");
+  else
+    sprintf(buff, "[%s]", objtypename(key));
+  return buff;
+}
+
+
+static const char *arraylabel (SnapState *ss, unsigned int i) {
+  sprintf(ss->label, "[%u]", i + 1);
+  return ss->label;
+}
+
+
+static const char *upvallabel (SnapState *ss, LClosure *cl, int i) {
+  TString *name = (cl->p != NULL && i < cl->p->sizeupvalues)
+                  ? cl->p->upvalues[i].name : NULL;
+  if (name == NULL)
+    return "upvalue";
+  sprintf(ss->label, "upvalue %.*s", MAXSNAPLABEL, getstr(name));
+  return ss->label;
+}
+
+
+/*
+** Label stack slot 'o' with the name of the local variable it holds,
+** when that information is available. Slots are visited in order, so
+** 'ss->ci' (the frame of the previous slot) only moves forward.
+*/
+static const char *slotlabel (SnapState *ss, lua_State *th, StkId o) {
+  CallInfo *ci = ss->ci;
+  while (ci != th->ci && o >= ci->next->func)
+    ci = ci->next;
+  ss->ci = ci;
+  if (o == ci->func && ci != &th->base_ci)
+    return "(function)";
+  else if (!isLua(ci))
+    return "(C stack)";
+  else if (o < ci->u.l.base)
+    return "(vararg)";
+  else {
+    Proto *p = clLvalue(ci->func)->p;
+    const char *name = luaF_getlocalname(p, cast_int(o - ci->u.l.base) + 1,
+                                         pcRel(ci->u.l.savedpc, p));
+    if (name == NULL)
+      return "(temporary)";
+    sprintf(ss->label, "local %.*s", MAXSNAPLABEL, name);
+    return ss->label;
+  }
+}
+
+
+/*
+** Weak references are not edges: they do not keep objects alive. As a
+** simplification, values in ephemeron tables are treated as strong.
+*/
+#define snaparray(ss,v,i)  \
+	{ if (!((ss)->wm & WEAKVALUE)) snapvalue(ss, v, arraylabel(ss, i)); }
+
+static void snapentry (SnapState *ss, Node *n) {
+  TValue key;
+  getnodekey(ss->g->mainthread, &key, n);
+  if (!(ss->wm & WEAKKEY))
+    snapvalue(ss, &key, "(key)");
+  if (!(ss->wm & WEAKVALUE))
+    snapvalue(ss, gval(n), keylabel(&key, ss->label));
+}
+
+#define snapempty(ss,n)		((void)0)
+
+
+static void snaptable (SnapState *ss, Table *h) {
+  ss->wm = weakmode(ss->g, h);
+  snapobjectN(ss, h->metatable, "metatable");
+  tableedges(ss, h, snaparray, snapentry, snapempty);
+}
+
+
+/* the label of each upvalue is its name, when known */
+#define snapupval(ss,cl,i)  \
+	snapvalue(ss, (cl)->upvals[i]->v, upvallabel(ss, cl, i))
+
+
+static void snapthread (SnapState *ss, lua_State *th) {
+  if (th->stack == NULL)
+    return;  /* stack not completely built yet */
+  ss->ci = &th->base_ci;
+  threadedges(ss, th, snapvalue);
+}
+
+
+/*
+** Description of an object: the contents of strings (truncated) and
+** where a function was defined.
+*/
+static void snapdescription (SnapState *ss, GCObject *o) {
+  char buff[MAXSNAPLABEL + 50];
+  Proto *p = NULL;
+  switch (o->tt) {
+    case LUA_TSHRSTR: case LUA_TLNGSTR:
+      snaplabel(ss, getstr(gco2ts(o)), tsslen(gco2ts(o)));
+      return;
+    case LUA_TLCL: p = gco2lcl(o)->p; break;
+    case LUA_TPROTO: p = gco2p(o); break;
+    default: break;
+  }
+  if (p != NULL && p->source != NULL) {
+    sprintf(buff, "%.*s:%d", MAXSNAPLABEL, getstr(p->source),
+                             p->linedefined);
+    snaplabel(ss, buff, strlen(buff));
+  }
+  else
+    snaplabel(ss, "", 0);
+}
+
+
+static void snapobject (SnapState *ss, GCObject *o) {
+  size_t size = 0, countpos;
+  snapbytes(ss, "O", 1);
+  snapint(ss, novariant(o->tt), 1);
+  snapid(ss, o);
+  switch (o->tt) {
+    case LUA_TSHRSTR: size = sizelstring(gco2ts(o)->shrlen); break;
+    case LUA_TLNGSTR: size = sizelstring(gco2ts(o)->u.lnglen); break;
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      size = sizeof(Table) + sizeof(TValue) * h->sizearray;
+      if (!luaH_isdummy(h->node))
+        size += sizeof(Node) * cast(size_t, sizenode(h));
+      break;
+    }
+    case LUA_TLCL: size = sizeLclosure(gco2lcl(o)->nupvalues); break;
+    case LUA_TCCL: size = sizeCclosure(gco2ccl(o)->nupvalues); break;
+    case LUA_TPROTO: size = protosize(gco2p(o)); break;
+    case LUA_TUSERDATA: size = sizeudata(gco2u(o)); break;
+    case LUA_TTHREAD: size = threadsize(gco2th(o)); break;
+    default: lua_assert(0);
+  }
+  snapint(ss, size, 8);
+  snapdescription(ss, o);
+  countpos = ss->n;
+  snapint(ss, 0, 4);  /* number of edges (patched below) */
+  ss->nedges = 0;
+  switch (o->tt) {
+    case LUA_TTABLE: snaptable(ss, gco2t(o)); break;
+    case LUA_TLCL: lclosureedges(ss, gco2lcl(o), snapobjectN, snapupval); break;
+    case LUA_TCCL: cclosureedges(ss, gco2ccl(o), snapvalue); break;
+    case LUA_TPROTO: protoedges(ss, gco2p(o), snapvalue, snapobjectN); break;
+    case LUA_TUSERDATA: {
+      Udata *u = gco2u(o);
+      TValue uvalue;
+      snapobjectN(ss, u->metatable, "metatable");
+      getuservalue(ss->g->mainthread, u, &uvalue);
+      snapvalue(ss, &uvalue, "uservalue");
+      break;
+    }
+    case LUA_TTHREAD: snapthread(ss, gco2th(o)); break;
+    default: break;  /* strings have no references */
+  }
+  if (ss->status == LUA_OK) {  /* patch number of edges */
+    size_t i, x = ss->nedges;
+    for (i = 0; i < 4; i++, x >>= 8)
+      ss->buff[countpos + i] = cast(char, x & 0xff);
+  }
+}
+
+
+int luaC_heapsnapshot (lua_State *L, lua_Writer writer, void *data) {
+  global_State *g = G(L);
+  SnapState ss;
+  GCObject *o;
+  int i;
+  memset(&ss, 0, sizeof(ss));
+  ss.g = g;
+  ss.status = LUA_OK;
+  snapbytes(&ss, LUA_SNAPSHOTSIG, sizeof(LUA_SNAPSHOTSIG) - 1);
+  snapint(&ss, SNAPSHOTVERSION, 1);
+  /* globals first, so that paths through them are preferred */
+  snaproot(&ss, gcvalue(luaH_getint(hvalue(&g->l_registry),
+                                    LUA_RIDX_GLOBALS)), "globals");
+  snaproot(&ss, gcvalue(&g->l_registry), "registry");
+  snaproot(&ss, obj2gco(g->mainthread), "mainthread");
+  if (L != g->mainthread)
+    snaproot(&ss, obj2gco(L), "running thread");
+  for (i = 0; i < LUA_NUMTAGS; i++) {
+    if (g->mt[i] != NULL) {
+      char buff[50];
+      sprintf(buff, "metatable(%s)", ttypename(i));
+      snaproot(&ss, obj2gco(g->mt[i]), buff);
+    }
+  }
+  for (o = g->tobefnz; o != NULL; o = o->next)
+    snaproot(&ss, o, "(being finalized)");
+  while (ss.nstack > 0 && ss.status == LUA_OK)
+    snapobject(&ss, ss.stack[--ss.nstack]);
+  snaprealloc(&ss, ss.stack, ss.sizestack * sizeof(GCObject *), 0);
+  snaprealloc(&ss, ss.seen, ss.sizeseen * sizeof(GCObject *), 0);
+  if (ss.status == LUA_OK) {
+    lua_unlock(L);
+    ss.status = (*writer)(L, ss.buff, ss.n, data);
+    lua_lock(L);
+  }
+  snaprealloc(&ss, ss.buff, ss.size, 0);
+  return ss.status;
+}
+
+/* }====================================================== */
+
+
+
 /*
 ** {======================================================
 ** GC control
@@ -926,6 +1721,33 @@ void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt) {
 */
 
 
+/*
+** Threshold used by the pacer: with 'gctarget' set, memory use should
+** stay below 'estimate * (1 + gctarget/100)'. The growth of the heap
+** during a cycle is inversely proportional to the step multiplier
+** ('gcallocfactor', measured in previous cycles, is that growth per
+** live byte times the multiplier), so the pacer starts the cycle as
+** late as possible with the configured multiplier and only increases
+** the multiplier when even starting right now would not fit.
+*/
+static l_mem pacedthreshold (global_State *g) {
+  lua_Number live = cast_num(g->GCestimate);
+  lua_Number allowed = live / 100 * g->gctarget * PACERSLACK;
+  lua_Number mul = cast_num(g->gcstepmul);
+  lua_Number growth = g->gcallocfactor * live / mul;
+  lua_Number threshold;
+  if (growth > allowed) {  /* cannot fit with configured multiplier? */
+    mul = g->gcallocfactor * live / allowed;
+    if (mul > MAXPACEDMUL) mul = MAXPACEDMUL;
+    growth = g->gcallocfactor * live / mul;
+  }
+  g->gcpacedmul = cast_int(mul);
+  threshold = live + allowed - growth;
+  if (threshold < live) threshold = live;  /* start as soon as possible */
+  return (threshold < cast_num(MAX_LMEM)) ? cast(l_mem, threshold) : MAX_LMEM;
+}
+
+
 /*
 ** Set a reasonable "time" to wait before starting a new GC cycle; cycle
 ** will start when memory use hits threshold. (Division by 'estimate'
@@ -936,14 +1758,51 @@ static void setpause (global_State *g) {
   l_mem threshold, debt;
   l_mem estimate = g->GCestimate / PAUSEADJ;  /* adjust 'estimate' */
   lua_assert(estimate > 0);
-  threshold = (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
-            ? estimate * g->gcpause  /* no overflow */
-            : MAX_LMEM;  /* overflow; truncate to maximum */
+  if (g->gctarget > 0)
+    threshold = pacedthreshold(g);
+  else
+    threshold = (g->gcpause < MAX_LMEM / estimate)  /* overflow? */
+              ? estimate * g->gcpause  /* no overflow */
+              : MAX_LMEM;  /* overflow; truncate to maximum */
   debt = gettotalbytes(g) - threshold;
   luaE_setdebt(g, debt);
 }
 
 
+/*
+** Called at the end of an incremental cycle: update the pacer's
+** estimate of how much the heap grows during a cycle.
+*/
+static void measurecycle (global_State *g) {
+  if (g->GCpeak > g->GCcyclestart && g->GCestimate > 0) {
+    lua_Number growth = cast_num(g->GCpeak - g->GCcyclestart);
+    lua_Number f = growth / cast_num(g->GCestimate) * getstepmul(g);
+    g->gcallocfactor = (g->gcallocfactor + f) / 2;
+  }
+}
+
+
+/*
+** Update the pacer's estimate of the collector speed after a step that
+** did 'work' units in 'elapsed' microseconds, and resize the basic step
+** so that it takes about 'gctargetpause' microseconds.
+*/
+static void measurestep (global_State *g, lu_mem work, lu_mem elapsed) {
+  lua_Number size;
+  if (elapsed == 0 || work == 0)
+    return;  /* too little to measure */
+  if (g->gcthroughput == 0)
+    g->gcthroughput = cast_num(work) / cast_num(elapsed);
+  else
+    g->gcthroughput = (g->gcthroughput * 3 +
+                       cast_num(work) / cast_num(elapsed)) / 4;
+  size = g->gcthroughput * g->gctargetpause;
+  if (size < GCSTEPSIZE / 16) size = GCSTEPSIZE / 16;
+  else if (size > cast_num(MAX_LMEM / 2)) size = cast_num(MAX_LMEM / 2);
+  g->GCstepsize = cast(l_mem, size);
+}
+
+
 /*
 ** Enter first sweep phase.
 ** The call to 'sweeptolive' makes pointer point to an object inside
@@ -1028,8 +1887,10 @@ static lu_mem sweepstep (lua_State *L, global_State *g,
                          int nextstate, GCObject **nextlist) {
   if (g->sweepgc) {
     l_mem olddebt = g->GCdebt;
+    lu_mem oldfree = gcpoolfree(g);
     g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
+    g->GCestimate -= gcpoolfree(g) - oldfree;  /* (blocks freed to the pool) */
     if (g->sweepgc)  /* is there still something to sweep? */
       return (GCSWEEPMAX * GCSWEEPCOST);
   }
@@ -1045,6 +1906,7 @@ static lu_mem singlestep (lua_State *L) {
   switch (g->gcstate) {
     case GCSpause: {
       g->GCmemtrav = g->strt.size * sizeof(GCObject*);
+      g->GCcyclestart = g->GCpeak = gcinuse(g);
       restartcollection(g);
       g->gcstate = GCSpropagate;
       return g->GCmemtrav;
@@ -1063,7 +1925,7 @@ static lu_mem singlestep (lua_State *L) {
       propagateall(g);  /* make sure gray list is empty */
       work = atomic(L);  /* work is what was traversed by 'atomic' */
       sw = entersweep(L);
-      g->GCestimate = gettotalbytes(g);  /* first estimate */;
+      g->GCestimate = gcinuse(g);  /* first estimate */;
       return work + sw * GCSWEEPCOST;
     }
     case GCSswpallgc: {  /* sweep "regular" objects */
@@ -1082,11 +1944,14 @@ static lu_mem singlestep (lua_State *L) {
       return 0;
     }
     case GCScallfin: {  /* call remaining finalizers */
-      if (g->tobefnz && g->gckind != KGC_EMERGENCY) {
+      if (g->tobefnz && g->gckind != KGC_EMERGENCY && !g->gcdeferfin) {
         int n = runafewfinalizers(L);
         return (n * GCFINALIZECOST);
       }
       else {  /* emergency mode or no more finalizers */
+#if defined(LUAI_GCPOOL)
+        luaM_poolshrink(L);  /* give back chunks emptied by the sweep */
+#endif
         g->gcstate = GCSpause;  /* finish collection */
         return 0;
       }
@@ -1113,33 +1978,95 @@ void luaC_runtilstate (lua_State *L, int statesmask) {
 */
 static l_mem getdebt (global_State *g) {
   l_mem debt = g->GCdebt;
-  int stepmul = g->gcstepmul;
+  int stepmul = getstepmul(g);
   debt = (debt / STEPMULADJ) + 1;
   debt = (debt < MAX_LMEM / stepmul) ? debt * stepmul : MAX_LMEM;
   return debt;
 }
 
 /*
-** performs a basic GC step when collector is running
+** Common tail of 'luaC_step' and 'luaC_idle': feed the pacer with the
+** 'total' work done since 'start', then either set the pause (if the
+** cycle is over) or convert the remaining 'debt' back to bytes and run
+** some pending finalizers.
+*/
+static void finishstep (lua_State *L, l_mem debt, lu_mem total,
+                        lu_mem start) {
+  global_State *g = G(L);
+  if (g->gctargetpause > 0)
+    measurestep(g, total, luai_gcclock() - start);
+  if (g->gcstate == GCSpause) {
+    measurecycle(g);
+    setpause(g);  /* pause until next cycle */
+  }
+  else {
+    debt = (debt / getstepmul(g)) * STEPMULADJ;  /* convert 'work units' to Kb */
+    luaE_setdebt(g, debt);
+    runafewfinalizers(L);
+  }
+}
+
+
+/*
+** performs a basic GC step when collector is running. With a time
+** slice set ('gcslice'), the step stops when the slice is over, even if
+** the debt was not paid; the remaining debt makes the next step start
+** at the next check. (The atomic phase is indivisible and may still
+** exceed the slice.)
 */
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
   l_mem debt = getdebt(g);  /* GC deficit (be paid now) */
+  lu_mem start = 0;
+  lu_mem total = 0;  /* work done in this step */
   if (!g->gcrunning) {  /* not running? */
     luaE_setdebt(g, -GCSTEPSIZE * 10);  /* avoid being called too often */
     return;
   }
+  if (gcinuse(g) > g->GCpeak)
+    g->GCpeak = gcinuse(g);
+  if (g->gctargetpause > 0 || g->gcslice > 0)
+    start = luai_gcclock();
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
-  } while (debt > -GCSTEPSIZE && g->gcstate != GCSpause);
-  if (g->gcstate == GCSpause)
-    setpause(g);  /* pause until next cycle */
-  else {
-    debt = (debt / g->gcstepmul) * STEPMULADJ;  /* convert 'work units' to Kb */
-    luaE_setdebt(g, debt);
-    runafewfinalizers(L);
-  }
+    total += work;
+    if (g->gcslice > 0 && luai_gcclock() - start >= cast(lu_mem, g->gcslice))
+      break;  /* time slice is over */
+  } while (debt > -g->GCstepsize && g->gcstate != GCSpause);
+  finishstep(L, debt, total, start);
+}
+
+
+/*
+** Does as much collection work as fits in 'usec' microseconds, to be
+** called when the host is idle. Work done here is credited against the
+** GC debt, so it delays the next allocation-triggered steps. When the
+** collector is paused, a new cycle starts only if memory was allocated
+** since the previous one; when it is stopped, nothing is done. Returns
+** 1 if it finished a cycle.
+*/
+int luaC_idle (lua_State *L, int usec) {
+  global_State *g = G(L);
+  l_mem debt;
+  lu_mem start;
+  lu_mem total = 0;
+  if (!g->gcrunning)  /* collector stopped? */
+    return 0;
+  if (g->gcstate == GCSpause && gcinuse(g) <= g->GCestimate)
+    return 0;  /* nothing new to collect */
+  debt = getdebt(g);
+  if (gcinuse(g) > g->GCpeak)
+    g->GCpeak = gcinuse(g);
+  start = luai_gcclock();
+  do {
+    lu_mem work = singlestep(L);
+    debt -= work;
+    total += work;
+  } while (g->gcstate != GCSpause &&
+           luai_gcclock() - start < cast(lu_mem, usec));
+  finishstep(L, debt, total, start);
+  return (g->gcstate == GCSpause);
 }
 
 
@@ -1164,7 +2091,7 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   luaC_runtilstate(L, ~bitmask(GCSpause));  /* start new collection */
   luaC_runtilstate(L, bitmask(GCScallfin));  /* run up to finalizers */
   /* estimate must be correct after a full GC cycle */
-  lua_assert(g->GCestimate == gettotalbytes(g));
+  lua_assert(g->GCestimate == gcinuse(g));
   luaC_runtilstate(L, bitmask(GCSpause));  /* finish collection */
   g->gckind = KGC_NORMAL;
   setpause(g);
@@ -79,6 +79,7 @@
 #define WHITE1BIT	1  /* object is white (type 1) */
 #define BLACKBIT	2  /* object is black */
 #define FINALIZEDBIT	3  /* object has been marked for finalization */
+#define EPHKEYBIT	4  /* object is key of a pending ephemeron entry */
 /* bit 7 is currently used by tests (luaL_checkmemory) */
 
 #define WHITEBITS	bit2mask(WHITE0BIT, WHITE1BIT)
@@ -125,6 +126,10 @@
 LUAI_FUNC void luaC_fix (lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_freeallobjects (lua_State *L);
 LUAI_FUNC void luaC_step (lua_State *L);
+LUAI_FUNC int luaC_idle (lua_State *L, int usec);
+LUAI_FUNC int luaC_runfinalizers (lua_State *L, int max);
+LUAI_FUNC void luaC_heapstats (lua_State *L, lua_HeapStats *hs);
+LUAI_FUNC int luaC_heapsnapshot (lua_State *L, lua_Writer writer, void *data);
 LUAI_FUNC void luaC_runtilstate (lua_State *L, int statesmask);
 LUAI_FUNC void luaC_fullgc (lua_State *L, int isemergency);
 LUAI_FUNC GCObject *luaC_newobj (lua_State *L, int tt, size_t sz);
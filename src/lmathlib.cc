@@ -360,8 +360,6 @@ static const luaL_Reg mathlib[] = {
   {"fmod",   math_fmod},
   {"ult",   math_ult},
   {"log",   math_log},
-  {"max",   math_max},
-  {"min",   math_min},
   {"modf",   math_modf},
   {"rad",   math_rad},
   {"random",     math_random},
@@ -389,11 +387,23 @@ static const luaL_Reg mathlib[] = {
 };
 
 
+/* these compare with '<', which can call metamethods: not fast */
+static const luaL_Reg mathlib_cmp[] = {
+  {"max",   math_max},
+  {"min",   math_min},
+  {NULL, NULL}
+};
+
+
 /*
 ** Open math library
 */
 LUAMOD_API int luaopen_math (lua_State *L) {
-  luaL_newlib(L, mathlib);
+  luaL_checkversion(L);
+  lua_createtable(L, 0, sizeof(mathlib)/sizeof(mathlib[0]) +
+                        sizeof(mathlib_cmp)/sizeof(mathlib_cmp[0]) - 2);
+  luaL_setfastfuncs(L, mathlib);  /* none of them calls back into Lua */
+  luaL_setfuncs(L, mathlib_cmp, 0);
   lua_pushnumber(L, PI);
   lua_setfield(L, -2, "pi");
   lua_pushnumber(L, (lua_Number)HUGE_VAL);
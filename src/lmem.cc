@@ -11,6 +11,7 @@
 
 
 #include <stddef.h>
+#include <stdlib.h>
 
 #include "lua.h"
 
@@ -98,3 +99,230 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   return newblock;
 }
 
+
+
+#if defined(LUAI_GCPOOL)
+/*
+** {======================================================
+** Small-object pool
+** =======================================================
+*/
+
+/*
+** Small collectable objects are allocated by bumping a pointer inside
+** a large chunk and, once freed, kept in a free list per size class
+** to be reused by the next object of that class. At the end of each
+** collection cycle, chunks whose blocks are all free are returned to
+** 'frealloc'. Accounting ('GCdebt') is done by chunk: the collector
+** sees the memory the pool holds, and handing out or freeing a block
+** inside a chunk costs nothing. 'nfree' counts the bytes in free
+** blocks, so that the collector can tell the memory in use from the
+** memory held.
+*/
+
+
+/* size of each chunk requested from 'frealloc' */
+#if !defined(LUAI_GCPOOLCHUNK)
+#define LUAI_GCPOOLCHUNK	(16 * 1024)
+#endif
+
+
+/* header of each chunk; objects start right after it */
+typedef union PoolChunk {
+  struct {
+    union PoolChunk *previous;  /* list of all chunks */
+    char *end;  /* end of the part already handed out */
+    size_t nfree;  /* bytes in free blocks (used by 'luaM_poolshrink') */
+  } h;
+  L_Umaxalign dummy;  /* ensure maximum alignment for objects */
+} PoolChunk;
+
+
+#define CHUNKSIZE	(sizeof(PoolChunk) + LUAI_GCPOOLCHUNK)
+
+#define chunkstart(c)	cast(char *, (c) + 1)
+
+/* true if all blocks handed out from chunk 'c' are free */
+#define isemptychunk(c)  \
+	((c)->h.nfree == cast(size_t, (c)->h.end - chunkstart(c)))
+
+#define poolclass(s)	(((s) + GCPOOLGRAIN - 1) / GCPOOLGRAIN - 1)
+#define classsize(c)	(cast(size_t, (c) + 1) * GCPOOLGRAIN)
+
+
+/*
+** Start a new current chunk (the rest of the old one is lost). Returns
+** 0 if there is no memory for it.
+*/
+static int newchunk (global_State *g, GCPool *p) {
+  PoolChunk *c = cast(PoolChunk *, (*g->frealloc)(g->ud, NULL, 0, CHUNKSIZE));
+  if (c == NULL)
+    return 0;
+  if (p->top != NULL)  /* is there a current chunk? */
+    cast(PoolChunk *, p->chunks)->h.end = p->top;  /* close it */
+  c->h.previous = cast(PoolChunk *, p->chunks);
+  p->chunks = c;
+  p->top = chunkstart(c);
+  p->limit = p->top + LUAI_GCPOOLCHUNK;
+  g->GCdebt += CHUNKSIZE;
+  return 1;
+}
+
+
+void *luaM_poolalloc_ (lua_State *L, int tag, size_t size) {
+  global_State *g = G(L);
+  GCPool *p = &g->pool;
+  void *block;
+  int c;
+  if (size > LUAI_GCPOOLMAX)  /* too big for the pool? */
+    return luaM_newobject(L, tag, size);
+  c = poolclass(size);
+  if (p->freelist[c] == NULL &&
+      cast(size_t, p->limit - p->top) < classsize(c) && !newchunk(g, p)) {
+    if (g->version)  /* is state fully built? */
+      luaC_fullgc(L, 1);  /* try to free some memory... */
+    /* the collection may have freed a block of this class */
+    if (p->freelist[c] == NULL && !newchunk(g, p))
+      luaD_throw(L, LUA_ERRMEM);
+  }
+  block = p->freelist[c];
+  if (block != NULL) {  /* reuse a freed block */
+    p->freelist[c] = *cast(void **, block);
+    p->nfree -= classsize(c);
+  }
+  else {  /* bump pointer in current chunk */
+    block = p->top;
+    p->top += classsize(c);
+  }
+  return block;
+}
+
+
+void luaM_poolfree_ (lua_State *L, void *block, size_t size) {
+  global_State *g = G(L);
+  GCPool *p = &g->pool;
+  int c;
+  if (size > LUAI_GCPOOLMAX) {
+    luaM_freemem(L, block, size);
+    return;
+  }
+  c = poolclass(size);
+  *cast(void **, block) = p->freelist[c];
+  p->freelist[c] = block;
+  p->nfree += classsize(c);
+}
+
+
+static int cmpchunk (const void *a, const void *b) {
+  size_t ca = cast(size_t, *cast(PoolChunk *const *, a));
+  size_t cb = cast(size_t, *cast(PoolChunk *const *, b));
+  return (ca < cb) ? -1 : (ca > cb);
+}
+
+
+/* find the chunk containing 'block' in array 'v' sorted by address */
+static PoolChunk *findchunk (PoolChunk **v, size_t n, void *block) {
+  size_t lo = 0;
+  while (n - lo > 1) {  /* chunk is in [lo, n) */
+    size_t m = lo + (n - lo) / 2;
+    if (cast(size_t, v[m]) <= cast(size_t, block)) lo = m;
+    else n = m;
+  }
+  return v[lo];
+}
+
+
+/*
+** Give back to 'frealloc' all chunks without live objects. Called at
+** the end of each collection cycle, when the free lists have all blocks
+** released by the sweep. Free blocks are assigned to their chunks by a
+** binary search over the chunks sorted by address. (If there is no
+** memory for that array, nothing is released this time.)
+*/
+void luaM_poolshrink (lua_State *L) {
+  global_State *g = G(L);
+  GCPool *p = &g->pool;
+  PoolChunk *c = cast(PoolChunk *, p->chunks);
+  PoolChunk *kept = NULL;
+  PoolChunk **tail = &kept;
+  PoolChunk **v;
+  size_t n = 0;
+  int k;
+  for (; c != NULL; c = c->h.previous) {
+    c->h.nfree = 0;
+    n++;
+  }
+  if (n == 0 ||
+      (v = cast(PoolChunk **, (*g->frealloc)(g->ud, NULL, 0,
+                                             n * sizeof(*v)))) == NULL)
+    return;
+  if (p->top != NULL)  /* current chunk is still growing */
+    cast(PoolChunk *, p->chunks)->h.end = p->top;
+  n = 0;
+  for (c = cast(PoolChunk *, p->chunks); c != NULL; c = c->h.previous)
+    v[n++] = c;
+  qsort(v, n, sizeof(*v), cmpchunk);
+  for (k = 0; k < GCPOOLCLASSES; k++) {  /* count free bytes per chunk */
+    void *b;
+    for (b = p->freelist[k]; b != NULL; b = *cast(void **, b))
+      findchunk(v, n, b)->h.nfree += classsize(k);
+  }
+  for (k = 0; k < GCPOOLCLASSES; k++) {  /* unlink blocks of empty chunks */
+    void **pb = &p->freelist[k];
+    while (*pb != NULL) {
+      if (isemptychunk(findchunk(v, n, *pb)))
+        *pb = *cast(void **, *pb);  /* remove block from the list */
+      else
+        pb = cast(void **, *pb);
+    }
+  }
+  (*g->frealloc)(g->ud, v, n * sizeof(*v), 0);
+  c = cast(PoolChunk *, p->chunks);
+  while (c != NULL) {  /* free empty chunks, keeping the others in order */
+    PoolChunk *previous = c->h.previous;
+    if (isemptychunk(c)) {
+      if (c == p->chunks)  /* freeing the current chunk? */
+        p->top = p->limit = NULL;
+      p->nfree -= c->h.nfree;
+      (*g->frealloc)(g->ud, c, CHUNKSIZE, 0);
+      g->GCdebt -= CHUNKSIZE;
+    }
+    else {
+      *tail = c;
+      tail = &c->h.previous;
+    }
+    c = previous;
+  }
+  *tail = NULL;
+  p->chunks = kept;
+}
+
+
+/* memory held by the pool */
+lu_mem luaM_poolsize (lua_State *L) {
+  lu_mem n = 0;
+  PoolChunk *c;
+  for (c = cast(PoolChunk *, G(L)->pool.chunks); c != NULL; c = c->h.previous)
+    n += CHUNKSIZE;
+  return n;
+}
+
+
+/*
+** Free all chunks. Called when closing the state, after all objects
+** were freed.
+*/
+void luaM_poolclose (lua_State *L) {
+  global_State *g = G(L);
+  PoolChunk *c = cast(PoolChunk *, g->pool.chunks);
+  while (c != NULL) {
+    PoolChunk *previous = c->h.previous;
+    (*g->frealloc)(g->ud, c, CHUNKSIZE, 0);
+    g->GCdebt -= CHUNKSIZE;
+    c = previous;
+  }
+  g->pool.init();
+}
+
+/* }====================================================== */
+#endif
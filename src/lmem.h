@@ -49,6 +49,28 @@
 
 #define luaM_newobject(L,tag,s)	luaM_realloc_(L, NULL, tag, (s))
 
+
+/*
+** Collectable objects are created and freed through these macros. With
+** LUAI_GCPOOL defined, small objects come from a pool of size classes
+** carved out of large chunks (see lmem.c).
+*/
+#if defined(LUAI_GCPOOL)
+
+#if !defined(LUAI_GCPOOLMAX)
+#define LUAI_GCPOOLMAX	256	/* largest object served by the pool */
+#endif
+
+#define luaM_newgcobject(L,tag,s)	luaM_poolalloc_(L, tag, (s))
+#define luaM_freegcobject(L,b,s)	luaM_poolfree_(L, (b), (s))
+
+#else
+
+#define luaM_newgcobject(L,tag,s)	luaM_newobject(L,tag,s)
+#define luaM_freegcobject(L,b,s)	luaM_freemem(L,b,s)
+
+#endif
+
 #define luaM_growvector(L,v,nelems,size,t,limit,e) \
           if ((nelems)+1 > (size)) \
             ((v)=cast(t *, luaM_growaux_(L,v,&(size),sizeof(t),limit,e)))
@@ -64,6 +86,13 @@ LUAI_FUNC void *luaM_realloc_ (lua_State *L, void *block, size_t oldsize,
 LUAI_FUNC void *luaM_growaux_ (lua_State *L, void *block, int *size,
                                size_t size_elem, int limit,
                                const char *what);
+#if defined(LUAI_GCPOOL)
+LUAI_FUNC void *luaM_poolalloc_ (lua_State *L, int tag, size_t size);
+LUAI_FUNC void luaM_poolfree_ (lua_State *L, void *block, size_t size);
+LUAI_FUNC void luaM_poolshrink (lua_State *L);
+LUAI_FUNC lu_mem luaM_poolsize (lua_State *L);
+LUAI_FUNC void luaM_poolclose (lua_State *L);
+#endif
 
 #endif
 
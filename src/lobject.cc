@@ -10,6 +10,7 @@
 #include "lprefix.h"
 
 
+#include <float.h>
 #include <locale.h>
 #include <math.h>
 #include <stdarg.h>
@@ -33,6 +34,16 @@
 LUAI_DDEF const TValue luaO_nilobject_ = {NILCONSTANT};
 
 
+#if defined(LUA_NANTRICK)
+LUAI_DDEF const lu_byte luaO_nntag_[16] = {
+  LUA_TNIL, LUA_TBOOLEAN, LUA_TLIGHTUSERDATA, LUA_TNUMINT,
+  LUA_TDEADKEY, 0, LUA_TLCF, LUA_TFCF,
+  ctb(LUA_TSHRSTR), ctb(LUA_TLNGSTR), ctb(LUA_TTABLE), ctb(LUA_TUSERDATA),
+  ctb(LUA_TLCL), ctb(LUA_TCCL), ctb(LUA_TTHREAD), 0
+};
+#endif
+
+
 /*
 ** converts an integer to a "floating point byte", represented as
 ** (eeeeexxx), where the real value is (1xxx) * 2^(eeeee - 1) if
@@ -176,6 +187,169 @@ static int isneg (const char **s) {
 
 
 
+/*
+** {======================================================
+** Floats with 64-bit significands ("do-it-yourself" floats), used
+** to convert floats from and to strings without the C library. They
+** need IEEE doubles and a 64-bit 'lua_Unsigned' (for the arithmetic).
+** =======================================================
+*/
+
+#if !defined(l_fastfloat)
+#define l_fastfloat  (LUA_FLOAT_TYPE == LUA_FLOAT_DOUBLE && \
+                      (LUA_MAXINTEGER >> 31 >> 31) == 1)
+#endif
+
+#if l_fastfloat	/* { */
+
+typedef lua_Unsigned l_uint64;
+
+/* a "do-it-yourself" float: f * 2^e, with 64 bits of precision */
+typedef struct DiyFp {
+  l_uint64 f;
+  int e;
+} DiyFp;
+
+
+#define MASK32		((cast(l_uint64, 1) << 32) - 1)
+#define SIGNIFBITS	52  /* explicit bits in a double's significand */
+#define HIDDENBIT	(cast(l_uint64, 1) << SIGNIFBITS)
+#define EXPBIAS		(0x3FF + SIGNIFBITS)
+#define DENORMALEXP	(1 - EXPBIAS)
+
+/* range for the binary exponent of scaled values */
+#define MINTARGETEXP	(-60)
+#define MAXTARGETEXP	(-32)
+
+
+/*
+** Cached powers of ten: 10^k (for k = -348, -340, ..., 340), rounded
+** to 64 bits, as high and low halves of the significand and binary
+** and decimal exponents
+*/
+static const struct {
+  unsigned int fhi, flo;
+  short e, k;
+} pow10cache[] = {
+  {0xfa8fd5a0, 0x081c0288, -1220, -348},
+  {0xbaaee17f, 0xa23ebf76, -1193, -340},
+  {0x8b16fb20, 0x3055ac76, -1166, -332},
+  {0xcf42894a, 0x5dce35ea, -1140, -324},
+  {0x9a6bb0aa, 0x55653b2d, -1113, -316},
+  {0xe61acf03, 0x3d1a45df, -1087, -308},
+  {0xab70fe17, 0xc79ac6ca, -1060, -300},
+  {0xff77b1fc, 0xbebcdc4f, -1034, -292},
+  {0xbe5691ef, 0x416bd60c, -1007, -284},
+  {0x8dd01fad, 0x907ffc3c, -980, -276},
+  {0xd3515c28, 0x31559a83, -954, -268},
+  {0x9d71ac8f, 0xada6c9b5, -927, -260},
+  {0xea9c2277, 0x23ee8bcb, -901, -252},
+  {0xaecc4991, 0x4078536d, -874, -244},
+  {0x823c1279, 0x5db6ce57, -847, -236},
+  {0xc2109436, 0x4dfb5637, -821, -228},
+  {0x9096ea6f, 0x3848984f, -794, -220},
+  {0xd77485cb, 0x25823ac7, -768, -212},
+  {0xa086cfcd, 0x97bf97f4, -741, -204},
+  {0xef340a98, 0x172aace5, -715, -196},
+  {0xb23867fb, 0x2a35b28e, -688, -188},
+  {0x84c8d4df, 0xd2c63f3b, -661, -180},
+  {0xc5dd4427, 0x1ad3cdba, -635, -172},
+  {0x936b9fce, 0xbb25c996, -608, -164},
+  {0xdbac6c24, 0x7d62a584, -582, -156},
+  {0xa3ab6658, 0x0d5fdaf6, -555, -148},
+  {0xf3e2f893, 0xdec3f126, -529, -140},
+  {0xb5b5ada8, 0xaaff80b8, -502, -132},
+  {0x87625f05, 0x6c7c4a8b, -475, -124},
+  {0xc9bcff60, 0x34c13053, -449, -116},
+  {0x964e858c, 0x91ba2655, -422, -108},
+  {0xdff97724, 0x70297ebd, -396, -100},
+  {0xa6dfbd9f, 0xb8e5b88f, -369, -92},
+  {0xf8a95fcf, 0x88747d94, -343, -84},
+  {0xb9447093, 0x8fa89bcf, -316, -76},
+  {0x8a08f0f8, 0xbf0f156b, -289, -68},
+  {0xcdb02555, 0x653131b6, -263, -60},
+  {0x993fe2c6, 0xd07b7fac, -236, -52},
+  {0xe45c10c4, 0x2a2b3b06, -210, -44},
+  {0xaa242499, 0x697392d3, -183, -36},
+  {0xfd87b5f2, 0x8300ca0e, -157, -28},
+  {0xbce50864, 0x92111aeb, -130, -20},
+  {0x8cbccc09, 0x6f5088cc, -103, -12},
+  {0xd1b71758, 0xe219652c, -77, -4},
+  {0x9c400000, 0x00000000, -50, 4},
+  {0xe8d4a510, 0x00000000, -24, 12},
+  {0xad78ebc5, 0xac620000, 3, 20},
+  {0x813f3978, 0xf8940984, 30, 28},
+  {0xc097ce7b, 0xc90715b3, 56, 36},
+  {0x8f7e32ce, 0x7bea5c70, 83, 44},
+  {0xd5d238a4, 0xabe98068, 109, 52},
+  {0x9f4f2726, 0x179a2245, 136, 60},
+  {0xed63a231, 0xd4c4fb27, 162, 68},
+  {0xb0de6538, 0x8cc8ada8, 189, 76},
+  {0x83c7088e, 0x1aab65db, 216, 84},
+  {0xc45d1df9, 0x42711d9a, 242, 92},
+  {0x924d692c, 0xa61be758, 269, 100},
+  {0xda01ee64, 0x1a708dea, 295, 108},
+  {0xa26da399, 0x9aef774a, 322, 116},
+  {0xf209787b, 0xb47d6b85, 348, 124},
+  {0xb454e4a1, 0x79dd1877, 375, 132},
+  {0x865b8692, 0x5b9bc5c2, 402, 140},
+  {0xc83553c5, 0xc8965d3d, 428, 148},
+  {0x952ab45c, 0xfa97a0b3, 455, 156},
+  {0xde469fbd, 0x99a05fe3, 481, 164},
+  {0xa59bc234, 0xdb398c25, 508, 172},
+  {0xf6c69a72, 0xa3989f5c, 534, 180},
+  {0xb7dcbf53, 0x54e9bece, 561, 188},
+  {0x88fcf317, 0xf22241e2, 588, 196},
+  {0xcc20ce9b, 0xd35c78a5, 614, 204},
+  {0x98165af3, 0x7b2153df, 641, 212},
+  {0xe2a0b5dc, 0x971f303a, 667, 220},
+  {0xa8d9d153, 0x5ce3b396, 694, 228},
+  {0xfb9b7cd9, 0xa4a7443c, 720, 236},
+  {0xbb764c4c, 0xa7a44410, 747, 244},
+  {0x8bab8eef, 0xb6409c1a, 774, 252},
+  {0xd01fef10, 0xa657842c, 800, 260},
+  {0x9b10a4e5, 0xe9913129, 827, 268},
+  {0xe7109bfb, 0xa19c0c9d, 853, 276},
+  {0xac2820d9, 0x623bf429, 880, 284},
+  {0x80444b5e, 0x7aa7cf85, 907, 292},
+  {0xbf21e440, 0x03acdd2d, 933, 300},
+  {0x8e679c2f, 0x5e44ff8f, 960, 308},
+  {0xd433179d, 0x9c8cb841, 986, 316},
+  {0x9e19db92, 0xb4e31ba9, 1013, 324},
+  {0xeb96bf6e, 0xbadf77d9, 1039, 332},
+  {0xaf87023b, 0x9bf0ee6b, 1066, 340}
+};
+
+#define POW10FIRST	(-348)  /* decimal exponent of first cached power */
+#define POW10STEP	8  /* distance between cached powers */
+
+
+static DiyFp diymul (DiyFp x, DiyFp y) {
+  l_uint64 a = x.f >> 32, b = x.f & MASK32;
+  l_uint64 c = y.f >> 32, d = y.f & MASK32;
+  l_uint64 ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  l_uint64 tmp = (bd >> 32) + (ad & MASK32) + (bc & MASK32);
+  DiyFp r;
+  tmp += cast(l_uint64, 1) << 31;  /* round */
+  r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+
+static DiyFp diynormalize (DiyFp x) {
+  while (!(x.f & (cast(l_uint64, 1) << 63))) {
+    x.f <<= 1;
+    x.e--;
+  }
+  return x;
+}
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
 /*
 ** {==================================================================
 ** Lua's implementation for 'lua_strx2number'
@@ -245,20 +419,300 @@ static lua_Number lua_strx2number (const char *s, char **endptr) {
 /* }====================================================== */
 
 
+/*
+** {==================================================================
+** Conversion of decimal numerals to floats
+** ===================================================================
+*/
+
+#if l_fastfloat	/* { */
+
+/* maximum number of decimal digits that always fit in a 'l_uint64' */
+#define MAXUINT64DIGITS	19
+
+/*
+** limit for the decimal exponent and for the scale given by zeros and
+** dropped digits in 'l_str2dec'; numerals beyond it go to 'strtod'
+*/
+#define MAXDECSCALE	100000
+
+/* largest exponent of a double (for a DiyFp with a 53-bit 'f') */
+#define MAXDOUBLEEXP	(0x7FF - EXPBIAS)
+
+/* errors in 'diystrtod' are kept in units of 1/DENOMINATOR */
+#define DENOMLOG	3
+#define DENOMINATOR	(1 << DENOMLOG)
+
+
+/*
+** Clinger's fast path needs float operations done in double
+** precision (not in an extended one)
+*/
+#if !defined(l_clinger)
+#if defined(__FLT_EVAL_METHOD__)
+#define l_clinger	(__FLT_EVAL_METHOD__ == 0)
+#else
+#define l_clinger	1
+#endif
+#endif
+
+
+/* powers of ten that are exact doubles */
+static const double exactpow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#define MAXEXACTPOW10	22
+
+
+/* 10^1, ..., 10^7 as normalized DiyFps (their low halves are zero) */
+static const struct {
+  unsigned int fhi;
+  int e;
+} adjustpow10[] = {
+  {0xa0000000, -60}, {0xc8000000, -57}, {0xfa000000, -54},
+  {0x9c400000, -50}, {0xc3500000, -47}, {0xf4240000, -44},
+  {0x98968000, -40}
+};
+
+
+/* convert a DiyFp with at most 54 significant bits to a double */
+static double diy2double (DiyFp x) {
+  l_uint64 bits;
+  double d;
+  while (x.f > HIDDENBIT + (HIDDENBIT - 1)) {
+    x.f >>= 1;
+    x.e++;
+  }
+  if (x.e >= MAXDOUBLEEXP)
+    return HUGE_VAL;
+  if (x.e < DENORMALEXP)
+    return 0.0;
+  while (x.e > DENORMALEXP && (x.f & HIDDENBIT) == 0) {
+    x.f <<= 1;
+    x.e--;
+  }
+  bits = x.f & (HIDDENBIT - 1);
+  if (x.f & HIDDENBIT)  /* not a denormal? */
+    bits |= cast(l_uint64, x.e + EXPBIAS) << SIGNIFBITS;
+  memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+
+/*
+** Compute 'w' * 10^'q' ('w' has 'nd' digits and an error of half a
+** unit if 'inexact') with DiyFps, tracking the error of each step
+** (as in the double-conversion library). Returns false if the error
+** does not allow a correct rounding.
+*/
+static int diystrtod (l_uint64 w, int nd, int q, int inexact,
+                      double *result) {
+  l_uint64 error = (inexact) ? DENOMINATOR / 2 : 0;
+  l_uint64 mask, precbits, halfway;
+  DiyFp input, c;
+  int i, olde, magnitude, sigsize, precdigits;
+  input.f = w;
+  input.e = 0;
+  input = diynormalize(input);
+  error <<= -input.e;
+  i = (q - POW10FIRST) / POW10STEP;  /* cached power not above 10^q */
+  c.f = (cast(l_uint64, pow10cache[i].fhi) << 32) | pow10cache[i].flo;
+  c.e = pow10cache[i].e;
+  if (pow10cache[i].k != q) {  /* must multiply by the rest of 10^q? */
+    DiyFp adj;
+    int a = q - pow10cache[i].k;
+    adj.f = cast(l_uint64, adjustpow10[a - 1].fhi) << 32;
+    adj.e = adjustpow10[a - 1].e;
+    input = diymul(input, adj);
+    if (nd + a > MAXUINT64DIGITS)  /* product did not fit in 64 bits? */
+      error += DENOMINATOR / 2;
+  }
+  input = diymul(input, c);
+  /* error from the cached power, from their product, and from rounding */
+  error += DENOMINATOR / 2 + (error != 0) + DENOMINATOR / 2;
+  olde = input.e;
+  input = diynormalize(input);
+  error <<= olde - input.e;
+  /* number of significant bits the result will have */
+  magnitude = 64 + input.e;
+  if (magnitude >= DENORMALEXP + SIGNIFBITS + 1)
+    sigsize = SIGNIFBITS + 1;
+  else if (magnitude <= DENORMALEXP)
+    sigsize = 0;
+  else
+    sigsize = magnitude - DENORMALEXP;
+  precdigits = 64 - sigsize;  /* bits to be rounded away */
+  if (precdigits + DENOMLOG >= 64) {  /* very small denormal? */
+    int shift = precdigits + DENOMLOG - 64 + 1;
+    input.f >>= shift;
+    input.e += shift;
+    error = (error >> shift) + 1 + DENOMINATOR;
+    precdigits -= shift;
+  }
+  mask = (cast(l_uint64, 1) << precdigits) - 1;
+  precbits = (input.f & mask) * DENOMINATOR;
+  halfway = (cast(l_uint64, 1) << (precdigits - 1)) * DENOMINATOR;
+  if (halfway - error < precbits && precbits < halfway + error)
+    return 0;  /* too close to a tie */
+  input.f >>= precdigits;
+  input.e += precdigits;
+  if (precbits >= halfway + error)
+    input.f++;  /* round up */
+  *result = diy2double(input);
+  return 1;
+}
+
+
+/*
+** Compute 'w' * 10^'q' correctly rounded, where 'w' has 'nd' digits
+** and, if 'inexact', stands for a longer numeral. Returns false if it
+** cannot be sure of the result.
+*/
+static int decimal2double (l_uint64 w, int nd, int q, int inexact,
+                           double *result) {
+  if (w == 0)
+    *result = 0.0;
+  else if (q + nd > DBL_MAX_10_EXP + 1)  /* w*10^q >= 10^309? */
+    *result = HUGE_VAL;
+  else if (q + nd <= DBL_MIN_10_EXP - 17)  /* w*10^q < 10^-324? */
+    *result = 0.0;
+#if l_clinger
+  else if (!inexact && w <= (HIDDENBIT << 1) && q <= MAXEXACTPOW10 &&
+           q >= -MAXEXACTPOW10)  /* exact operands? (Clinger) */
+    *result = (q >= 0) ? cast(double, w) * exactpow10[q]
+                       : cast(double, w) / exactpow10[-q];
+#endif
+  else
+    return diystrtod(w, nd, q, inexact, result);
+  return 1;
+}
+
+
+/*
+** Convert a decimal numeral (with optional spaces around it) to a
+** float, as 'lua_str2number' would; returns NULL if the string is not
+** such a numeral or if the result could not be computed here.
+*/
+static const char *l_str2dec (const char *s, lua_Number *result) {
+  int dot = lua_getlocaledecpoint();
+  l_uint64 w = 0;  /* first significant digits */
+  int nd = 0;  /* number of digits in 'w' */
+  int q = 0;  /* decimal exponent */
+  int hasdigits = 0, hasdot = 0, dropped = 0, roundup = 0, inexact = 0;
+  int neg;
+  double r;
+  while (lisspace(cast_uchar(*s))) s++;  /* skip initial spaces */
+  neg = isneg(&s);
+  for (; ; s++) {
+    if (*s == dot && !hasdot)
+      hasdot = 1;
+    else if (lisdigit(cast_uchar(*s))) {
+      int d = *s - '0';
+      hasdigits = 1;
+      if (nd == 0 && d == 0) {  /* leading zero? */
+        if (hasdot && --q < -MAXDECSCALE)
+          return NULL;  /* too many zeros to handle here */
+      }
+      else if (nd < MAXUINT64DIGITS) {
+        w = w * 10 + d;
+        nd++;
+        if (hasdot) q--;
+      }
+      else {  /* too many digits; round them away */
+        if (!dropped)  /* first dropped digit? */
+          roundup = (d >= 5);
+        dropped = 1;
+        inexact |= (d != 0);
+        if (!hasdot && ++q > MAXDECSCALE)
+          return NULL;  /* too many digits to handle here */
+      }
+    }
+    else break;
+  }
+  if (!hasdigits)
+    return NULL;
+  if (*s == 'e' || *s == 'E') {  /* exponent part? */
+    int e = 0;
+    int neg1;
+    s++;
+    neg1 = isneg(&s);
+    if (!lisdigit(cast_uchar(*s)))
+      return NULL;  /* must have at least one digit */
+    for (; lisdigit(cast_uchar(*s)); s++) {
+      if (e >= MAXDECSCALE)
+        return NULL;  /* exponent too large to handle here */
+      e = e * 10 + (*s - '0');
+    }
+    q += (neg1) ? -e : e;
+  }
+  while (lisspace(cast_uchar(*s))) s++;  /* skip trailing spaces */
+  if (*s != '\0')
+    return NULL;
+  if (roundup) w++;
+  if (!decimal2double(w, nd, q, inexact, &r))
+    return NULL;
+  *result = (neg) ? -r : r;
+  return s;
+}
+
+#endif				/* } */
+
+/* }====================================================== */
+
+
 static const char *l_str2d (const char *s, lua_Number *result) {
   char *endptr;
   if (strpbrk(s, "nN"))  /* reject 'inf' and 'nan' */
     return NULL;
   else if (strpbrk(s, "xX"))  /* hex? */
     *result = lua_strx2number(s, &endptr);
-  else
+  else {
+#if l_fastfloat
+    const char *e = l_str2dec(s, result);
+    if (e != NULL)  /* converted it? */
+      return e;
+#endif
     *result = lua_str2number(s, &endptr);
+  }
   if (endptr == s) return NULL;  /* nothing recognized */
   while (lisspace(cast_uchar(*endptr))) endptr++;
   return (*endptr == '\0' ? endptr : NULL);  /* OK if no trailing characters */
 }
 
 
+/*
+** Integers with 64 bits on little-endian machines convert decimal
+** digits in groups of 8, with a few word operations
+*/
+#if !defined(l_swardigits)
+#if (LUA_MAXINTEGER >> 31 >> 31) == 1 && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define l_swardigits	1
+#else
+#define l_swardigits	0
+#endif
+#endif
+
+#if l_swardigits	/* { */
+
+/* a word with mask 'm' (32 bits) in both halves */
+#define BOTHHALVES(m)	((cast(lua_Unsigned, m) << 32) | (m))
+
+/* value of the 8 decimal digits at 's' */
+static lua_Unsigned digits8 (const char *s) {
+  lua_Unsigned v;
+  memcpy(&v, s, sizeof(v));  /* first digit in the lowest byte */
+  v -= BOTHHALVES(0x30303030u);  /* each byte is now a digit */
+  v = (v * 10 + (v >> 8)) & BOTHHALVES(0x00FF00FFu);  /* pairs */
+  v = (v * 100 + (v >> 16)) & BOTHHALVES(0x0000FFFFu);  /* quads */
+  return (v * 10000 + (v >> 32)) & 0xFFFFFFFFu;
+}
+
+#endif			/* } */
+
+
 static const char *l_str2int (const char *s, lua_Integer *result) {
   lua_Unsigned a = 0;
   int empty = 1;
@@ -274,10 +728,15 @@ static const char *l_str2int (const char *s, lua_Integer *result) {
     }
   }
   else {  /* decimal */
-    for (; lisdigit(cast_uchar(*s)); s++) {
+    const char *e = s;
+    while (lisdigit(cast_uchar(*e))) e++;  /* find end of digits */
+    empty = (e == s);
+#if l_swardigits
+    for (; e - s >= 8; s += 8)  /* convert 8 digits at a time */
+      a = a * 100000000 + digits8(s);
+#endif
+    for (; s < e; s++)
       a = a * 10 + *s - '0';
-      empty = 0;
-    }
   }
   while (lisspace(cast_uchar(*s))) s++;  /* skip trailing spaces */
   if (empty || *s != '\0') return NULL;  /* something wrong in the numeral */
@@ -321,31 +780,438 @@ int luaO_utf8esc (char *buff, unsigned long x) {
 }
 
 
-/* maximum length of the conversion of a number to a string */
-#define MAXNUMBER2STR	50
+/*
+** {======================================================
+** Conversion of numbers to strings
+** =======================================================
+*/
+
+/* pairs of decimal digits, for integer conversion */
+static const char digitpairs[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
 
 
 /*
-** Convert a number object to a string
+** Convert an integer to a decimal string (the same as LUA_INTEGER_FMT);
+** returns its length
 */
-void luaO_tostring (lua_State *L, StkId obj) {
-  char buff[MAXNUMBER2STR];
-  size_t len;
+static int int2str (char *buff, lua_Integer i) {
+  char digits[3 * sizeof(lua_Integer)];
+  char *p = digits + sizeof(digits);
+  lua_Unsigned u = (i < 0) ? 0u - l_castS2U(i) : l_castS2U(i);
+  int len;
+  while (u >= 100) {
+    const char *d = digitpairs + 2 * (u % 100);
+    u /= 100;
+    *--p = d[1];
+    *--p = d[0];
+  }
+  if (u >= 10) {
+    *--p = digitpairs[2 * u + 1];
+    *--p = digitpairs[2 * u];
+  }
+  else
+    *--p = cast(char, '0' + u);
+  if (i < 0) *--p = '-';
+  len = cast_int(digits + sizeof(digits) - p);
+  memcpy(buff, p, len * sizeof(char));
+  return len;
+}
+
+
+/*
+** The digits of floats come from the Grisu3 algorithm (Florian
+** Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+** Integers"), which either produces correct digits or reports that it
+** cannot; in that case the conversion falls back to 'sprintf'.
+*/
+#if l_fastfloat	/* { */
+
+/*
+** Get a cached power of ten 'c' such that the exponent of 'c' times a
+** normalized DiyFp with exponent 'e' falls in the target range;
+** returns the decimal exponent of 'c'
+*/
+static int cachedpow10 (int e, DiyFp *c) {
+  int minexp = MINTARGETEXP - (e + 64);
+  int k = cast_int(l_mathop(ceil)((minexp + 63) * 0.30102999566398114));
+  int i = (-POW10FIRST + k - 1) / POW10STEP + 1;
+  c->f = (cast(l_uint64, pow10cache[i].fhi) << 32) | pow10cache[i].flo;
+  c->e = pow10cache[i].e;
+  lua_assert(MINTARGETEXP <= e + c->e + 64 && e + c->e + 64 <= MAXTARGETEXP);
+  return pow10cache[i].k;
+}
+
+
+/*
+** Find the largest power of ten not greater than 'n' (> 0); returns
+** its number of digits
+*/
+static int biggestpow10 (unsigned int n, unsigned int *power) {
+  unsigned int p = 1;
+  int k = 1;
+  while (n / 10 >= p) {
+    p *= 10;
+    k++;
+  }
+  *power = p;
+  return k;
+}
+
+
+/*
+** Decide how to round the last digit of 'buff' in 'gencounted':
+** 'rest' is what was left out, 'tenkappa' is one unit of that digit,
+** and 'unit' is the error. Returns false if it cannot decide.
+*/
+static int roundcounted (char *buff, int len, l_uint64 rest,
+                         l_uint64 tenkappa, l_uint64 unit, int *kappa) {
+  int i;
+  if (unit >= tenkappa || tenkappa - unit <= unit)
+    return 0;
+  if (tenkappa - rest > rest && tenkappa - 2 * rest >= 2 * unit)
+    return 1;  /* round down */
+  if (rest > unit && tenkappa - (rest - unit) <= rest - unit) {
+    buff[len - 1]++;  /* round up */
+    for (i = len - 1; i > 0 && buff[i] == '0' + 10; i--) {
+      buff[i] = '0';
+      buff[i - 1]++;
+    }
+    if (buff[0] == '0' + 10) {  /* 99...9 became 100...0? */
+      buff[0] = '1';
+      (*kappa)++;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+
+/* generate 'ndigits' digits of scaled value 'w' */
+static int gencounted (DiyFp w, int ndigits, char *buff, int *kappa) {
+  l_uint64 error = 1;
+  l_uint64 one = cast(l_uint64, 1) << -w.e;
+  unsigned int integrals = cast(unsigned int, w.f >> -w.e);
+  l_uint64 fractionals = w.f & (one - 1);
+  unsigned int divisor;
+  int len = 0;
+  *kappa = biggestpow10(integrals, &divisor);
+  while (*kappa > 0) {
+    buff[len++] = cast(char, '0' + integrals / divisor);
+    integrals %= divisor;
+    (*kappa)--;
+    if (--ndigits == 0)
+      return roundcounted(buff, len,
+                          (cast(l_uint64, integrals) << -w.e) + fractionals,
+                          cast(l_uint64, divisor) << -w.e, error, kappa);
+    divisor /= 10;
+  }
+  while (ndigits > 0 && error < one) {  /* ('roundcounted' checks error) */
+    fractionals *= 10;
+    error *= 10;
+    buff[len++] = cast(char, '0' + (fractionals >> -w.e));
+    fractionals &= one - 1;
+    (*kappa)--;
+    ndigits--;
+  }
+  return (ndigits == 0 &&
+          roundcounted(buff, len, fractionals, one, error, kappa));
+}
+
+
+/*
+** Adjust the last digit of 'buff' (in 'genshortest') so that it is
+** the closest to the real value, and check that it is safe
+*/
+static int roundweed (char *buff, int len, l_uint64 distancehigh,
+                      l_uint64 unsafe, l_uint64 rest, l_uint64 tenkappa,
+                      l_uint64 unit) {
+  l_uint64 small = distancehigh - unit;
+  l_uint64 big = distancehigh + unit;
+  while (rest < small && unsafe - rest >= tenkappa &&
+         (rest + tenkappa < small ||
+          small - rest >= rest + tenkappa - small)) {
+    buff[len - 1]--;
+    rest += tenkappa;
+  }
+  if (rest < big && unsafe - rest >= tenkappa &&
+      (rest + tenkappa < big || big - rest > rest + tenkappa - big))
+    return 0;
+  return (2 * unit <= rest && rest <= unsafe - 4 * unit);
+}
+
+
+/*
+** Generate the shortest digits for scaled value 'w' that lie between
+** its scaled boundaries 'low' and 'high'; returns number of digits or
+** 0 if it cannot guarantee the result
+*/
+static int genshortest (DiyFp low, DiyFp w, DiyFp high, char *buff,
+                        int *kappa) {
+  l_uint64 unit = 1;
+  l_uint64 toolow = low.f - unit;
+  l_uint64 toohigh = high.f + unit;
+  l_uint64 unsafe = toohigh - toolow;
+  l_uint64 one = cast(l_uint64, 1) << -w.e;
+  unsigned int integrals = cast(unsigned int, toohigh >> -w.e);
+  l_uint64 fractionals = toohigh & (one - 1);
+  unsigned int divisor;
+  int len = 0;
+  *kappa = biggestpow10(integrals, &divisor);
+  while (*kappa > 0) {
+    l_uint64 rest;
+    buff[len++] = cast(char, '0' + integrals / divisor);
+    integrals %= divisor;
+    (*kappa)--;
+    rest = (cast(l_uint64, integrals) << -w.e) + fractionals;
+    if (rest < unsafe)
+      return roundweed(buff, len, toohigh - w.f, unsafe, rest,
+                       cast(l_uint64, divisor) << -w.e, unit) ? len : 0;
+    divisor /= 10;
+  }
+  for (;;) {
+    fractionals *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    buff[len++] = cast(char, '0' + (fractionals >> -w.e));
+    fractionals &= one - 1;
+    (*kappa)--;
+    if (fractionals < unsafe)
+      return roundweed(buff, len, (toohigh - w.f) * unit, unsafe,
+                       fractionals, one, unit) ? len : 0;
+  }
+}
+
+
+/*
+** Compute the decimal digits of 'x' (positive and finite) into 'buff'
+** (with no trailing zeros), either the shortest ones that identify
+** 'x' (when 'ndigits' is 0) or 'ndigits' correctly rounded digits.
+** The value of 'x' is then 'buff' * 10^'*dexp'. Returns number of
+** digits or 0 if it could not compute them.
+*/
+static int grisu (double x, int ndigits, char *buff, int *dexp) {
+  l_uint64 bits;
+  DiyFp v, w, c;
+  int k, kappa, len;
+  memcpy(&bits, &x, sizeof(x));
+  v.f = bits & (HIDDENBIT - 1);
+  v.e = cast_int(bits >> SIGNIFBITS);
+  if (v.e == 0)  /* denormal? */
+    v.e = DENORMALEXP;
+  else {
+    v.f += HIDDENBIT;
+    v.e -= EXPBIAS;
+  }
+  w = diynormalize(v);
+  k = cachedpow10(w.e, &c);
+  if (ndigits > 0) {
+    len = ndigits;
+    if (!gencounted(diymul(w, c), ndigits, buff, &kappa))
+      return 0;
+  }
+  else {
+    DiyFp low, high;
+    high.f = (v.f << 1) + 1;  /* upper boundary: halfway to next float */
+    high.e = v.e - 1;
+    high = diynormalize(high);
+    if (v.f == HIDDENBIT && v.e != DENORMALEXP) {  /* lower one closer? */
+      low.f = (v.f << 2) - 1;
+      low.e = v.e - 2;
+    }
+    else {
+      low.f = (v.f << 1) - 1;
+      low.e = v.e - 1;
+    }
+    low.f <<= low.e - high.e;
+    low.e = high.e;
+    len = genshortest(diymul(low, c), diymul(w, c), diymul(high, c),
+                      buff, &kappa);
+    if (len == 0)
+      return 0;
+  }
+  *dexp = kappa - k;
+  while (buff[len - 1] == '0') {  /* remove trailing zeros */
+    len--;
+    (*dexp)++;
+  }
+  return len;
+}
+
+
+/*
+** Write the 'len' digits in 'digits' (times 10^'dexp') as format
+** "%.<prec>g" would
+*/
+static int formatg (char *buff, const char *digits, int len, int dexp,
+                    int prec) {
+  char *p = buff;
+  int x = len + dexp - 1;  /* decimal exponent of first digit */
+  if (x < -4 || x >= prec) {  /* exponential format */
+    *p++ = digits[0];
+    if (len > 1) {
+      *p++ = lua_getlocaledecpoint();
+      memcpy(p, digits + 1, (len - 1) * sizeof(char));
+      p += len - 1;
+    }
+    *p++ = 'e';
+    *p++ = (x < 0) ? '-' : '+';
+    if (x < 0) x = -x;
+    if (x >= 100) {
+      *p++ = cast(char, '0' + x / 100);
+      x %= 100;
+    }
+    *p++ = digitpairs[2 * x];
+    *p++ = digitpairs[2 * x + 1];
+  }
+  else if (x < 0) {  /* 0.000ddd */
+    *p++ = '0';
+    *p++ = lua_getlocaledecpoint();
+    memset(p, '0', (-x - 1) * sizeof(char));
+    p += -x - 1;
+    memcpy(p, digits, len * sizeof(char));
+    p += len;
+  }
+  else if (len <= x + 1) {  /* integral value: ddd000 */
+    memcpy(p, digits, len * sizeof(char));
+    memset(p + len, '0', (x + 1 - len) * sizeof(char));
+    p += x + 1;
+  }
+  else {  /* ddd.ddd */
+    memcpy(p, digits, (x + 1) * sizeof(char));
+    p += x + 1;
+    *p++ = lua_getlocaledecpoint();
+    memcpy(p, digits + x + 1, (len - x - 1) * sizeof(char));
+    p += len - x - 1;
+  }
+  return cast_int(p - buff);
+}
+
+
+#if defined(LUA_SHORTESTFLOAT)
+
+/*
+** Compute the shortest digits of 'x' (positive and finite) with
+** 'sprintf', for when 'grisu' cannot: try each precision until the
+** digits read back as 'x'. Same results as 'grisu'.
+*/
+static int sprintdigits (double x, char *buff, int *dexp) {
+  char s[32];
+  int prec, len = 0;
+  const char *p;
+  for (prec = 15; prec < 17; prec++) {
+    sprintf(s, "%.*e", prec - 1, x);
+    if (lua_str2number(s, NULL) == x)
+      break;
+  }
+  if (prec == 17)
+    sprintf(s, "%.16e", x);
+  for (p = s; *p != 'e'; p++)  /* collect digits (skipping the point) */
+    if (lisdigit(cast_uchar(*p))) buff[len++] = *p;
+  while (len > 1 && buff[len - 1] == '0')  /* remove trailing zeros */
+    len--;
+  *dexp = atoi(p + 1) - (len - 1);
+  return len;
+}
+
+#else
+
+/*
+** 'num2str' writes floats as the default 'lua_number2str' does (with
+** "%.14g"), so it can be used only when that definition is in effect.
+** (The comparison is between constants, done by the compiler.)
+*/
+#define l_str(x)	#x
+#define l_xstr(x)	l_str(x)
+#define l_defaultn2s  \
+	(strcmp(l_xstr(lua_number2str(s,n)), "sprintf((s), \"%.14g\", (n))") == 0)
+
+#endif
+
+
+/*
+** Convert a float to a string with 'formatg'; returns 0 if it cannot
+** do the conversion (in which case 'lua_number2str' must do it)
+*/
+static int num2str (char *buff, lua_Number n) {
+  char digits[20];
+  int len, dexp, neg = 0;
+#if defined(LUA_SHORTESTFLOAT)
+  const int ndigits = 0, prec = 17;
+#else
+  const int ndigits = 14, prec = 14;  /* as in "%.14g" */
+  if (!l_defaultn2s)
+    return 0;
+#endif
+  if (!(n == n) || n - n != 0)  /* NaN or infinite? */
+    return 0;
+  if (n < 0) {
+    n = -n;
+    neg = 1;
+  }
+  else if (n == 0) {
+    if (1 / n < 0) *buff++ = '-';
+    *buff = '0';
+    return (1 / n < 0) + 1;
+  }
+  len = grisu(n, ndigits, digits, &dexp);
+#if defined(LUA_SHORTESTFLOAT)
+  if (len == 0)  /* keep the same format ('prec') in the fallback */
+    len = sprintdigits(n, digits, &dexp);
+#else
+  if (len == 0)
+    return 0;
+#endif
+  if (neg) *buff++ = '-';
+  return neg + formatg(buff, digits, len, dexp, prec);
+}
+
+#else				/* }{ */
+
+#define num2str(buff,n)		0
+
+#endif				/* } */
+
+
+/*
+** Convert a number object to a string in 'buff' (with at least
+** LUA_N2SBUFFSZ bytes); returns the length of the result (without
+** a final zero)
+*/
+int luaO_tostringbuff (const TValue *obj, char *buff) {
+  int len;
   lua_assert(ttisnumber(obj));
   if (ttisinteger(obj))
-    len = lua_integer2str(buff, ivalue(obj));
+    len = int2str(buff, ivalue(obj));
   else {
-    len = lua_number2str(buff, fltvalue(obj));
+    len = num2str(buff, fltvalue(obj));
+    if (len == 0)  /* could not convert it? */
+      len = lua_number2str(buff, fltvalue(obj));
 #if !defined(LUA_COMPAT_FLOATSTRING)
+    buff[len] = '\0';
     if (buff[strspn(buff, "-0123456789")] == '\0') {  /* looks like an int? */
       buff[len++] = lua_getlocaledecpoint();
       buff[len++] = '0';  /* adds '.0' to result */
     }
 #endif
   }
+  return len;
+}
+
+
+/*
+** Convert a number object to a string
+*/
+void luaO_tostring (lua_State *L, StkId obj) {
+  char buff[LUA_N2SBUFFSZ];
+  int len = luaO_tostringbuff(obj, buff);
   setsvalue2s(L, obj, luaS_newlstr(L, buff, len));
 }
 
+/* }====================================================== */
+
 
 static void pushstr (lua_State *L, const char *str, size_t l) {
   setsvalue2s(L, L->top++, luaS_newlstr(L, str, l));
@@ -41,12 +41,14 @@
 ** 0 - Lua function
 ** 1 - light C function
 ** 2 - regular C function (closure)
+** 3 - fast light C function (see 'lua_pushfastcfunction')
 */
 
 /* Variant tags for functions */
 #define LUA_TLCL	(LUA_TFUNCTION | (0 << 4))  /* Lua closure */
 #define LUA_TLCF	(LUA_TFUNCTION | (1 << 4))  /* light C function */
 #define LUA_TCCL	(LUA_TFUNCTION | (2 << 4))  /* C closure */
+#define LUA_TFCF	(LUA_TFUNCTION | (3 << 4))  /* fast light C function */
 
 
 /* Variant tags for strings */
@@ -101,7 +103,7 @@ typedef union Value Value;
 ** an actual value plus a tag with its type.
 */
 
-#define TValuefields	Value value_; int tt_
+#define TValuefields	Value value_; lu_byte tt_
 
 typedef struct lua_TValue TValue;
 
@@ -143,7 +145,9 @@ typedef struct lua_TValue TValue;
 #define ttisclosure(o)		((rttype(o) & 0x1F) == LUA_TFUNCTION)
 #define ttisCclosure(o)		checktag((o), ctb(LUA_TCCL))
 #define ttisLclosure(o)		checktag((o), ctb(LUA_TLCL))
-#define ttislcf(o)		checktag((o), LUA_TLCF)
+/* light C functions, fast or not, differ only in bit 5 */
+#define ttislcf(o)		((rttype(o) & ~(2 << 4)) == LUA_TLCF)
+#define ttisfastcf(o)		checktag((o), LUA_TFCF)
 #define ttisfulluserdata(o)	checktag((o), ctb(LUA_TUSERDATA))
 #define ttisthread(o)		checktag((o), ctb(LUA_TTHREAD))
 #define ttisdeadkey(o)		checktag((o), LUA_TDEADKEY)
@@ -202,6 +206,9 @@ typedef struct lua_TValue TValue;
 #define setfvalue(obj,x) \
   { TValue *io=(obj); val_(io).f=(x); settt_(io, LUA_TLCF); }
 
+#define setfastfvalue(obj,x) \
+  { TValue *io=(obj); val_(io).f=(x); settt_(io, LUA_TFCF); }
+
 #define setpvalue(obj,x) \
   { TValue *io=(obj); val_(io).p=(x); settt_(io, LUA_TLIGHTUSERDATA); }
 
@@ -246,8 +253,13 @@ typedef struct lua_TValue TValue;
 
 
 
+/*
+** copy fields one by one: a table node keeps parts of its key in the
+** padding after the value's tag (see 'Node')
+*/
 #define setobj(L,obj1,obj2) \
-	{ TValue *io1=(obj1); *io1 = *(obj2); \
+	{ TValue *io1=(obj1); const TValue *io2=(obj2); \
+	  io1->value_ = io2->value_; io1->tt_ = io2->tt_; \
 	  (void)L; checkliveness(G(L),io1); }
 
 
@@ -273,6 +285,174 @@ typedef struct lua_TValue TValue;
 
 
 
+/*
+** {======================================================
+** NaN Trick
+** =======================================================
+*/
+#if defined(LUA_NANTRICK)
+
+#if !defined(__LP64__) && !defined(_LP64)
+#error "LUA_NANTRICK needs 64-bit pointers"
+#endif
+
+/*
+** A value is a double in 'nb'. Floats are stored as they are (except
+** that all NaNs become a single positive quiet NaN); all other values
+** use quiet NaNs with the sign bit set (13 bits), a 4-bit code for their
+** tag and a 47-bit payload (a pointer, a boolean, or a 32-bit integer).
+** Codes for collectable types have their highest bit set, so that
+** 'iscollectable' is a single comparison.
+*/
+typedef unsigned long lu_nanbits;
+
+#define NNBITS		47
+#define NNMARK		(~cast(lu_nanbits, 0) << (NNBITS + 4))
+#define NNPAYLOAD	((cast(lu_nanbits, 1) << NNBITS) - 1)
+#define NNCANONICALNAN	(cast(lu_nanbits, 0x7ff8) << 48)
+
+#define nncode(t) \
+  ((t) == LUA_TNIL ? 0 : (t) == LUA_TBOOLEAN ? 1 : \
+   (t) == LUA_TLIGHTUSERDATA ? 2 : (t) == LUA_TNUMINT ? 3 : \
+   (t) == LUA_TDEADKEY ? 4 : (t) == LUA_TLCF ? 6 : (t) == LUA_TFCF ? 7 : \
+   (t) == ctb(LUA_TSHRSTR) ? 8 : (t) == ctb(LUA_TLNGSTR) ? 9 : \
+   (t) == ctb(LUA_TTABLE) ? 10 : (t) == ctb(LUA_TUSERDATA) ? 11 : \
+   (t) == ctb(LUA_TLCL) ? 12 : (t) == ctb(LUA_TCCL) ? 13 : 14)
+
+/* tag for each code */
+LUAI_DDEC const lu_byte luaO_nntag_[16];
+
+#define nb_(o)		(val_(o).nb)
+#define nnbox(t,p)	(NNMARK | (cast(lu_nanbits, nncode(t)) << NNBITS) | (p))
+#define nnisboxed(o)	((nb_(o) & NNMARK) == NNMARK)
+#define nnpayload(o)	(nb_(o) & NNPAYLOAD)
+#define nnptr(p)  \
+  check_exp((cast(lu_nanbits, p) & ~NNPAYLOAD) == 0, cast(lu_nanbits, p))
+
+#undef TValuefields
+#define TValuefields	Value value_
+
+#undef NILCONSTANT
+#define NILCONSTANT	{nnbox(LUA_TNIL, 0)}
+
+#undef rttype
+#define rttype(o)  \
+  (nnisboxed(o) ? luaO_nntag_[(nb_(o) >> NNBITS) & 0xf] : LUA_TNUMFLT)
+
+#undef checktag
+#define checktag(o,t)	((nb_(o) >> NNBITS) == (nnbox(t, 0) >> NNBITS))
+#undef ttisnumber
+#define ttisnumber(o)	(ttisfloat(o) || ttisinteger(o))
+#undef ttisfloat
+#define ttisfloat(o)	(!nnisboxed(o))
+#undef ttisstring
+#define ttisstring(o)	((nb_(o) >> (NNBITS + 1)) == (NNMARK >> (NNBITS + 1) | 4))
+#undef ttisclosure
+#define ttisclosure(o)	((nb_(o) >> (NNBITS + 1)) == (NNMARK >> (NNBITS + 1) | 6))
+#undef ttislcf
+#define ttislcf(o)	((nb_(o) >> (NNBITS + 1)) == (NNMARK >> (NNBITS + 1) | 3))
+#undef ttisfunction
+#define ttisfunction(o)	(ttisclosure(o) || ttislcf(o))
+#undef iscollectable
+#define iscollectable(o)  \
+	((nb_(o) >> (NNBITS + 3)) == (NNMARK >> (NNBITS + 3) | 1))
+
+#undef ivalue
+#define ivalue(o)  \
+  check_exp(ttisinteger(o), cast(lua_Integer, cast(int, nb_(o))))
+#undef gcvalue
+#define gcvalue(o)  \
+  check_exp(iscollectable(o), cast(GCObject *, nnpayload(o)))
+#undef pvalue
+#define pvalue(o)	check_exp(ttislightuserdata(o), cast(void *, nnpayload(o)))
+#undef tsvalue
+#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(gcvalue(o)))
+#undef uvalue
+#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(gcvalue(o)))
+#undef clvalue
+#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(gcvalue(o)))
+#undef clLvalue
+#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(gcvalue(o)))
+#undef clCvalue
+#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(gcvalue(o)))
+#undef fvalue
+#define fvalue(o)  \
+  check_exp(ttislcf(o), cast(lua_CFunction, nnpayload(o)))
+#undef hvalue
+#define hvalue(o)	check_exp(ttistable(o), gco2t(gcvalue(o)))
+#undef bvalue
+#define bvalue(o)	check_exp(ttisboolean(o), cast_int(nb_(o) & 1))
+#undef thvalue
+#define thvalue(o)	check_exp(ttisthread(o), gco2th(gcvalue(o)))
+#undef deadvalue
+#define deadvalue(o)	check_exp(ttisdeadkey(o), cast(void *, nnpayload(o)))
+
+#undef settt_
+#define settt_(o,t)	(nb_(o) = nnbox(t, nnpayload(o)))
+
+#define nnsetgc(L,obj,t,x) \
+  { TValue *io = (obj); nb_(io) = nnbox(t, nnptr(x)); \
+    checkliveness(G(L),io); }
+
+#undef setfltvalue
+#define setfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); \
+    if (luai_numisnan(n_)) nb_(io) = NNCANONICALNAN; else val_(io).n = n_; }
+#undef chgfltvalue
+#define chgfltvalue(obj,x) \
+  { lua_assert(ttisfloat(obj)); setfltvalue(obj,x); }
+#undef setivalue
+#define setivalue(obj,x) \
+  { TValue *io=(obj); \
+    nb_(io) = nnbox(LUA_TNUMINT, cast(unsigned int, (x))); }
+#undef chgivalue
+#define chgivalue(obj,x) \
+  { lua_assert(ttisinteger(obj)); setivalue(obj,x); }
+#undef setnilvalue
+#define setnilvalue(obj)	(nb_(obj) = nnbox(LUA_TNIL, 0))
+#undef setfvalue
+#define setfvalue(obj,x) \
+  { TValue *io=(obj); nb_(io) = nnbox(LUA_TLCF, nnptr(x)); }
+#undef setfastfvalue
+#define setfastfvalue(obj,x) \
+  { TValue *io=(obj); nb_(io) = nnbox(LUA_TFCF, nnptr(x)); }
+#undef setpvalue
+#define setpvalue(obj,x) \
+  { TValue *io=(obj); nb_(io) = nnbox(LUA_TLIGHTUSERDATA, nnptr(x)); }
+#undef setbvalue
+#define setbvalue(obj,x) \
+  { TValue *io=(obj); \
+    nb_(io) = nnbox(LUA_TBOOLEAN, cast(lu_nanbits, (x) != 0)); }
+#undef setgcovalue
+#define setgcovalue(L,obj,x) \
+  { TValue *io = (obj); GCObject *i_g=(x); \
+    nb_(io) = nnbox(ctb(i_g->tt), nnptr(i_g)); }
+#undef setsvalue
+#define setsvalue(L,obj,x) \
+  { TString *x_ = (x); nnsetgc(L, obj, ctb(x_->tt), x_); }
+#undef setuvalue
+#define setuvalue(L,obj,x)	nnsetgc(L, obj, ctb(LUA_TUSERDATA), (x))
+#undef setthvalue
+#define setthvalue(L,obj,x)	nnsetgc(L, obj, ctb(LUA_TTHREAD), (x))
+#undef setclLvalue
+#define setclLvalue(L,obj,x)	nnsetgc(L, obj, ctb(LUA_TLCL), (x))
+#undef setclCvalue
+#define setclCvalue(L,obj,x)	nnsetgc(L, obj, ctb(LUA_TCCL), (x))
+#undef sethvalue
+#define sethvalue(L,obj,x)	nnsetgc(L, obj, ctb(LUA_TTABLE), (x))
+#undef setdeadvalue
+#define setdeadvalue(obj)	settt_(obj, LUA_TDEADKEY)
+
+#undef setobj
+#define setobj(L,obj1,obj2) \
+	{ TValue *io1=(obj1); *io1 = *(obj2); \
+	  (void)L; checkliveness(G(L),io1); }
+
+#endif
+/* }====================================================== */
+
+
+
 /*
 ** {======================================================
 ** types and prototypes
@@ -281,6 +461,9 @@ typedef struct lua_TValue TValue;
 
 
 union Value {
+#if defined(LUA_NANTRICK)
+  lu_nanbits nb;   /* whole value (see 'NaN Trick') */
+#endif
   GCObject *gc;    /* collectable objects */
   void *p;         /* light userdata */
   int b;           /* booleans */
@@ -378,10 +561,18 @@ typedef union UUdata {
 	  checkliveness(G(L),io); }
 
 
+#if !defined(LUA_NANTRICK)
 #define getuservalue(L,u,o) \
 	{ TValue *io=(o); const Udata *iu = (u); \
 	  io->value_ = iu->user_; settt_(io, iu->ttuv_); \
 	  checkliveness(G(L),io); }
+#else
+/* 'user_' already holds the tag */
+#define getuservalue(L,u,o) \
+	{ TValue *io=(o); const Udata *iu = (u); \
+	  io->value_ = iu->user_; \
+	  checkliveness(G(L),io); }
+#endif
 
 
 /*
@@ -476,27 +667,91 @@ typedef union Closure {
 ** Tables
 */
 
-typedef union TKey {
-  struct {
-    TValuefields;
+/*
+** Nodes for hash tables: the key's tag sits in the padding after the
+** value's tag, so that a node takes 24 bytes (instead of 32 with a full
+** TValue for the key) on 64-bit machines. The value is still accessible
+** as a proper 'TValue' through 'i_val'. With the NaN trick the key is
+** already a whole 8-byte value.
+*/
+#if !defined(LUA_NANTRICK)
+
+typedef union Node {
+  struct NodeKey {
+    TValuefields;  /* fields for value */
+    lu_byte key_tt;  /* key type */
     int next;  /* for chaining (offset for next node) */
-  } nk;
-  TValue tvk;
-} TKey;
+    Value key_val;  /* key value */
+  } u;
+  TValue i_val;  /* direct access to node's value as a proper 'TValue' */
+} Node;
 
 
-/* copy a value into a key without messing up field 'next' */
-#define setnodekey(L,key,obj) \
-	{ TKey *k_=(key); const TValue *io_=(obj); \
-	  k_->nk.value_ = io_->value_; k_->nk.tt_ = io_->tt_; \
+/* copy a value into a key */
+#define setnodekey(L,node,obj) \
+	{ Node *n_=(node); const TValue *io_=(obj); \
+	  n_->u.key_val = io_->value_; n_->u.key_tt = io_->tt_; \
 	  (void)L; checkliveness(G(L),io_); }
 
+/* copy a value from a key */
+#define getnodekey(L,obj,node) \
+	{ TValue *io_=(obj); const Node *n_=(node); \
+	  io_->value_ = n_->u.key_val; io_->tt_ = n_->u.key_tt; \
+	  (void)L; }
+
+#define keytt(node)		((node)->u.key_tt)
+#define keyval(node)		((node)->u.key_val)
 
-typedef struct Node {
-  TValue i_val;
-  TKey i_key;
+#define keyisnil(node)		(keytt(node) == LUA_TNIL)
+#define keyisinteger(node)	(keytt(node) == LUA_TNUMINT)
+#define keyival(node)		(keyval(node).i)
+#define keyisshrstr(node)	(keytt(node) == ctb(LUA_TSHRSTR))
+#define keystrval(node)		(gco2ts(keyval(node).gc))
+#define keyiscollectable(node)	(keytt(node) & BIT_ISCOLLECTABLE)
+#define keyisdead(node)		(keytt(node) == LUA_TDEADKEY)
+
+/* a dead key keeps its 'gc' field (only for comparisons in 'next') */
+#define gckey(node)		(keyval(node).gc)
+
+#define setnilkey(node)		(keytt(node) = LUA_TNIL)
+#define setdeadkey(node)	(keytt(node) = LUA_TDEADKEY)
+
+#else
+
+typedef union Node {
+  struct NodeKey {
+    TValuefields;  /* fields for value */
+    int next;  /* for chaining (offset for next node) */
+    TValue key_tv;  /* key */
+  } u;
+  TValue i_val;  /* direct access to node's value as a proper 'TValue' */
 } Node;
 
+#define setnodekey(L,node,obj) \
+	{ Node *n_=(node); const TValue *io_=(obj); n_->u.key_tv = *io_; \
+	  (void)L; checkliveness(G(L),io_); }
+
+#define getnodekey(L,obj,node) \
+	{ TValue *io_=(obj); const Node *n_=(node); *io_ = n_->u.key_tv; \
+	  (void)L; }
+
+#define nodekey_(node)		(&(node)->u.key_tv)
+
+#define keyisnil(node)		ttisnil(nodekey_(node))
+#define keyisinteger(node)	ttisinteger(nodekey_(node))
+#define keyival(node)		ivalue(nodekey_(node))
+#define keyisshrstr(node)	ttisshrstring(nodekey_(node))
+#define keystrval(node)		tsvalue(nodekey_(node))
+#define keyiscollectable(node)	iscollectable(nodekey_(node))
+#define keyisdead(node)		ttisdeadkey(nodekey_(node))
+
+#define gckey(node)		cast(GCObject *, nnpayload(nodekey_(node)))
+
+#define setnilkey(node)		setnilvalue(nodekey_(node))
+#define setdeadkey(node)	setdeadvalue(nodekey_(node))
+
+#endif
+
 
 typedef struct Table {
   CommonHeader;
@@ -542,6 +797,7 @@ LUAI_FUNC void luaO_arith (lua_State *L, int op, const TValue *p1,
                            const TValue *p2, TValue *res);
 LUAI_FUNC size_t luaO_str2num (const char *s, TValue *o);
 LUAI_FUNC int luaO_hexavalue (int c);
+LUAI_FUNC int luaO_tostringbuff (const TValue *obj, char *buff);
 LUAI_FUNC void luaO_tostring (lua_State *L, StkId obj);
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
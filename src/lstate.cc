@@ -101,52 +101,100 @@ void luaE_setdebt (global_State *g, l_mem debt) {
 }
 
 
+/*
+** CallInfo structures after 'base_ci' are allocated in contiguous
+** blocks, all linked in the 'ci' list as soon as the block is created.
+** Block sizes depend only on the number of entries before them: they
+** double from 2 up to LUAI_CIBLOCK, so that threads with few calls
+** (such as most coroutines) stay small. 'L->nci' counts the entries in
+** the list after 'base_ci', which is always made of whole blocks.
+*/
+#define ciblocksize(n)	((n) < LUAI_CIBLOCK - 2 ? (n) + 2 : LUAI_CIBLOCK)
+
+
 CallInfo *luaE_extendCI (lua_State *L) {
-  CallInfo *ci = luaM_new(L, CallInfo);
+  int size = ciblocksize(L->nci);
+  CallInfo *block = luaM_newvector(L, size, CallInfo);
+  int i;
   lua_assert(L->ci->next == NULL);
-  L->ci->next = ci;
-  ci->previous = L->ci;
-  ci->next = NULL;
-  return ci;
+  L->ci->next = block;
+  block[0].previous = L->ci;
+  for (i = 1; i < size; i++) {
+    block[i - 1].next = &block[i];
+    block[i].previous = &block[i - 1];
+  }
+  block[size - 1].next = NULL;
+  L->nci += size;
+  L->idlecycles = 0;
+  return block;
 }
 
 
 /*
-** free all CallInfo structures not in use by a thread
+** free the unused blocks after the one holding 'L->ci': all of them or,
+** if 'half', the second half of them
 */
-void luaE_freeCI (lua_State *L) {
+static void freeblocks (lua_State *L, int half) {
   CallInfo *ci = L->ci;
-  CallInfo *next = ci->next;
+  CallInfo *block;
+  int depth = 0;
+  int n = 0;  /* number of entries up to the end of the current block */
+  int keep = 0;  /* number of unused blocks to keep */
+  for (; ci != &L->base_ci; ci = ci->previous)
+    depth++;
+  while (n < depth)
+    n += ciblocksize(n);
+  for (ci = L->ci; depth < n; depth++)  /* go to the end of the block */
+    ci = ci->next;
+  if (half) {  /* count unused blocks */
+    int m = n;
+    for (block = ci->next; block != NULL; keep++) {
+      block = block[ciblocksize(m) - 1].next;
+      m += ciblocksize(m);
+    }
+    keep /= 2;
+  }
+  for (; keep > 0; keep--) {  /* skip kept blocks */
+    ci = ci->next + (ciblocksize(n) - 1);
+    n += ciblocksize(n);
+  }
+  block = ci->next;
   ci->next = NULL;
-  while ((ci = next) != NULL) {
-    next = ci->next;
-    luaM_free(L, ci);
+  L->nci = n;
+  while (block != NULL) {
+    int size = ciblocksize(n);
+    CallInfo *next = block[size - 1].next;
+    luaM_freearray(L, block, size);
+    n += size;
+    block = next;
   }
 }
 
 
 /*
-** free half of the CallInfo structures not in use by a thread
+** free all CallInfo blocks not in use by a thread
+*/
+void luaE_freeCI (lua_State *L) {
+  freeblocks(L, 0);
+}
+
+
+/*
+** free half of the CallInfo blocks not in use by a thread
 */
 void luaE_shrinkCI (lua_State *L) {
-  CallInfo *ci = L->ci;
-  while (ci->next != NULL) {  /* while there is 'next' */
-    CallInfo *next2 = ci->next->next;  /* next's next */
-    if (next2 == NULL) break;
-    luaM_free(L, ci->next);  /* remove next */
-    ci->next = next2;  /* remove 'next' from the list */
-    next2->previous = ci;
-    ci = next2;
-  }
+  freeblocks(L, 1);
 }
 
 
-static void stack_init (lua_State *L1, lua_State *L) {
+static void stack_init (lua_State *L1, lua_State *L, int size) {
   int i; CallInfo *ci;
+  lua_assert(MIN_STACK_SIZE <= size && size <= LUAI_MAXSTACK);
   /* initialize stack array */
-  L1->stack = luaM_newvector(L, BASIC_STACK_SIZE, TValue);
-  L1->stacksize = BASIC_STACK_SIZE;
-  for (i = 0; i < BASIC_STACK_SIZE; i++)
+  L1->stack = luaM_newvector(L, size, TValue);
+  L1->stacksize = size;
+  L1->minstacksize = size;
+  for (i = 0; i < size; i++)
     setnilvalue(L1->stack + i);  /* erase new stack */
   L1->top = L1->stack;
   L1->stack_last = L1->stack + L1->stacksize - EXTRA_STACK;
@@ -195,7 +243,7 @@ static void init_registry (lua_State *L, global_State *g) {
 static void f_luaopen (lua_State *L, void *ud) {
   global_State *g = G(L);
   UNUSED(ud);
-  stack_init(L, L);  /* init stack */
+  stack_init(L, L, BASIC_STACK_SIZE);  /* init stack */
   init_registry(L, g);
   luaS_init(L);
   luaT_init(L);
@@ -227,6 +275,8 @@ static void preinit_thread (lua_State *L, global_State *g) {
   L->nny = 1;
   L->status = LUA_OK;
   L->errfunc = 0;
+  L->nci = 0;
+  L->idlecycles = 0;
 }
 
 
@@ -238,15 +288,27 @@ static void close_state (lua_State *L) {
     luai_userstateclose(L);
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
   g->buff.free(L);
+  luaG_freeallocsites(L);
   freestack(L);
+#if defined(LUAI_GCPOOL)
+  luaM_poolclose(L);
+#endif
   lua_assert(gettotalbytes(g) == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
 }
 
 
-LUA_API lua_State *lua_newthread (lua_State *L) {
+/*
+** create a new thread whose stack starts with 'stacksize' slots
+** (clipped to [MIN_STACK_SIZE, LUAI_MAXSTACK]); small stacks save memory
+** when there are many coroutines, large ones avoid repeated growth in
+** coroutines known to go deep
+*/
+LUA_API lua_State *lua_newthreadsize (lua_State *L, int stacksize) {
   global_State *g = G(L);
   lua_State *L1;
+  if (stacksize < MIN_STACK_SIZE) stacksize = MIN_STACK_SIZE;
+  else if (stacksize > LUAI_MAXSTACK) stacksize = LUAI_MAXSTACK;
   lua_lock(L);
   luaC_checkGC(L);
   /* create new thread */
@@ -268,12 +330,51 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
   memcpy(lua_getextraspace(L1), lua_getextraspace(g->mainthread),
          LUA_EXTRASPACE);
   luai_userstatethread(L, L1);
-  stack_init(L1, L);  /* init stack */
+  stack_init(L1, L, stacksize);  /* init stack */
   lua_unlock(L);
   return L1;
 }
 
 
+LUA_API lua_State *lua_newthread (lua_State *L) {
+  return lua_newthreadsize(L, BASIC_STACK_SIZE);
+}
+
+
+/*
+** reset a thread that is not running to the state of a new thread
+** created by the main thread, keeping its stack and 'ci' list (and
+** its hooks); returns LUA_OK or, if the thread had stopped with an
+** error, its error status
+*/
+LUA_API int lua_resetthread (lua_State *L) {
+  CallInfo *ci = &L->base_ci;
+  int status;
+  lua_lock(L);
+  status = (L->status == LUA_YIELD) ? LUA_OK : L->status;
+  L->ci = ci;
+  luaF_close(L, L->stack);  /* close all upvalues */
+  setnilvalue(L->stack);  /* 'function' entry for basic 'ci' */
+  ci->func = L->stack;
+  ci->callstatus = 0;
+  L->top = L->stack + 1;
+  ci->top = L->top + LUA_MINSTACK;
+  L->status = LUA_OK;
+  L->errorJmp = NULL;
+  L->oldpc = NULL;
+  L->errfunc = 0;
+  L->nny = 1;
+  L->nCcalls = 0;
+  L->allowhook = 1;
+  resethookcount(L);
+  L->idlecycles = 0;
+  memcpy(lua_getextraspace(L), lua_getextraspace(G(L)->mainthread),
+         LUA_EXTRASPACE);
+  lua_unlock(L);
+  return status;
+}
+
+
 void luaE_freethread (lua_State *L, lua_State *L1) {
   LX *l = fromstate(L1);
   luaF_close(L1, L1->stack);  /* close all upvalues for this thread */
@@ -302,11 +403,16 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->mainthread = L;
   g->seed = makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
+  g->gcdeferfin = 0;
+  g->errmode = LUA_ERRMODE_THROW;
   g->GCestimate = 0;
   g->strt.size = g->strt.nuse = 0;
   g->strt.hash = NULL;
   setnilvalue(&g->l_registry);
   g->buff.init();
+#if defined(LUAI_GCPOOL)
+  g->pool.init();
+#endif
   g->panic = NULL;
   g->version = NULL;
   g->gcstate = GCSpause;
@@ -315,12 +421,22 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->sweepgc = NULL;
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = NULL;
+  g->ephdeps = NULL;
   g->twups = NULL;
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
   g->gcfinnum = 0;
   g->gcpause = LUAI_GCPAUSE;
   g->gcstepmul = LUAI_GCMUL;
+  g->gctarget = g->gctargetpause = g->gcslice = 0;
+  g->gcsample = g->gcsamplecount = g->nallocsites = 0;
+  g->allocsites = NULL;
+  g->allocsitehash = NULL;
+  g->gcpacedmul = LUAI_GCMUL;
+  g->GCstepsize = GCSTEPSIZE;
+  g->GCcyclestart = g->GCpeak = 0;
+  g->gcallocfactor = cast_num(2 * LUAI_GCMUL);  /* conservative guess */
+  g->gcthroughput = 0;
   for (i=0; i < LUA_NUMTAGS; i++) g->mt[i] = NULL;
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
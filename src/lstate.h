@@ -31,6 +31,8 @@
 
 
 struct lua_longjmp;  /* defined in ldo.c */
+struct EphemeronDeps;  /* defined in lgc.c */
+struct AllocSite;  /* defined in ldebug.h */
 
 
 
@@ -40,6 +42,9 @@ struct lua_longjmp;  /* defined in ldo.c */
 
 #define BASIC_STACK_SIZE        (2*LUA_MINSTACK)
 
+/* smallest stack for a thread: its function plus LUA_MINSTACK slots */
+#define MIN_STACK_SIZE		(1 + LUA_MINSTACK + EXTRA_STACK)
+
 
 /* kinds of Garbage Collection */
 #define KGC_NORMAL	0
@@ -103,6 +108,31 @@ typedef struct CallInfo {
 #define getoah(st)	((st) & CIST_OAH)
 
 
+#if defined(LUAI_GCPOOL)
+
+#define GCPOOLGRAIN	16  /* sizes of pool classes are multiples of it */
+#define GCPOOLCLASSES	((LUAI_GCPOOLMAX + GCPOOLGRAIN - 1) / GCPOOLGRAIN)
+
+/*
+** Pool of small collectable objects (see lmem.c)
+*/
+struct GCPool {
+  void *freelist[GCPOOLCLASSES];  /* free blocks of each size class */
+  char *top;  /* first free byte in current chunk */
+  char *limit;  /* end of current chunk */
+  void *chunks;  /* list of all chunks */
+  lu_mem nfree;  /* bytes in free blocks */
+  inline void init(void) {
+    for (int i = 0; i < GCPOOLCLASSES; i++) freelist[i] = NULL;
+    top = limit = NULL;
+    chunks = NULL;
+    nfree = 0;
+  }
+};
+
+#endif
+
+
 /*
 ** 'global state', shared by all threads of this state
 */
@@ -120,6 +150,8 @@ typedef struct global_State {
   lu_byte gcstate;  /* state of garbage collector */
   lu_byte gckind;  /* kind of GC running */
   lu_byte gcrunning;  /* true if GC is running */
+  lu_byte gcdeferfin;  /* true if finalizers only run when requested */
+  lu_byte errmode;  /* mechanism for new error handlers (LUA_ERRMODE_*) */
   GCObject *allgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* current position of sweep in list */
   GCObject *finobj;  /* list of collectable objects with finalizers */
@@ -128,13 +160,31 @@ typedef struct global_State {
   GCObject *weak;  /* list of tables with weak values */
   GCObject *ephemeron;  /* list of ephemeron tables (weak keys) */
   GCObject *allweak;  /* list of all-weak tables */
+  struct EphemeronDeps *ephdeps;  /* pending ephemeron entries (atomic) */
   GCObject *tobefnz;  /* list of userdata to be GC */
   GCObject *fixedgc;  /* list of objects not to be collected */
   struct lua_State *twups;  /* list of threads with open upvalues */
   Mbuffer buff;  /* temporary buffer for string concatenation */
+#if defined(LUAI_GCPOOL)
+  GCPool pool;  /* small-object pool */
+#endif
   unsigned int gcfinnum;  /* number of finalizers to call in each GC step */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC 'granularity' */
+  int gctarget;  /* target heap overhead (%) for the pacer (0 = off) */
+  int gctargetpause;  /* target step pause (in microseconds) (0 = off) */
+  int gcslice;  /* time limit for each GC step (in microseconds) (0 = off) */
+  int gcsample;  /* sample one in 'gcsample' new objects (0 = off) */
+  int gcsamplecount;  /* new objects until next sample */
+  int nallocsites;  /* number of entries in 'allocsites' */
+  struct AllocSite *allocsites;  /* sites found by the heap sampler */
+  int *allocsitehash;  /* first site of each hash chain in 'allocsites' */
+  int gcpacedmul;  /* step multiplier chosen by the pacer */
+  l_mem GCstepsize;  /* work done by each basic GC step */
+  lu_mem GCcyclestart;  /* total bytes when current cycle started */
+  lu_mem GCpeak;  /* maximum total bytes seen in current cycle */
+  lua_Number gcallocfactor;  /* growth in a cycle per live byte * stepmul */
+  lua_Number gcthroughput;  /* GC work units done per microsecond */
   lua_CFunction panic;  /* to be called in unprotected errors */
   struct lua_State *mainthread;
   const lua_Number *version;  /* pointer to version number */
@@ -165,12 +215,15 @@ struct lua_State {
   lua_Hook hook;
   ptrdiff_t errfunc;  /* current error handling function (stack index) */
   int stacksize;
+  int minstacksize;  /* initial size; the stack never shrinks below it */
+  int nci;  /* number of entries in the 'ci' list after 'base_ci' */
   int basehookcount;
   int hookcount;
   unsigned short nny;  /* number of non-yieldable calls in stack */
   unsigned short nCcalls;  /* number of nested C calls */
   lu_byte hookmask;
   lu_byte allowhook;
+  lu_byte idlecycles;  /* GC cycles since stack or 'ci' list last grew */
 };
 
 
@@ -214,6 +267,11 @@ union GCUnion {
 /* actual number of total bytes allocated */
 #define gettotalbytes(g)	((g)->totalbytes + (g)->GCdebt)
 
+/* largest block of CallInfo entries allocated together (a power of 2) */
+#if !defined(LUAI_CIBLOCK)
+#define LUAI_CIBLOCK	8
+#endif
+
 LUAI_FUNC void luaE_setdebt (global_State *g, l_mem debt);
 LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
 LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
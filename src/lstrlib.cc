@@ -13,6 +13,7 @@
 #include <ctype.h>
 #include <float.h>
 #include <limits.h>
+#include <locale.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -196,6 +197,123 @@ static int str_dump (lua_State *L) {
 
 
 
+/*
+** {======================================================
+** CACHE OF COMPILED STRINGS
+** Patterns and format strings are compiled into userdata that are kept
+** in a small per-state cache, keyed by the address of their (interned)
+** string. A cache is a userdata with LUA_STRCACHESIZE entries, shared
+** as the first upvalue by the functions that use it; their second
+** upvalue is a table that keeps each entry's compiled object alive.
+** Each compiled object in turn keeps its string (as its user value),
+** so that the string address identifies the entry. Entries are grouped
+** in pairs; a new string replaces the least recently used entry of its
+** pair.
+** =======================================================
+*/
+
+/* number of entries in each cache (must be even) */
+#if !defined(LUA_STRCACHESIZE)
+#define LUA_STRCACHESIZE	64
+#endif
+
+
+typedef struct StrCache {
+  struct {
+    const char *s;  /* compiled string (NULL for empty entries) */
+    size_t l;
+    void *obj;  /* compiled object */
+  } entry[LUA_STRCACHESIZE];
+  unsigned char lru[LUA_STRCACHESIZE / 2];  /* entry to replace in pair */
+} StrCache;
+
+#define STRCACHE	lua_upvalueindex(1)
+#define STRCACHEANCHORS	lua_upvalueindex(2)
+
+
+/*
+** Compile 's' into a new userdata, left on the stack; return NULL (and
+** push nothing) if 's' is malformed
+*/
+typedef void *(*CompileF) (lua_State *L, const char *s, size_t l);
+
+/* check whether a cached object can still be used */
+typedef int (*ValidF) (const void *obj);
+
+
+/* index of the pair of entries for string 's' (with length 'l') */
+static unsigned int cachepair (const char *s, size_t l) {
+  return (((unsigned int)((size_t)s >> 3) ^ (unsigned int)l)
+          * 2654435769u >> 16) % (LUA_STRCACHESIZE / 2);
+}
+
+
+/*
+** Return the compiled form of string 's' (with length 'l') without
+** pushing it, or NULL if it is not in the cache; '*pe' gets its entry.
+*/
+static void *findcompiled (lua_State *L, const char *s, size_t l,
+                           ValidF valid, int *pe) {
+  StrCache *sc = (StrCache *)lua_touserdata(L, STRCACHE);
+  unsigned int pair = cachepair(s, l);
+  int h = (int)pair * 2;  /* first entry of the pair */
+  int i;
+  for (i = h; i < h + 2; i++) {
+    if (sc->entry[i].s == s && sc->entry[i].l == l &&
+        (valid == NULL || valid(sc->entry[i].obj))) {
+      sc->lru[pair] = (unsigned char)(h + 1 - i);  /* the other one */
+      *pe = i;
+      return sc->entry[i].obj;
+    }
+  }
+  return NULL;
+}
+
+
+/*
+** Push the compiled form of string 's' (with length 'l') from the
+** string at index 'arg', and return it; if the string is malformed,
+** push nil and return NULL. ('s' may skip a prefix of the string.)
+*/
+static void *getcompiled (lua_State *L, int arg, const char *s, size_t l,
+                          CompileF compile, ValidF valid) {
+  StrCache *sc = (StrCache *)lua_touserdata(L, STRCACHE);
+  unsigned int pair;
+  int h;
+  void *obj = findcompiled(L, s, l, valid, &h);
+  if (obj != NULL) {
+    lua_rawgeti(L, STRCACHEANCHORS, h + 1);  /* hit */
+    return obj;
+  }
+  pair = cachepair(s, l);
+  h = (int)pair * 2 + sc->lru[pair];  /* entry to be replaced */
+  sc->lru[pair] ^= 1;
+  obj = compile(L, s, l);
+  if (obj == NULL) {
+    lua_pushnil(L);
+    return NULL;
+  }
+  lua_pushvalue(L, arg);
+  lua_setuservalue(L, -2);  /* compiled object keeps its string */
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, STRCACHEANCHORS, h + 1);  /* replace old entry */
+  sc->entry[h].s = s;
+  sc->entry[h].l = l;
+  sc->entry[h].obj = obj;
+  return obj;
+}
+
+
+/* push the two upvalues for a new cache */
+static void createcache (lua_State *L) {
+  StrCache *sc = (StrCache *)lua_newuserdata(L, sizeof(StrCache));
+  memset(sc, 0, sizeof(StrCache));
+  lua_createtable(L, LUA_STRCACHESIZE, 0);
+}
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** PATTERN MATCHING
@@ -334,26 +452,29 @@ static int singlematch (MatchState *ms, const char *s, const char *p,
 }
 
 
-static const char *matchbalance (MatchState *ms, const char *s,
-                                   const char *p) {
-  if (p >= ms->p_end - 1)
-    luaL_error(ms->L, "malformed pattern (missing arguments to '%%b')");
-  if (*s != *p) return NULL;
+static const char *balance (MatchState *ms, const char *s, int b, int e) {
+  if (uchar(*s) != b) return NULL;
   else {
-    int b = *p;
-    int e = *(p+1);
     int cont = 1;
     while (++s < ms->src_end) {
-      if (*s == e) {
+      if (uchar(*s) == e) {
         if (--cont == 0) return s+1;
       }
-      else if (*s == b) cont++;
+      else if (uchar(*s) == b) cont++;
     }
   }
   return NULL;  /* string ends out of balance */
 }
 
 
+static const char *matchbalance (MatchState *ms, const char *s,
+                                   const char *p) {
+  if (p >= ms->p_end - 1)
+    luaL_error(ms->L, "malformed pattern (missing arguments to '%%b')");
+  return balance(ms, s, uchar(*p), uchar(*(p+1)));
+}
+
+
 static const char *max_expand (MatchState *ms, const char *s,
                                  const char *p, const char *ep) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
@@ -521,167 +642,780 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
-static const char *lmemfind (const char *s1, size_t l1,
-                               const char *s2, size_t l2) {
-  if (l2 == 0) return s1;  /* empty strings are everywhere */
-  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
-  else {
-    const char *init;  /* to search for a '*s2' inside 's1' */
-    l2--;  /* 1st char will be checked by 'memchr' */
-    l1 = l1-l2;  /* 's2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct 'l1' and 's1' to try again */
-        l1 -= init-s1;
-        s1 = init;
-      }
+/*
+** {======================================================
+** Compiled patterns: a pattern is translated once into a sequence of
+** 'PItem's, with character classes expanded into bitmaps and runs of
+** plain characters merged into literals. Compiled patterns are kept in
+** a per-state cache (see 'getcompiled').
+** Malformed patterns are not compiled; they go through 'match', which
+** reports the error when (and if) it reaches the faulty part.
+** =======================================================
+*/
+
+/* kinds of items in a compiled pattern */
+enum PItemOp {
+  PI_END, PI_OPEN, PI_POSITION, PI_CLOSE, PI_EOS, PI_BALANCE,
+  PI_FRONTIER, PI_BACKREF, PI_LITERAL,
+  PI_CHAR, PI_ANY, PI_SET  /* single-character classes */
+};
+
+
+#define SETSIZE		(UCHAR_MAX / CHAR_BIT + 1)
+#define inset(st,c)	((st)[(c) / CHAR_BIT] & (1 << ((c) % CHAR_BIT)))
+#define addtoset(st,c)	((st)[(c) / CHAR_BIT] |= (1 << ((c) % CHAR_BIT)))
+
+
+typedef struct PItem {
+  unsigned char op;  /* kind of item ('PItemOp') */
+  unsigned char rep;  /* suffix of a single class ('*', '+', '-', '?', 0) */
+  unsigned char c1, c2;  /* characters for PI_CHAR, PI_BALANCE, PI_BACKREF */
+  int len;  /* length of a literal */
+  union {
+    const char *lit;  /* contents of a literal */
+    const unsigned char *set;  /* bitmap for PI_SET and PI_FRONTIER */
+  } u;
+} PItem;
+
+
+#define LOCALESIZE	32
+
+typedef struct Prog {
+  int first;  /* first item that is not a capture opening (or -1) */
+  int ctype;  /* true if some bitmap depends on the locale */
+  char locale[LOCALESIZE];  /* 'LC_CTYPE' when the pattern was compiled */
+  PItem code[1];  /* items, followed by bitmaps and literal contents */
+} Prog;
+
+
+typedef struct CompileState {
+  const char *p_end;  /* end of pattern */
+  PItem *code;  /* NULL when only counting items */
+  unsigned char *sets;
+  char *lits;
+  int nitems, nsets, nlits;
+  int lastlit;  /* true if last item is a literal that can grow */
+  int ctype;
+  PItem dummyitem;  /* work areas when counting */
+  unsigned char dummyset[SETSIZE];
+} CompileState;
+
+
+/* 'classend' for the compiler: returns NULL for malformed classes */
+static const char *cclassend (CompileState *cs, const char *p) {
+  switch (*p++) {
+    case L_ESC: return (p == cs->p_end) ? NULL : p+1;
+    case '[': {
+      if (*p == '^') p++;
+      do {  /* look for a ']' */
+        if (p == cs->p_end) return NULL;
+        if (*(p++) == L_ESC && p < cs->p_end)
+          p++;  /* skip escapes (e.g. '%]') */
+      } while (*p != ']');
+      return p+1;
     }
-    return NULL;  /* not found */
+    default: return p;
   }
 }
 
 
-static void push_onecapture (MatchState *ms, int i, const char *s,
-                                                    const char *e) {
-  if (i >= ms->level) {
-    if (i == 0)  /* ms->level == 0, too */
-      lua_pushlstring(ms->L, s, e - s);  /* add whole match */
-    else
-      luaL_error(ms->L, "invalid capture index %%%d", i + 1);
-  }
-  else {
-    ptrdiff_t l = ms->capture[i].len;
-    if (l == CAP_UNFINISHED) luaL_error(ms->L, "unfinished capture");
-    if (l == CAP_POSITION)
-      lua_pushinteger(ms->L, (ms->capture[i].init - ms->src_init) + 1);
-    else
-      lua_pushlstring(ms->L, ms->capture[i].init, l);
+static PItem *newitem (CompileState *cs, int op) {
+  PItem *it = (cs->code) ? &cs->code[cs->nitems] : &cs->dummyitem;
+  cs->nitems++;
+  cs->lastlit = 0;
+  it->op = (unsigned char)op;
+  it->rep = it->c1 = it->c2 = 0;
+  it->len = 0;
+  it->u.lit = NULL;
+  return it;
+}
+
+
+/*
+** Create a bitmap for the class at 'p' (ending at 'ep'); only fills it
+** in the second pass.
+*/
+static const unsigned char *newset (CompileState *cs, const char *p,
+                                    const char *ep) {
+  unsigned char *st = (cs->code) ? cs->sets + cs->nsets * SETSIZE
+                                 : cs->dummyset;
+  cs->nsets++;
+  if (cs->code) {
+    int c;
+    memset(st, 0, SETSIZE);
+    for (c = 0; c <= UCHAR_MAX; c++) {
+      if (*p == '[' ? matchbracketclass(c, p, ep - 1)
+                    : match_class(c, uchar(*(p+1))))
+        addtoset(st, c);
+    }
   }
+  if (memchr(p, L_ESC, ep - p))  /* uses some class like '%a'? */
+    cs->ctype = 1;  /* its contents depend on the locale */
+  return st;
 }
 
 
-static int push_captures (MatchState *ms, const char *s, const char *e) {
-  int i;
-  int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
-  luaL_checkstack(ms->L, nlevels, "too many captures");
-  for (i = 0; i < nlevels; i++)
-    push_onecapture(ms, i, s, e);
-  return nlevels;  /* number of strings pushed */
+static void addliteral (CompileState *cs, int c) {
+  if (!cs->lastlit) {  /* start a new literal? */
+    PItem *it = newitem(cs, PI_LITERAL);
+    it->u.lit = cs->lits + cs->nlits;
+    cs->lastlit = 1;
+  }
+  if (cs->code) {
+    cs->lits[cs->nlits] = (char)c;
+    cs->code[cs->nitems - 1].len++;
+  }
+  cs->nlits++;
 }
 
 
-/* check whether pattern has no special characters */
-static int nospecials (const char *p, size_t l) {
-  size_t upto = 0;
-  do {
-    if (strpbrk(p + upto, SPECIALS))
-      return 0;  /* pattern has a special character */
-    upto += strlen(p + upto) + 1;  /* may have more after \0 */
-  } while (upto <= l);
-  return 1;  /* no special chars found */
+static int isclassletter (int cl) {
+  return (cl != 0 && strchr("acdglpsuwxz", tolower(cl)) != NULL);
 }
 
 
-static int str_find_aux (lua_State *L, int find) {
-  size_t ls, lp;
-  const char *s = luaL_checklstring(L, 1, &ls);
-  const char *p = luaL_checklstring(L, 2, &lp);
-  lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
-  if (init < 1) init = 1;
-  else if (init > (lua_Integer)ls + 1) {  /* start after string's end? */
-    lua_pushnil(L);  /* cannot find anything */
-    return 1;
+/*
+** Compile the single-character class at 'p' (ending at 'ep') plus its
+** optional suffix; return what follows them.
+*/
+static const char *compileclass (CompileState *cs, const char *p,
+                                 const char *ep) {
+  int rep = 0;
+  PItem *it;
+  if (ep < cs->p_end &&
+      (*ep == '*' || *ep == '+' || *ep == '-' || *ep == '?'))
+    rep = uchar(*ep);
+  if (*p == '.')
+    it = newitem(cs, PI_ANY);
+  else if (*p == '[' || (*p == L_ESC && isclassletter(uchar(*(p+1))))) {
+    it = newitem(cs, PI_SET);
+    it->u.set = newset(cs, p, ep);
   }
-  /* explicit request or no special characters? */
-  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
-    /* do a plain search */
-    const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp);
-    if (s2) {
-      lua_pushinteger(L, (s2 - s) + 1);
-      lua_pushinteger(L, (s2 - s) + lp);
-      return 2;
+  else {  /* single character (maybe escaped) */
+    int c = (*p == L_ESC) ? uchar(*(p+1)) : uchar(*p);
+    if (rep == 0) {  /* plain character? */
+      addliteral(cs, c);
+      return ep;
     }
+    it = newitem(cs, PI_CHAR);
+    it->c1 = (unsigned char)c;
   }
-  else {
-    MatchState ms;
-    const char *s1 = s + init - 1;
-    int anchor = (*p == '^');
-    if (anchor) {
-      p++; lp--;  /* skip anchor character */
-    }
-    ms.L = L;
-    ms.matchdepth = MAXCCALLS;
-    ms.src_init = s;
-    ms.src_end = s + ls;
-    ms.p_end = p + lp;
-    do {
-      const char *res;
-      ms.level = 0;
-      lua_assert(ms.matchdepth == MAXCCALLS);
-      if ((res=match(&ms, s1, p)) != NULL) {
-        if (find) {
-          lua_pushinteger(L, (s1 - s) + 1);  /* start */
-          lua_pushinteger(L, res - s);   /* end */
-          return push_captures(&ms, NULL, 0) + 2;
+  it->rep = (unsigned char)rep;
+  return (rep) ? ep + 1 : ep;
+}
+
+
+/* translate pattern 'p'; returns 0 if pattern is malformed */
+static int compile (CompileState *cs, const char *p) {
+  while (p < cs->p_end) {
+    switch (*p) {
+      case '(': {
+        if (*(p + 1) == ')') {  /* position capture? */
+          newitem(cs, PI_POSITION);
+          p += 2;
         }
-        else
-          return push_captures(&ms, s1, res);
+        else {
+          newitem(cs, PI_OPEN);
+          p++;
+        }
+        break;
       }
-    } while (s1++ < ms.src_end && !anchor);
+      case ')': {
+        newitem(cs, PI_CLOSE);
+        p++;
+        break;
+      }
+      case '$': {
+        if ((p + 1) != cs->p_end)  /* is the '$' the last char in pattern? */
+          goto dflt;
+        newitem(cs, PI_EOS);
+        p++;
+        break;
+      }
+      case L_ESC: {
+        switch (*(p + 1)) {
+          case 'b': {
+            PItem *it;
+            if (p + 2 >= cs->p_end - 1)
+              return 0;  /* missing arguments to '%b' */
+            it = newitem(cs, PI_BALANCE);
+            it->c1 = uchar(*(p + 2));
+            it->c2 = uchar(*(p + 3));
+            p += 4;
+            break;
+          }
+          case 'f': {
+            const char *ep;
+            p += 2;
+            if (*p != '[' || (ep = cclassend(cs, p)) == NULL)
+              return 0;
+            newitem(cs, PI_FRONTIER)->u.set = newset(cs, p, ep);
+            p = ep;
+            break;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {
+            newitem(cs, PI_BACKREF)->c1 = uchar(*(p + 1));
+            p += 2;
+            break;
+          }
+          default: goto dflt;
+        }
+        break;
+      }
+      default: dflt: {
+        const char *ep = cclassend(cs, p);
+        if (ep == NULL) return 0;
+        p = compileclass(cs, p, ep);
+        break;
+      }
+    }
   }
-  lua_pushnil(L);  /* not found */
+  newitem(cs, PI_END);
   return 1;
 }
 
 
-static int str_find (lua_State *L) {
-  return str_find_aux(L, 1);
+/*
+** Compile pattern 'p' into a new userdata, left on the stack; returns
+** NULL (and pushes nothing) if the pattern is malformed. The first
+** pass only counts items, bitmaps, and literal characters.
+*/
+static void *compilepattern (lua_State *L, const char *p, size_t lp) {
+  CompileState cs;
+  Prog *prog;
+  const char *loc;
+  memset(&cs, 0, sizeof(cs));
+  cs.p_end = p + lp;
+  if (!compile(&cs, p))
+    return NULL;
+  prog = (Prog *)lua_newuserdata(L, offsetof(Prog, code) +
+                                    cs.nitems * sizeof(PItem) +
+                                    cs.nsets * SETSIZE + cs.nlits);
+  cs.code = prog->code;
+  cs.sets = (unsigned char *)(cs.code + cs.nitems);
+  cs.lits = (char *)(cs.sets + cs.nsets * SETSIZE);
+  cs.nitems = cs.nsets = cs.nlits = 0;
+  compile(&cs, p);
+  for (prog->first = 0; prog->code[prog->first].op == PI_OPEN ||
+                        prog->code[prog->first].op == PI_POSITION;
+       prog->first++) {
+    if (prog->first == LUA_MAXCAPTURES) {  /* would raise an error? */
+      prog->first = -1;  /* cannot skip positions */
+      break;
+    }
+  }
+  prog->ctype = cs.ctype;
+  loc = setlocale(LC_CTYPE, NULL);
+  if (loc != NULL && strlen(loc) < LOCALESIZE)
+    strcpy(prog->locale, loc);
+  else
+    prog->locale[0] = '\0';  /* do not reuse it if it depends on locale */
+  return prog;
 }
 
 
-static int str_match (lua_State *L) {
-  return str_find_aux(L, 0);
+/* check whether 'prog' was compiled under the current locale */
+static int validprog (const void *obj) {
+  const Prog *prog = (const Prog *)obj;
+  const char *loc;
+  if (!prog->ctype) return 1;
+  loc = setlocale(LC_CTYPE, NULL);
+  return (loc != NULL && prog->locale[0] != '\0' &&
+          strcmp(loc, prog->locale) == 0);
 }
 
 
-static int gmatch_aux (lua_State *L) {
-  MatchState ms;
-  size_t ls, lp;
-  const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
-  const char *p = lua_tolstring(L, lua_upvalueindex(2), &lp);
-  const char *src;
-  ms.L = L;
-  ms.matchdepth = MAXCCALLS;
-  ms.src_init = s;
-  ms.src_end = s+ls;
-  ms.p_end = p + lp;
-  for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
-       src <= ms.src_end;
-       src++) {
-    const char *e;
-    ms.level = 0;
-    lua_assert(ms.matchdepth == MAXCCALLS);
-    if ((e = match(&ms, src, p)) != NULL) {
-      lua_Integer newstart = e-s;
-      if (e == src) newstart++;  /* empty match? go at least one position */
-      lua_pushinteger(L, newstart);
-      lua_replace(L, lua_upvalueindex(3));
-      return push_captures(&ms, src, e);
-    }
+/* Push the compiled form of a pattern (see 'getcompiled') */
+static Prog *getprog (lua_State *L, int arg, const char *p, size_t lp) {
+  return (Prog *)getcompiled(L, arg, p, lp, compilepattern, validprog);
+}
+
+
+/* recursive function */
+static const char *cmatch (MatchState *ms, const char *s, const PItem *it);
+
+
+static int csinglematch (MatchState *ms, const char *s, const PItem *it) {
+  if (s >= ms->src_end)
+    return 0;
+  switch (it->op) {
+    case PI_CHAR: return (uchar(*s) == it->c1);
+    case PI_SET: return inset(it->u.set, uchar(*s));
+    default: return 1;  /* PI_ANY */
   }
-  return 0;  /* not found */
 }
 
 
-static int gmatch (lua_State *L) {
-  luaL_checkstring(L, 1);
-  luaL_checkstring(L, 2);
-  lua_settop(L, 2);
-  lua_pushinteger(L, 0);
-  lua_pushcclosure(L, gmatch_aux, 3);
-  return 1;
+static const char *cmax_expand (MatchState *ms, const char *s,
+                                  const PItem *it) {
+  const PItem *next = it + 1;
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  switch (it->op) {
+    case PI_ANY: i = ms->src_end - s; break;
+    case PI_CHAR: {
+      while (s + i < ms->src_end && uchar(s[i]) == it->c1) i++;
+      break;
+    }
+    default: {
+      while (s + i < ms->src_end && inset(it->u.set, uchar(s[i]))) i++;
+      break;
+    }
+  }
+  if (next->op == PI_END)  /* nothing else to match? */
+    return s + i;
+  else if (next->op == PI_LITERAL) {
+    /* try only the positions where the literal can start */
+    char c = next->u.lit[0];
+    for (; i >= 0; i--) {
+      if (s + i < ms->src_end && s[i] == c) {
+        const char *res = cmatch(ms, s + i, next);
+        if (res) return res;
+      }
+    }
+    return NULL;
+  }
+  /* keeps trying to match with the maximum repetitions */
+  for (; i >= 0; i--) {
+    const char *res = cmatch(ms, s + i, next);
+    if (res) return res;
+  }
+  return NULL;
+}
+
+
+static const char *cmin_expand (MatchState *ms, const char *s,
+                                  const PItem *it) {
+  for (;;) {
+    const char *res = cmatch(ms, s, it + 1);
+    if (res != NULL)
+      return res;
+    else if (csinglematch(ms, s, it))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *cstart_capture (MatchState *ms, const char *s,
+                                     const PItem *it, int what) {
+  const char *res;
+  int level = ms->level;
+  if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=cmatch(ms, s, it)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *cend_capture (MatchState *ms, const char *s,
+                                   const PItem *it) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = cmatch(ms, s, it)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+/* same as 'match', over a compiled pattern */
+static const char *cmatch (MatchState *ms, const char *s, const PItem *it) {
+  if (ms->matchdepth-- == 0)
+    luaL_error(ms->L, "pattern too complex");
+  init: /* using goto's to optimize tail recursion */
+  switch (it->op) {
+    case PI_END: break;
+    case PI_OPEN: {
+      s = cstart_capture(ms, s, it + 1, CAP_UNFINISHED);
+      break;
+    }
+    case PI_POSITION: {
+      s = cstart_capture(ms, s, it + 1, CAP_POSITION);
+      break;
+    }
+    case PI_CLOSE: {
+      s = cend_capture(ms, s, it + 1);
+      break;
+    }
+    case PI_EOS: {
+      s = (s == ms->src_end) ? s : NULL;  /* check end of string */
+      break;
+    }
+    case PI_LITERAL: {
+      if (ms->src_end - s >= it->len && *s == *it->u.lit &&
+          memcmp(s, it->u.lit, it->len) == 0) {
+        s += it->len; it++; goto init;
+      }
+      s = NULL;
+      break;
+    }
+    case PI_BALANCE: {
+      s = balance(ms, s, it->c1, it->c2);
+      if (s != NULL) {
+        it++; goto init;
+      }
+      break;
+    }
+    case PI_FRONTIER: {
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s - 1));
+      if (!inset(it->u.set, previous) && inset(it->u.set, uchar(*s))) {
+        it++; goto init;
+      }
+      s = NULL;
+      break;
+    }
+    case PI_BACKREF: {
+      s = match_capture(ms, s, it->c1);
+      if (s != NULL) {
+        it++; goto init;
+      }
+      break;
+    }
+    default: {  /* single-character class plus optional suffix */
+      if (!csinglematch(ms, s, it)) {
+        if (it->rep == '*' || it->rep == '?' || it->rep == '-') {
+          it++; goto init;  /* accept empty */
+        }
+        s = NULL;  /* '+' or no suffix: fail */
+      }
+      else {  /* matched once */
+        switch (it->rep) {
+          case '?': {
+            const char *res;
+            if ((res = cmatch(ms, s + 1, it + 1)) != NULL)
+              s = res;
+            else {
+              it++; goto init;
+            }
+            break;
+          }
+          case '+':  /* 1 or more repetitions */
+            s++;  /* 1 match already done */
+            /* FALLTHROUGH */
+          case '*':  /* 0 or more repetitions */
+            s = cmax_expand(ms, s, it);
+            break;
+          case '-':  /* 0 or more repetitions (minimum) */
+            s = cmin_expand(ms, s, it);
+            break;
+          default:  /* no suffix */
+            s++; it++; goto init;
+        }
+      }
+      break;
+    }
+  }
+  ms->matchdepth++;
+  return s;
+}
+
+
+/* run the compiled pattern, if there is one, or interpret 'p' */
+static const char *domatch (MatchState *ms, const char *s, const char *p,
+                            const Prog *prog) {
+  return (prog != NULL) ? cmatch(ms, s, prog->code) : match(ms, s, p);
+}
+
+/* }====================================================== */
+
+
+/*
+** Substring search. The search starts with 'memchr' on the first
+** character of the needle, which is hard to beat while that character
+** is rare. After LUA_MEMFINDMISSES false candidates, it switches to
+** one of two engines: long needles in long subjects use Horspool's
+** algorithm; other needles test a word's worth of candidate positions
+** at a time, looking for positions where both the first and the last
+** characters of the needle match.
+*/
+
+/* false candidates from 'memchr' before switching engines */
+#if !defined(LUA_MEMFINDMISSES)
+#define LUA_MEMFINDMISSES	8
+#endif
+
+/* minimum lengths of needle and subject to use Horspool's algorithm */
+#if !defined(LUA_HORSPOOLNEEDLE)
+#define LUA_HORSPOOLNEEDLE	16
+#endif
+
+#if !defined(LUA_HORSPOOLSUBJECT)
+#define LUA_HORSPOOLSUBJECT	1024
+#endif
+
+
+#define WORDSIZE	sizeof(size_t)
+#define BYTEONES	(~(size_t)0 / UCHAR_MAX)  /* 0x0101...01 */
+#define BYTEHIGHS	(BYTEONES << (CHAR_BIT - 1))  /* 0x8080...80 */
+
+/* true if word 'w' has a zero byte (may also flag bytes after it) */
+#define haszerobyte(w)	(((w) - BYTEONES) & ~(w) & BYTEHIGHS)
+
+
+/* check for 's2' at 's1', where first and last chars are known equal */
+#define matchmiddle(s1,s2,l2)	(memcmp((s1) + 1, (s2) + 1, (l2) - 2) == 0)
+
+
+static const char *firstlastfind (const char *s1, size_t l1,
+                                  const char *s2, size_t l2) {
+  size_t first = BYTEONES * uchar(s2[0]);
+  size_t last = BYTEONES * uchar(s2[l2 - 1]);
+  size_t i = 0;
+  size_t n = l1 - l2 + 1;  /* number of positions to try */
+  for (; i + WORDSIZE <= n; i += WORDSIZE) {  /* a whole word of them */
+    size_t a, b;
+    memcpy(&a, s1 + i, WORDSIZE);  /* first chars of candidates */
+    memcpy(&b, s1 + i + l2 - 1, WORDSIZE);  /* last chars of candidates */
+    if (haszerobyte((a ^ first) | (b ^ last))) {  /* some candidate? */
+      size_t j;
+      for (j = i; j < i + WORDSIZE; j++) {
+        if (s1[j] == s2[0] && s1[j + l2 - 1] == s2[l2 - 1] &&
+            matchmiddle(s1 + j, s2, l2))
+          return s1 + j;
+      }
+    }
+  }
+  for (; i < n; i++) {  /* remaining positions */
+    if (s1[i] == s2[0] && s1[i + l2 - 1] == s2[l2 - 1] &&
+        matchmiddle(s1 + i, s2, l2))
+      return s1 + i;
+  }
+  return NULL;
+}
+
+
+static const char *horspoolfind (const char *s1, size_t l1,
+                                 const char *s2, size_t l2) {
+  size_t skip[UCHAR_MAX + 1];  /* shift for each last character */
+  int lastc = uchar(s2[l2 - 1]);
+  size_t i;
+  for (i = 0; i <= UCHAR_MAX; i++)
+    skip[i] = l2;
+  for (i = 0; i < l2 - 1; i++)
+    skip[uchar(s2[i])] = l2 - 1 - i;
+  for (i = 0; i <= l1 - l2; i += skip[uchar(s1[i + l2 - 1])]) {
+    if (uchar(s1[i + l2 - 1]) == lastc && memcmp(s1 + i, s2, l2 - 1) == 0)
+      return s1 + i;
+  }
+  return NULL;
+}
+
+
+static const char *lmemfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  if (l2 == 0) return s1;  /* empty strings are everywhere */
+  else if (l2 > l1) return NULL;  /* avoids a negative 'l1' */
+  else {
+    const char *init;  /* to search for a '*s2' inside 's1' */
+    int misses = 0;
+    while ((init = (const char *)memchr(s1, *s2, l1 - l2 + 1)) != NULL) {
+      if (memcmp(init + 1, s2 + 1, l2 - 1) == 0)
+        return init;
+      l1 -= (init + 1) - s1;  /* correct 'l1' and 's1' to try again */
+      s1 = init + 1;
+      if (l2 > l1)
+        break;
+      else if (++misses == LUA_MEMFINDMISSES) {  /* 1st char is frequent? */
+        if (l2 >= LUA_HORSPOOLNEEDLE && l1 >= LUA_HORSPOOLSUBJECT)
+          return horspoolfind(s1, l1, s2, l2);
+        else
+          return firstlastfind(s1, l1, s2, l2);
+      }
+    }
+    return NULL;  /* not found */
+  }
+}
+
+
+/*
+** First position from 's' where a match for 'prog' may start, or NULL
+** if there is none. For unanchored searches. Looks at the first item
+** after any capture openings: a literal is searched with 'lmemfind',
+** and a class that must match at least once (as in '%d+' or '%s') with
+** 'memchr' or a scan of its bitmap.
+*/
+static const char *firstcandidate (MatchState *ms, const char *s,
+                                   const Prog *prog) {
+  const PItem *it;
+  if (prog == NULL || prog->first < 0)
+    return s;
+  it = &prog->code[prog->first];
+  switch (it->op) {
+    case PI_LITERAL:
+      return lmemfind(s, ms->src_end - s, it->u.lit, it->len);
+    case PI_BALANCE:
+      return (const char *)memchr(s, it->c1, ms->src_end - s);
+    case PI_EOS:
+      return ms->src_end;
+    case PI_CHAR: case PI_SET: {
+      if (it->rep != 0 && it->rep != '+')
+        return s;  /* can match the empty string */
+      if (it->op == PI_CHAR)
+        return (const char *)memchr(s, it->c1, ms->src_end - s);
+      while (s < ms->src_end && !inset(it->u.set, uchar(*s)))
+        s++;
+      return (s < ms->src_end) ? s : NULL;
+    }
+    default:
+      return s;
+  }
+}
+
+
+static void push_onecapture (MatchState *ms, int i, const char *s,
+                                                    const char *e) {
+  if (i >= ms->level) {
+    if (i == 0)  /* ms->level == 0, too */
+      lua_pushlstring(ms->L, s, e - s);  /* add whole match */
+    else
+      luaL_error(ms->L, "invalid capture index %%%d", i + 1);
+  }
+  else {
+    ptrdiff_t l = ms->capture[i].len;
+    if (l == CAP_UNFINISHED) luaL_error(ms->L, "unfinished capture");
+    if (l == CAP_POSITION)
+      lua_pushinteger(ms->L, (ms->capture[i].init - ms->src_init) + 1);
+    else
+      lua_pushlstring(ms->L, ms->capture[i].init, l);
+  }
+}
+
+
+static int push_captures (MatchState *ms, const char *s, const char *e) {
+  int i;
+  int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
+  luaL_checkstack(ms->L, nlevels, "too many captures");
+  for (i = 0; i < nlevels; i++)
+    push_onecapture(ms, i, s, e);
+  return nlevels;  /* number of strings pushed */
+}
+
+
+/* check whether pattern has no special characters */
+static int nospecials (const char *p, size_t l) {
+  size_t upto = 0;
+  do {
+    if (strpbrk(p + upto, SPECIALS))
+      return 0;  /* pattern has a special character */
+    upto += strlen(p + upto) + 1;  /* may have more after \0 */
+  } while (upto <= l);
+  return 1;  /* no special chars found */
+}
+
+
+static int str_find_aux (lua_State *L, int find) {
+  size_t ls, lp;
+  const char *s = luaL_checklstring(L, 1, &ls);
+  const char *p = luaL_checklstring(L, 2, &lp);
+  lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
+  if (init < 1) init = 1;
+  else if (init > (lua_Integer)ls + 1) {  /* start after string's end? */
+    lua_pushnil(L);  /* cannot find anything */
+    return 1;
+  }
+  /* explicit request or no special characters? */
+  if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
+    /* do a plain search */
+    const char *s2 = lmemfind(s + init - 1, ls - (size_t)init + 1, p, lp);
+    if (s2) {
+      lua_pushinteger(L, (s2 - s) + 1);
+      lua_pushinteger(L, (s2 - s) + lp);
+      return 2;
+    }
+  }
+  else {
+    MatchState ms;
+    const char *s1 = s + init - 1;
+    int anchor = (*p == '^');
+    const Prog *prog;
+    if (anchor) {
+      p++; lp--;  /* skip anchor character */
+    }
+    prog = getprog(L, 2, p, lp);
+    ms.L = L;
+    ms.matchdepth = MAXCCALLS;
+    ms.src_init = s;
+    ms.src_end = s + ls;
+    ms.p_end = p + lp;
+    do {
+      const char *res;
+      if (!anchor && (s1 = firstcandidate(&ms, s1, prog)) == NULL)
+        break;  /* no more candidates */
+      ms.level = 0;
+      lua_assert(ms.matchdepth == MAXCCALLS);
+      if ((res=domatch(&ms, s1, p, prog)) != NULL) {
+        if (find) {
+          lua_pushinteger(L, (s1 - s) + 1);  /* start */
+          lua_pushinteger(L, res - s);   /* end */
+          return push_captures(&ms, NULL, 0) + 2;
+        }
+        else
+          return push_captures(&ms, s1, res);
+      }
+    } while (s1++ < ms.src_end && !anchor);
+  }
+  lua_pushnil(L);  /* not found */
+  return 1;
+}
+
+
+static int str_find (lua_State *L) {
+  return str_find_aux(L, 1);
+}
+
+
+static int str_match (lua_State *L) {
+  return str_find_aux(L, 0);
+}
+
+
+static int gmatch_aux (lua_State *L) {
+  MatchState ms;
+  size_t ls, lp;
+  const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
+  const char *p = lua_tolstring(L, lua_upvalueindex(2), &lp);
+  const Prog *prog = (const Prog *)lua_touserdata(L, lua_upvalueindex(4));
+  const char *src;
+  ms.L = L;
+  ms.matchdepth = MAXCCALLS;
+  ms.src_init = s;
+  ms.src_end = s+ls;
+  ms.p_end = p + lp;
+  for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
+       src <= ms.src_end;
+       src++) {
+    const char *e;
+    if ((src = firstcandidate(&ms, src, prog)) == NULL)
+      break;  /* no more candidates */
+    ms.level = 0;
+    lua_assert(ms.matchdepth == MAXCCALLS);
+    if ((e = domatch(&ms, src, p, prog)) != NULL) {
+      lua_Integer newstart = e-s;
+      if (e == src) newstart++;  /* empty match? go at least one position */
+      lua_pushinteger(L, newstart);
+      lua_replace(L, lua_upvalueindex(3));
+      return push_captures(&ms, src, e);
+    }
+  }
+  return 0;  /* not found */
+}
+
+
+static int gmatch (lua_State *L) {
+  size_t lp;
+  const char *p;
+  luaL_checkstring(L, 1);
+  p = luaL_checklstring(L, 2, &lp);
+  lua_settop(L, 2);
+  lua_pushinteger(L, 0);
+  getprog(L, 2, p, lp);  /* compiled pattern (or nil) */
+  lua_pushcclosure(L, gmatch_aux, 4);
+  return 1;
 }
 
 
@@ -754,13 +1488,15 @@ static int str_gsub (lua_State *L) {
   lua_Integer n = 0;
   MatchState ms;
   luaL_Buffer b;
+  const Prog *prog;
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
-  luaL_buffinit(L, &b);
   if (anchor) {
     p++; lp--;  /* skip anchor character */
   }
+  prog = getprog(L, 2, p, lp);  /* (must be pushed before the buffer) */
+  luaL_buffinit(L, &b);
   ms.L = L;
   ms.matchdepth = MAXCCALLS;
   ms.src_init = src;
@@ -768,9 +1504,15 @@ static int str_gsub (lua_State *L) {
   ms.p_end = p + lp;
   while (n < max_s) {
     const char *e;
+    if (!anchor) {  /* skip positions where no match can start */
+      const char *c = firstcandidate(&ms, src, prog);
+      if (c == NULL) break;
+      luaL_addlstring(&b, src, c - src);
+      src = c;
+    }
     ms.level = 0;
     lua_assert(ms.matchdepth == MAXCCALLS);
-    e = match(&ms, src, p);
+    e = domatch(&ms, src, p, prog);
     if (e) {
       n++;
       add_value(&ms, &b, src, e, tr);
@@ -918,11 +1660,20 @@ static void addquoted (lua_State *L, luaL_Buffer *b, int arg) {
   luaL_addchar(b, '"');
 }
 
-static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+/*
+** Read the flags, width, and precision of a format item into 'form'
+** (as "%flags-width.precision<conv>") and return a pointer to the
+** conversion character; return NULL with a message in 'err' if the
+** item is invalid.
+*/
+static const char *checkformat (const char *strfrmt, char *form,
+                                const char **err) {
   const char *p = strfrmt;
   while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
-  if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char))
-    luaL_error(L, "invalid format (repeated flags)");
+  if ((size_t)(p - strfrmt) >= sizeof(FLAGS)/sizeof(char)) {
+    *err = "invalid format (repeated flags)";
+    return NULL;
+  }
   if (isdigit(uchar(*p))) p++;  /* skip width */
   if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   if (*p == '.') {
@@ -930,8 +1681,10 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
     if (isdigit(uchar(*p))) p++;  /* skip precision */
     if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   }
-  if (isdigit(uchar(*p)))
-    luaL_error(L, "invalid format (width or precision too long)");
+  if (isdigit(uchar(*p))) {
+    *err = "invalid format (width or precision too long)";
+    return NULL;
+  }
   *(form++) = '%';
   memcpy(form, strfrmt, ((p - strfrmt) + 1) * sizeof(char));
   form += (p - strfrmt) + 1;
@@ -940,6 +1693,15 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
 }
 
 
+static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+  const char *err;
+  const char *p = checkformat(strfrmt, form, &err);
+  if (p == NULL)
+    luaL_error(L, "%s", err);
+  return p;
+}
+
+
 /*
 ** add length modifier into formats
 */
@@ -953,78 +1715,614 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
-static int str_format (lua_State *L) {
+/* add the length modifier that conversion 'conv' needs, if any */
+static void fixlenmod (char *form, int conv) {
+  if (strchr("diouxX", conv))
+    addlenmod(form, LUA_INTEGER_FRMLEN);
+  else if (strchr("aAeEfgG", conv))
+    addlenmod(form, LUA_NUMBER_FRMLEN);
+}
+
+
+/*
+** Add the value at index 'arg' converted with format item 'form' (which
+** already has its length modifier) for conversion 'conv'.
+*/
+static void addconv (lua_State *L, luaL_Buffer *b, int arg, int conv,
+                     const char *form) {
+  char *buff = luaL_prepbuffsize(b, MAX_ITEM);  /* to put formatted item */
+  int nb = 0;  /* number of bytes in added item */
+  switch (conv) {
+    case 'c': {
+      nb = sprintf(buff, form, (int)luaL_checkinteger(L, arg));
+      break;
+    }
+    case 'd': case 'i':
+    case 'o': case 'u': case 'x': case 'X': {
+      lua_Integer n = luaL_checkinteger(L, arg);
+      nb = sprintf(buff, form, n);
+      break;
+    }
+    case 'a': case 'A':
+      nb = lua_number2strx(L, buff, form, luaL_checknumber(L, arg));
+      break;
+    case 'e': case 'E': case 'f':
+    case 'g': case 'G': {
+      nb = sprintf(buff, form, luaL_checknumber(L, arg));
+      break;
+    }
+    case 'q': {
+      addquoted(L, b, arg);
+      break;
+    }
+    case 's': {
+      size_t l;
+      const char *s = luaL_tolstring(L, arg, &l);
+      if (!strchr(form, '.') && l >= 100) {
+        /* no precision and string is too long to be formatted;
+           keep original string */
+        luaL_addvalue(b);
+      }
+      else {
+        nb = sprintf(buff, form, s);
+        lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
+      }
+      break;
+    }
+    default: {  /* also treat cases 'pnLlh' */
+      luaL_error(L, "invalid option '%%%c' to 'format'", conv);
+    }
+  }
+  luaL_addsize(b, nb);
+}
+
+
+/*
+** {------------------------------------------------------
+** Compiled formats: a format string is parsed once into a sequence of
+** 'FItem's, kept in a per-state cache (see 'getcompiled'). Common
+** conversions without flags or width ('%d', '%i', '%x', '%X', '%s',
+** '%f', and '%.Nf') are done without 'sprintf'. Invalid formats are
+** not compiled; 'addformat' interprets them, raising errors as before.
+** -------------------------------------------------------
+*/
+
+/* kinds of format items */
+enum FItemKind {
+  FI_LITERAL,  /* text copied verbatim */
+  FI_INT,  /* '%d' or '%i' */
+  FI_HEX,  /* '%x' or '%X' */
+  FI_STR,  /* '%s' */
+  FI_FIXED,  /* '%f' or '%.Nf' */
+  FI_OTHER  /* anything else, through 'addconv' */
+};
+
+
+/* maximum precision for FI_FIXED */
+#define MAXFIXEDPREC	9
+
+
+typedef struct FItem {
+  unsigned char kind;  /* 'FItemKind' */
+  char conv;  /* conversion character */
+  unsigned char prec;  /* precision for FI_FIXED */
+  size_t len;  /* length of a literal */
+  const char *lit;  /* literal text (inside the format string) */
+  char form[MAX_FORMAT];  /* format item for 'sprintf' */
+} FItem;
+
+
+typedef struct Format {
+  int nitems;
+  int fixed;  /* true if there is some FI_FIXED item */
+  FItem item[1];  /* variable length */
+} Format;
+
+
+/*
+** Translate format 'strfrmt' into 'f' (or only count its items when
+** 'f' is NULL); returns number of items or -1 if format is invalid.
+*/
+static int parseformat (Format *f, const char *strfrmt, size_t sfl) {
+  const char *strfrmt_end = strfrmt + sfl;
+  int n = 0;
+  while (strfrmt < strfrmt_end) {
+    FItem dummy;
+    FItem *it = (f) ? &f->item[n] : &dummy;
+    n++;
+    if (*strfrmt != L_ESC || *(strfrmt + 1) == L_ESC) {  /* literal? */
+      const char *init = strfrmt;
+      while (strfrmt < strfrmt_end && *strfrmt != L_ESC) strfrmt++;
+      if (strfrmt < strfrmt_end && *(strfrmt + 1) == L_ESC)
+        strfrmt++;  /* include the first '%' of '%%' */
+      it->kind = FI_LITERAL;
+      it->lit = init;
+      it->len = strfrmt - init;
+      if (strfrmt < strfrmt_end && *strfrmt == L_ESC && it->len > 0 &&
+          init[it->len - 1] == L_ESC)
+        strfrmt++;  /* skip second '%' */
+    }
+    else {  /* format item */
+      const char *err;
+      const char *spec = ++strfrmt;
+      const char *p = checkformat(spec, it->form, &err);
+      if (p == NULL || *p == '\0' || !strchr("cdiouxXaAeEfgGqs", *p))
+        return -1;
+      it->conv = *p;
+      it->kind = FI_OTHER;
+      if (p == spec) {  /* no flags, width, or precision? */
+        switch (*p) {
+          case 'd': case 'i': it->kind = FI_INT; break;
+          case 'x': case 'X': it->kind = FI_HEX; break;
+          case 's': it->kind = FI_STR; break;
+          case 'f': it->kind = FI_FIXED; it->prec = 6; break;
+        }
+      }
+      else if (*p == 'f' && *spec == '.' && p - spec <= 2 &&
+               (p - spec == 1 || *(spec + 1) - '0' <= MAXFIXEDPREC)) {
+        it->kind = FI_FIXED;  /* '%.f' or '%.Nf' */
+        it->prec = (unsigned char)((p - spec == 1) ? 0 : *(spec + 1) - '0');
+      }
+      if (it->kind == FI_FIXED && f) f->fixed = 1;
+      fixlenmod(it->form, *p);
+      strfrmt = p + 1;
+    }
+  }
+  return n;
+}
+
+
+static void *compileformat (lua_State *L, const char *strfrmt, size_t sfl) {
+  Format *f;
+  int n = parseformat(NULL, strfrmt, sfl);
+  if (n < 0)
+    return NULL;
+  f = (Format *)lua_newuserdata(L, offsetof(Format, item) +
+                                   (n > 0 ? n : 1) * sizeof(FItem));
+  f->nitems = n;
+  f->fixed = 0;
+  parseformat(f, strfrmt, sfl);
+  return f;
+}
+
+
+/* size of a buffer for the decimal digits of a 'lua_Unsigned' */
+#define MAXUDIGITS	(3 * sizeof(lua_Unsigned))
+
+
+/*
+** Write the decimal digits of 'u' backwards, ending right before 'end';
+** returns a pointer to the first digit
+*/
+static char *utodec (char *end, lua_Unsigned u) {
+  do {
+    *--end = (char)('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  return end;
+}
+
+
+/* add integer 'n' in decimal */
+static void addint (luaL_Buffer *b, lua_Integer n) {
+  char digits[MAXUDIGITS + 1];
+  char *p = digits + sizeof(digits);
+  p = utodec(p, (n < 0) ? 0u - (lua_Unsigned)n : (lua_Unsigned)n);
+  if (n < 0) *--p = '-';
+  luaL_addlstring(b, p, digits + sizeof(digits) - p);
+}
+
+
+static void addhex (luaL_Buffer *b, lua_Unsigned u, int upper) {
+  const char *hexdigits = (upper) ? "0123456789ABCDEF" : "0123456789abcdef";
+  char digits[2 * sizeof(lua_Integer)];
+  char *p = digits + sizeof(digits);
+  do {
+    *--p = hexdigits[u & 0xF];
+    u >>= 4;
+  } while (u != 0);
+  luaL_addlstring(b, p, digits + sizeof(digits) - p);
+}
+
+
+/* '%s' without flags: 'sprintf' would stop at the first zero */
+static void addplainstring (lua_State *L, luaL_Buffer *b, int arg) {
+  char *buff = luaL_prepbuffsize(b, MAX_ITEM);  /* before pushing string */
+  size_t l;
+  const char *s = luaL_tolstring(L, arg, &l);
+  if (l >= 100)  /* too long to be formatted? */
+    luaL_addvalue(b);  /* keep original string */
+  else {
+    l = strlen(s);
+    memcpy(buff, s, l * sizeof(char));
+    lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
+    luaL_addsize(b, l);
+  }
+}
+
+
+/*
+** Convert 'x' as '%.<prec>f' would; returns the length of the result,
+** or -1 when the number is too large (or not finite) or too close to a
+** rounding tie to be sure of getting the same digits as 'sprintf'
+*/
+static int fixedtostr (char *buff, lua_Number x, int prec, char point) {
+  static const lua_Number pow10[MAXFIXEDPREC + 1] =
+    {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+  int neg = (x < 0 || (x == 0 && 1 / x < 0));  /* (also for -0.0) */
+  lua_Number scaled = (neg ? -x : x) * pow10[prec];
+  lua_Number frac;
+  lua_Unsigned digits, unit;
+  char ipart[MAXUDIGITS];
+  char *p = buff;
+  char *q;
+  int i;
+  if (sizeof(lua_Number) < sizeof(double) || !(scaled < 1e9))
+    return -1;
+  digits = (lua_Unsigned)scaled;
+  frac = scaled - (lua_Number)digits;
+  if (frac > 0.5 - 1e-6 && frac < 0.5 + 1e-6)
+    return -1;
+  if (frac > 0.5) digits++;  /* round */
+  if (neg) *p++ = '-';
+  for (unit = 1, i = 0; i < prec; i++) unit *= 10;
+  q = utodec(ipart + sizeof(ipart), digits / unit);  /* integral part */
+  memcpy(p, q, (ipart + sizeof(ipart) - q) * sizeof(char));
+  p += ipart + sizeof(ipart) - q;
+  if (prec > 0) {
+    digits %= unit;
+    *p++ = point;
+    for (i = prec - 1; i >= 0; i--) {
+      p[i] = (char)('0' + digits % 10);
+      digits /= 10;
+    }
+    p += prec;
+  }
+  return (int)(p - buff);
+}
+
+
+static void addfixed (luaL_Buffer *b, lua_Number x, const FItem *it,
+                      char point) {
+  char *buff = luaL_prepbuffsize(b, MAX_ITEM);
+  int nb = fixedtostr(buff, x, it->prec, point);
+  if (nb < 0)
+    nb = sprintf(buff, it->form, x);
+  luaL_addsize(b, nb);
+}
+
+
+/* Push the compiled form of a format (see 'getcompiled') */
+static const Format *getformat (lua_State *L, int arg, const char *strfrmt,
+                                size_t sfl) {
+  return (const Format *)getcompiled(L, arg, strfrmt, sfl,
+                                     compileformat, NULL);
+}
+
+/* }------------------------------------------------------ */
+
+
+/*
+** Add to buffer 'b' the result of formatting the values after index
+** 'arg' (up to 'top') with the format string at index 'arg', using
+** its compiled form 'f' if there is one.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg, int top,
+                       const Format *f) {
+  if (f != NULL) {
+    char point = (f->fixed) ? lua_getlocaledecpoint() : '.';
+    int i;
+    for (i = 0; i < f->nitems; i++) {
+      const FItem *it = &f->item[i];
+      if (it->kind == FI_LITERAL) {
+        luaL_addlstring(b, it->lit, it->len);
+        continue;
+      }
+      if (++arg > top)
+        luaL_argerror(L, arg, "no value");
+      switch (it->kind) {
+        case FI_INT: addint(b, luaL_checkinteger(L, arg)); break;
+        case FI_HEX: {
+          addhex(b, (lua_Unsigned)luaL_checkinteger(L, arg), it->conv == 'X');
+          break;
+        }
+        case FI_STR: addplainstring(L, b, arg); break;
+        case FI_FIXED: addfixed(b, luaL_checknumber(L, arg), it, point); break;
+        default: addconv(L, b, arg, it->conv, it->form); break;
+      }
+    }
+  }
+  else {  /* interpret the format */
+    size_t sfl;
+    const char *strfrmt = luaL_checklstring(L, arg, &sfl);
+    const char *strfrmt_end = strfrmt+sfl;
+    while (strfrmt < strfrmt_end) {
+      if (*strfrmt != L_ESC)
+        luaL_addchar(b, *strfrmt++);
+      else if (*++strfrmt == L_ESC)
+        luaL_addchar(b, *strfrmt++);  /* %% */
+      else { /* format item */
+        char form[MAX_FORMAT];  /* to store the format ('%...') */
+        int conv;
+        if (++arg > top)
+          luaL_argerror(L, arg, "no value");
+        strfrmt = scanformat(L, strfrmt, form);
+        conv = uchar(*strfrmt++);
+        fixlenmod(form, conv);
+        addconv(L, b, arg, conv, form);
+      }
+    }
+  }
+}
+
+
+static int str_format (lua_State *L) {
+  int top = lua_gettop(L);
+  size_t sfl;
+  const char *strfrmt = luaL_checklstring(L, 1, &sfl);
+  const Format *f = getformat(L, 1, strfrmt, sfl);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 1, top, f);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** STRING BUFFERS
+** =======================================================
+*/
+
+/* metatable name for string buffers */
+#define LUA_STRBUFHANDLE	"STRBUF*"
+
+/* minimum size of a buffer's memory block */
+#define STRBUFMIN	64
+
+
+/*
+** The contents live in a separate userdata, kept as the user value of
+** the buffer, so that their memory is managed (and accounted) by the
+** collector like any other object.
+*/
+typedef struct StrBuf {
+  char *b;  /* contents (NULL before the first allocation) */
+  size_t n;  /* number of bytes in use */
+  size_t size;  /* size of block 'b' */
+} StrBuf;
+
+
+#define checkstrbuf(L,i)	((StrBuf *)luaL_checkudata(L, i, LUA_STRBUFHANDLE))
+
+
+/*
+** Return a pointer to at least 'sz' free bytes at the end of buffer
+** 'sb' (at stack index 'ib'), growing its block if needed. The new
+** block replaces the old one as the buffer's user value; the old one
+** is left to the collector.
+*/
+static char *strbufprep (lua_State *L, int ib, StrBuf *sb, size_t sz) {
+  if (sb->size - sb->n < sz) {  /* not enough space? */
+    size_t newsize = sb->size * 2;  /* double size */
+    char *newb;
+    if (((size_t)-1) - sz < sb->n)  /* overflow? */
+      luaL_error(L, "buffer too large");
+    if (newsize < sb->n + sz)  /* still not big enough? */
+      newsize = sb->n + sz;
+    if (newsize < STRBUFMIN)
+      newsize = STRBUFMIN;
+    ib = lua_absindex(L, ib);
+    newb = (char *)lua_newuserdata(L, newsize * sizeof(char));
+    if (sb->n > 0)
+      memcpy(newb, sb->b, sb->n * sizeof(char));
+    lua_setuservalue(L, ib);  /* anchor new block (and release old one) */
+    sb->b = newb;
+    sb->size = newsize;
+  }
+  return sb->b + sb->n;
+}
+
+
+static void strbufadd (lua_State *L, int ib, StrBuf *sb, const char *s,
+                       size_t l) {
+  if (l > 0) {  /* avoid 'memcpy' when 's' can be NULL */
+    memcpy(strbufprep(L, ib, sb, l), s, l * sizeof(char));
+    sb->n += l;
+  }
+}
+
+
+/* add a number as 'tostring' would convert it */
+static void strbufaddnumber (lua_State *L, int ib, StrBuf *sb, int arg) {
+  char *buff = strbufprep(L, ib, sb, LUA_N2SBUFFSZ);
+  sb->n += lua_numbertocstring(L, arg, buff) - 1;  /* (without the zero) */
+}
+
+
+static int strbuf_new (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 1, 0);
+  StrBuf *sb;
+  luaL_argcheck(L, 0 <= size && (lua_Unsigned)size < MAXSIZE, 1,
+                   "invalid size");
+  sb = (StrBuf *)lua_newuserdata(L, sizeof(StrBuf));
+  sb->b = NULL;
+  sb->n = sb->size = 0;
+  luaL_setmetatable(L, LUA_STRBUFHANDLE);
+  if (size > 0)
+    strbufprep(L, -1, sb, (size_t)size);
+  return 1;
+}
+
+
+static int strbuf_put (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
+  int top = lua_gettop(L);
+  int arg;
+  for (arg = 2; arg <= top; arg++) {
+    if (lua_type(L, arg) == LUA_TNUMBER)
+      strbufaddnumber(L, 1, sb, arg);
+    else if (lua_type(L, arg) == LUA_TUSERDATA) {
+      StrBuf *other = checkstrbuf(L, arg);
+      size_t l = other->n;
+      if (l > 0) {  /* grow first: 'other' may be 'sb' itself */
+        char *p = strbufprep(L, 1, sb, l);
+        memcpy(p, other->b, l * sizeof(char));
+        sb->n += l;
+      }
+    }
+    else {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      strbufadd(L, 1, sb, s, l);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int strbuf_putf (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
   int top = lua_gettop(L);
-  int arg = 1;
   size_t sfl;
-  const char *strfrmt = luaL_checklstring(L, arg, &sfl);
-  const char *strfrmt_end = strfrmt+sfl;
+  const char *strfrmt = luaL_checklstring(L, 2, &sfl);
+  const Format *f = getformat(L, 2, strfrmt, sfl);
   luaL_Buffer b;
   luaL_buffinit(L, &b);
-  while (strfrmt < strfrmt_end) {
-    if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
-    else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
-    else { /* format item */
-      char form[MAX_FORMAT];  /* to store the format ('%...') */
-      char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
-      int nb = 0;  /* number of bytes in added item */
-      if (++arg > top)
-        luaL_argerror(L, arg, "no value");
-      strfrmt = scanformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          nb = sprintf(buff, form, (int)luaL_checkinteger(L, arg));
-          break;
-        }
-        case 'd': case 'i':
-        case 'o': case 'u': case 'x': case 'X': {
-          lua_Integer n = luaL_checkinteger(L, arg);
-          addlenmod(form, LUA_INTEGER_FRMLEN);
-          nb = sprintf(buff, form, n);
-          break;
-        }
-        case 'a': case 'A':
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = lua_number2strx(L, buff, form, luaL_checknumber(L, arg));
-          break;
-        case 'e': case 'E': case 'f':
-        case 'g': case 'G': {
-          addlenmod(form, LUA_NUMBER_FRMLEN);
-          nb = sprintf(buff, form, luaL_checknumber(L, arg));
-          break;
-        }
-        case 'q': {
-          addquoted(L, &b, arg);
-          break;
-        }
-        case 's': {
-          size_t l;
-          const char *s = luaL_tolstring(L, arg, &l);
-          if (!strchr(form, '.') && l >= 100) {
-            /* no precision and string is too long to be formatted;
-               keep original string */
-            luaL_addvalue(&b);
-          }
-          else {
-            nb = sprintf(buff, form, s);
-            lua_pop(L, 1);  /* remove result from 'luaL_tolstring' */
-          }
-          break;
-        }
-        default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid option '%%%c' to 'format'",
-                               *(strfrmt - 1));
+  addformat(L, &b, 2, top, f);
+  strbufadd(L, 1, sb, b.b, b.n);  /* copy result without creating a string */
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int strbuf_rep (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
+  size_t l, lsep;
+  const char *s = luaL_checklstring(L, 2, &l);
+  lua_Integer n = luaL_checkinteger(L, 3);
+  const char *sep = luaL_optlstring(L, 4, "", &lsep);
+  if (n > 0) {
+    if (l + lsep < l || l + lsep > MAXSIZE / n)
+      return luaL_error(L, "resulting string too large");
+    else {
+      char *p = strbufprep(L, 1, sb,
+                           (size_t)n * l + (size_t)(n - 1) * lsep);
+      while (n-- > 1) {  /* first n-1 copies (followed by separator) */
+        memcpy(p, s, l * sizeof(char)); p += l;
+        if (lsep > 0) {  /* empty 'memcpy' is not that cheap */
+          memcpy(p, sep, lsep * sizeof(char));
+          p += lsep;
         }
       }
-      luaL_addsize(&b, nb);
+      memcpy(p, s, l * sizeof(char)); p += l;  /* last copy */
+      sb->n = p - sb->b;
     }
   }
-  luaL_pushresult(&b);
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int strbuf_reserve (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
+  lua_Integer size = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, 0 <= size && (lua_Unsigned)size < MAXSIZE, 2,
+                   "invalid size");
+  strbufprep(L, 1, sb, (size_t)size);
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int strbuf_reset (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
+  sb->n = 0;  /* keep the block for reuse */
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int strbuf_len (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
+  lua_pushinteger(L, (lua_Integer)sb->n);
   return 1;
 }
 
+
+static int strbuf_tostring (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
+  lua_pushlstring(L, sb->b, sb->n);
+  return 1;
+}
+
+
+static int strbuf_sub (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
+  size_t l = sb->n;
+  lua_Integer start = posrelat(luaL_checkinteger(L, 2), l);
+  lua_Integer end = posrelat(luaL_optinteger(L, 3, -1), l);
+  if (start < 1) start = 1;
+  if (end > (lua_Integer)l) end = l;
+  if (start <= end)
+    lua_pushlstring(L, sb->b + start - 1, (size_t)(end - start) + 1);
+  else lua_pushliteral(L, "");
+  return 1;
+}
+
+
+/* write the contents of the buffer to a file handle from 'io' */
+static int strbuf_writeto (lua_State *L) {
+  StrBuf *sb = checkstrbuf(L, 1);
+  luaL_Stream *p = (luaL_Stream *)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+  if (p->closef == NULL)
+    return luaL_error(L, "attempt to use a closed file");
+  if (sb->n > 0 && fwrite(sb->b, sizeof(char), sb->n, p->f) != sb->n)
+    return luaL_fileresult(L, 0, NULL);
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+/* buffer methods that never call back into Lua */
+static const luaL_Reg strbufmeth_fast[] = {
+  {"len", strbuf_len},
+  {"put", strbuf_put},
+  {"rep", strbuf_rep},
+  {"reserve", strbuf_reserve},
+  {"reset", strbuf_reset},
+  {"sub", strbuf_sub},
+  {"tostring", strbuf_tostring},
+  {"writeto", strbuf_writeto},
+  {NULL, NULL}
+};
+
+
+static const luaL_Reg strbufmeta[] = {
+  {"__len", strbuf_len},
+  {"__tostring", strbuf_tostring},
+  {NULL, NULL}
+};
+
+
+/* the format cache (two values) must be on the top of the stack */
+static void createstrbufmeta (lua_State *L) {
+  luaL_newmetatable(L, LUA_STRBUFHANDLE);
+  luaL_setfuncs(L, strbufmeta, 0);
+  lua_createtable(L, 0, sizeof(strbufmeth_fast)/sizeof(strbufmeth_fast[0]));
+  luaL_setfastfuncs(L, strbufmeth_fast);
+  lua_pushvalue(L, -4);  /* format cache */
+  lua_pushvalue(L, -4);
+  lua_pushcclosure(L, strbuf_putf, 2);  /* may call '__tostring' */
+  lua_setfield(L, -2, "putf");
+  lua_setfield(L, -2, "__index");  /* metatable.__index = methods */
+  lua_pop(L, 1);  /* pop metatable */
+}
+
 /* }====================================================== */
 
 
@@ -1191,15 +2489,15 @@ static KOption getoption (Header *h, const char **fmt, int *size) {
 
 /*
 ** Read, classify, and fill other details about the next option.
-** 'psize' is filled with option's size, 'notoalign' with its
-** alignment requirements.
-** Local variable 'size' gets the size to be aligned. (Kpadal option
+** 'psize' is filled with option's size, 'palign' with its alignment
+** (0 if it needs none).
+** Local variable 'align' gets the size to be aligned. (Kpadal option
 ** always gets its full alignment, other options are limited by 
 ** the maximum alignment ('maxalign'). Kchar option needs no alignment
 ** despite its size.
 */
-static KOption getdetails (Header *h, size_t totalsize,
-                           const char **fmt, int *psize, int *ntoalign) {
+static KOption getdetails (Header *h, const char **fmt, int *psize,
+                           int *palign) {
   KOption opt = getoption(h, fmt, psize);
   int align = *psize;  /* usually, alignment follows size */
   if (opt == Kpaddalign) {  /* 'X' gets alignment from following option */
@@ -1207,18 +2505,184 @@ static KOption getdetails (Header *h, size_t totalsize,
       luaL_argerror(h->L, 1, "invalid next option for option 'X'");
   }
   if (align <= 1 || opt == Kchar)  /* need no alignment? */
-    *ntoalign = 0;
+    *palign = 0;
   else {
     if (align > h->maxalign)  /* enforce maximum alignment */
       align = h->maxalign;
     if ((align & (align - 1)) != 0)  /* is 'align' not a power of 2? */
       luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
-    *ntoalign = (align - (int)(totalsize & (align - 1))) & (align - 1);
+    *palign = (align <= 1) ? 0 : align;
   }
   return opt;
 }
 
 
+/* number of padding bytes to align position 'pos' to 'align' */
+#define ntoalign(pos,align)  \
+	((align) == 0 ? 0 : ((align) - (int)((pos) & ((align) - 1))) & ((align) - 1))
+
+
+/*
+** Repetition of an option: a single value, 'count' values
+** ('opt*count'), or an array with 'count' values ('opt[count]') or
+** with all the values there are ('opt[*]')
+*/
+typedef enum KRepeat {
+  Rone,
+  Rmany,
+  Rarray,
+  Rall
+} KRepeat;
+
+
+/*
+** An option with its details, as read from a format string
+*/
+typedef struct PackItem {
+  unsigned char opt;  /* KOption */
+  unsigned char rep;  /* KRepeat */
+  unsigned char islittle;
+  int size;
+  int align;  /* alignment (0 if none) */
+  int count;  /* repetition count */
+} PackItem;
+
+
+/*
+** Read the next option of a format, with its repetition
+*/
+static void getitem (Header *h, const char **fmt, PackItem *it) {
+  char c = **fmt;  /* option */
+  KOption opt = getdetails(h, fmt, &it->size, &it->align);
+  it->opt = (unsigned char)opt;
+  it->islittle = (unsigned char)h->islittle;
+  it->rep = Rone;
+  it->count = 1;
+  if (**fmt == '*' || **fmt == '[') {
+    int array = (*((*fmt)++) == '[');
+    if (opt == Knop || opt == Kpaddalign || (array && opt == Kpadding))
+      luaL_error(h->L, "invalid repetition for format option '%c'", c);
+    if (array && **fmt == '*') {
+      (*fmt)++;
+      it->rep = Rall;
+    }
+    else {
+      it->count = getnum(fmt, -1);
+      if (it->count == -1)
+        luaL_error(h->L, "missing count for format option '%c'", c);
+      it->rep = (array) ? Rarray : Rmany;
+    }
+    if (array) {
+      if (**fmt != ']')
+        luaL_error(h->L, "missing ']' in format");
+      (*fmt)++;
+    }
+  }
+}
+
+
+/*
+** {------------------------------------------------------
+** Compiled formats: the options of a format string, kept in a
+** per-state cache (see 'getcompiled'), so that 'pack', 'unpack', and
+** 'packsize' do not parse the same format on every call. Formats with
+** errors are not compiled; they are read option by option, raising
+** the errors in their usual order.
+** -------------------------------------------------------
+*/
+
+typedef struct PackFormat {
+  int nitems;
+  PackItem item[1];  /* variable length */
+} PackFormat;
+
+
+/* build the compiled form of format at index 1 (protected) */
+static int buildpack (lua_State *L) {
+  const char *fmt0 = lua_tostring(L, 1);
+  const char *fmt = fmt0;
+  PackFormat *f;
+  PackItem it;
+  Header h;
+  int n = 0;
+  initheader(L, &h);
+  while (*fmt != '\0') {  /* count items */
+    getitem(&h, &fmt, &it);
+    n++;
+  }
+  f = (PackFormat *)lua_newuserdata(L, offsetof(PackFormat, item) +
+                                       (n > 0 ? n : 1) * sizeof(PackItem));
+  initheader(L, &h);
+  for (f->nitems = 0, fmt = fmt0; f->nitems < n; f->nitems++)
+    getitem(&h, &fmt, &f->item[f->nitems]);
+  return 1;
+}
+
+
+static void *compilepack (lua_State *L, const char *fmt, size_t lf) {
+  lua_pushcfunction(L, buildpack);
+  lua_pushlstring(L, fmt, lf);
+  if (lua_pcall(L, 1, 1, 0) != LUA_OK) {  /* invalid format? */
+    lua_pop(L, 1);  /* remove error message */
+    return NULL;
+  }
+  return lua_touserdata(L, -1);
+}
+
+
+/*
+** State of a traversal of a format: either its compiled items or the
+** format itself
+*/
+typedef struct PackState {
+  Header h;
+  const char *fmt;  /* format string (when not compiled) */
+  const PackItem *item;  /* next compiled item (NULL if not compiled) */
+  const PackItem *lastitem;
+} PackState;
+
+
+/*
+** Start a traversal of the format at index 1. A compiled format
+** replaces the format string at index 1, so that it stays alive during
+** the traversal: the cache alone does not keep it, as any allocation
+** may run finalizers that replace its entry. (The string itself is
+** kept by the compiled format.)
+*/
+static void initpack (lua_State *L, PackState *ps) {
+  size_t lf;
+  const char *fmt = luaL_checklstring(L, 1, &lf);
+  const PackFormat *f =
+      (const PackFormat *)getcompiled(L, 1, fmt, lf, compilepack, NULL);
+  if (f != NULL)
+    lua_replace(L, 1);  /* anchor compiled format */
+  else
+    lua_pop(L, 1);  /* remove nil */
+  initheader(L, &ps->h);
+  ps->fmt = fmt;
+  ps->item = (f != NULL) ? f->item : NULL;
+  ps->lastitem = (f != NULL) ? f->item + f->nitems : NULL;
+}
+
+
+/* get next item of a traversal; returns false at the end */
+static int nextitem (PackState *ps, PackItem *it) {
+  if (ps->item != NULL) {
+    if (ps->item == ps->lastitem)
+      return 0;
+    *it = *ps->item++;
+  }
+  else {
+    if (*ps->fmt == '\0')
+      return 0;
+    getitem(&ps->h, &ps->fmt, it);
+  }
+  return 1;
+}
+
+/* }------------------------------------------------------ */
+
+
 /*
 ** Pack integer 'n' with 'size' bytes and 'islittle' endianness.
 ** The final 'if' handles the case when 'size' is larger than
@@ -1246,12 +2710,10 @@ static void packint (luaL_Buffer *b, lua_Unsigned n,
 ** Copy 'size' bytes from 'src' to 'dest', correcting endianness if
 ** given 'islittle' is different from native endianness.
 */
-static void copywithendian (volatile char *dest, volatile const char *src,
+static void copywithendian (char *dest, const char *src,
                             int size, int islittle) {
-  if (islittle == nativeendian.little) {
-    while (size-- != 0)
-      *(dest++) = *(src++);
-  }
+  if (islittle == nativeendian.little)
+    memcpy(dest, src, size);
   else {
     dest += size - 1;
     while (size-- != 0)
@@ -1260,83 +2722,194 @@ static void copywithendian (volatile char *dest, volatile const char *src,
 }
 
 
+/*
+** Error in the value for an item: argument 'arg' itself or, if 'i'
+** is not 0, element 'i' of the array in argument 'arg'
+*/
+static int packerror (lua_State *L, int arg, lua_Integer i,
+                      const char *msg) {
+  if (i != 0)
+    msg = lua_pushfstring(L, "%s at index %I", msg, (LUAI_UACINT)i);
+  return luaL_argerror(L, arg, msg);
+}
+
+
+/* error for an array element (on the top) with a wrong type */
+static int packtypeerror (lua_State *L, int arg, lua_Integer i,
+                          const char *tname) {
+  const char *msg = lua_pushfstring(L, "%s expected at index %I, got %s",
+                                    tname, (LUAI_UACINT)i,
+                                    luaL_typename(L, -1));
+  return luaL_argerror(L, arg, msg);
+}
+
+
+/*
+** Get the value for an item, either argument 'arg' or element 'i' of
+** the array in argument 'arg'. (Array elements are popped before
+** returning, so that the string buffer stays on the top of the
+** stack; strings stay alive in the array and numbers are converted
+** into 'buff'.)
+*/
+static lua_Integer packinteger (lua_State *L, int arg, lua_Integer i) {
+  if (i == 0)
+    return luaL_checkinteger(L, arg);
+  else {
+    int isnum;
+    lua_Integer n;
+    lua_rawgeti(L, arg, i);
+    n = lua_tointegerx(L, -1, &isnum);
+    if (!isnum) {
+      if (lua_isnumber(L, -1))
+        packerror(L, arg, i, "number has no integer representation");
+      packtypeerror(L, arg, i, "number");
+    }
+    lua_pop(L, 1);
+    return n;
+  }
+}
+
+
+static lua_Number packnumber (lua_State *L, int arg, lua_Integer i) {
+  if (i == 0)
+    return luaL_checknumber(L, arg);
+  else {
+    int isnum;
+    lua_Number n;
+    lua_rawgeti(L, arg, i);
+    n = lua_tonumberx(L, -1, &isnum);
+    if (!isnum)
+      packtypeerror(L, arg, i, "number");
+    lua_pop(L, 1);
+    return n;
+  }
+}
+
+
+static const char *packstring (lua_State *L, int arg, lua_Integer i,
+                               size_t *len, char *buff) {
+  if (i == 0)
+    return luaL_checklstring(L, arg, len);
+  else {
+    const char *s = buff;
+    switch (lua_rawgeti(L, arg, i)) {
+      case LUA_TSTRING: s = lua_tolstring(L, -1, len); break;
+      case LUA_TNUMBER: *len = lua_numbertocstring(L, -1, buff) - 1; break;
+      default:
+        packtypeerror(L, arg, i, "string");
+    }
+    lua_pop(L, 1);
+    return s;
+  }
+}
+
+
+/*
+** Pack one value for item 'it' (see 'packinteger' for 'arg' and 'i');
+** returns whether it used a value.
+*/
+static int packone (lua_State *L, luaL_Buffer *b, const PackItem *it,
+                    int arg, lua_Integer i, size_t *totalsize) {
+  int size = it->size;
+  int nalign = ntoalign(*totalsize, it->align);
+  *totalsize += nalign + size;
+  while (nalign-- > 0)
+    luaL_addchar(b, LUA_PACKPADBYTE);  /* fill alignment */
+  switch ((KOption)it->opt) {
+    case Kint: {  /* signed integers */
+      lua_Integer n = packinteger(L, arg, i);
+      if (size < SZINT) {  /* need overflow check? */
+        lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
+        if (!(-lim <= n && n < lim))
+          packerror(L, arg, i, "integer overflow");
+      }
+      packint(b, (lua_Unsigned)n, it->islittle, size, (n < 0));
+      return 1;
+    }
+    case Kuint: {  /* unsigned integers */
+      lua_Integer n = packinteger(L, arg, i);
+      if (size < SZINT &&  /* need overflow check? */
+          !((lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB))))
+        packerror(L, arg, i, "unsigned overflow");
+      packint(b, (lua_Unsigned)n, it->islittle, size, 0);
+      return 1;
+    }
+    case Kfloat: {  /* floating-point options */
+      Ftypes u;
+      lua_Number n = packnumber(L, arg, i);  /* get argument */
+      char *buff = luaL_prepbuffsize(b, size);
+      if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
+      else if (size == sizeof(u.d)) u.d = (double)n;
+      else u.n = n;
+      /* move 'u' to final result, correcting endianness if needed */
+      copywithendian(buff, u.buff, size, it->islittle);
+      luaL_addsize(b, size);
+      return 1;
+    }
+    case Kchar: {  /* fixed-size string */
+      char nbuff[LUA_N2SBUFFSZ];
+      size_t len;
+      const char *s = packstring(L, arg, i, &len, nbuff);
+      if (len != (size_t)size)
+        packerror(L, arg, i, "wrong length");
+      luaL_addlstring(b, s, size);
+      return 1;
+    }
+    case Kstring: {  /* strings with length count */
+      char nbuff[LUA_N2SBUFFSZ];
+      size_t len;
+      const char *s = packstring(L, arg, i, &len, nbuff);
+      if (!(size >= (int)sizeof(size_t) || len < ((size_t)1 << (size * NB))))
+        packerror(L, arg, i, "string length does not fit in given size");
+      packint(b, (lua_Unsigned)len, it->islittle, size, 0);  /* pack length */
+      luaL_addlstring(b, s, len);
+      *totalsize += len;
+      return 1;
+    }
+    case Kzstr: {  /* zero-terminated string */
+      char nbuff[LUA_N2SBUFFSZ];
+      size_t len;
+      const char *s = packstring(L, arg, i, &len, nbuff);
+      if (strlen(s) != len)
+        packerror(L, arg, i, "string contains zeros");
+      luaL_addlstring(b, s, len);
+      luaL_addchar(b, '\0');  /* add zero at the end */
+      *totalsize += len + 1;
+      return 1;
+    }
+    case Kpadding: luaL_addchar(b, LUA_PACKPADBYTE);  /* FALLTHROUGH */
+    default:  /* Kpaddalign, Knop */
+      return 0;
+  }
+}
+
+
 static int str_pack (lua_State *L) {
   luaL_Buffer b;
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
-  int arg = 1;  /* current argument to pack */
+  PackState ps;
+  PackItem it;
+  int arg = 1;  /* last argument used */
   size_t totalsize = 0;  /* accumulate total size of result */
-  initheader(L, &h);
+  initpack(L, &ps);
   lua_pushnil(L);  /* mark to separate arguments from string buffer */
   luaL_buffinit(L, &b);
-  while (*fmt != '\0') {
-    int size, ntoalign;
-    KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
-    totalsize += ntoalign + size;
-    while (ntoalign-- > 0)
-     luaL_addchar(&b, LUA_PACKPADBYTE);  /* fill alignment */
-    arg++;
-    switch (opt) {
-      case Kint: {  /* signed integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT) {  /* need overflow check? */
-          lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
-          luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
-        }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
-        break;
-      }
-      case Kuint: {  /* unsigned integers */
-        lua_Integer n = luaL_checkinteger(L, arg);
-        if (size < SZINT)  /* need overflow check? */
-          luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
-                           arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
-        break;
-      }
-      case Kfloat: {  /* floating-point options */
-        volatile Ftypes u;
-        char *buff = luaL_prepbuffsize(&b, size);
-        lua_Number n = luaL_checknumber(L, arg);  /* get argument */
-        if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
-        else if (size == sizeof(u.d)) u.d = (double)n;
-        else u.n = n;
-        /* move 'u' to final result, correcting endianness if needed */
-        copywithendian(buff, u.buff, size, h.islittle);
-        luaL_addsize(&b, size);
-        break;
-      }
-      case Kchar: {  /* fixed-size string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, len == (size_t)size, arg, "wrong length");
-        luaL_addlstring(&b, s, size);
-        break;
-      }
-      case Kstring: {  /* strings with length count */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, size >= (int)sizeof(size_t) ||
-                         len < ((size_t)1 << (size * NB)),
-                         arg, "string length does not fit in given size");
-        packint(&b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
-        luaL_addlstring(&b, s, len);
-        totalsize += len;
+  while (nextitem(&ps, &it)) {
+    switch ((KRepeat)it.rep) {
+      case Rone: case Rmany: {
+        int k;
+        for (k = 0; k < it.count; k++)
+          arg += packone(L, &b, &it, arg + 1, 0, &totalsize);
         break;
       }
-      case Kzstr: {  /* zero-terminated string */
-        size_t len;
-        const char *s = luaL_checklstring(L, arg, &len);
-        luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
-        totalsize += len + 1;
+      case Rarray: case Rall: {  /* values from an array */
+        lua_Integer i, n = it.count;
+        luaL_checktype(L, ++arg, LUA_TTABLE);
+        if (it.rep == Rall)
+          n = (lua_Integer)lua_rawlen(L, arg);
+        for (i = 1; i <= n; i++)
+          packone(L, &b, &it, arg, i, &totalsize);
         break;
       }
-      case Kpadding: luaL_addchar(&b, LUA_PACKPADBYTE);  /* FALLTHROUGH */
-      case Kpaddalign: case Knop:
-        arg--;  /* undo increment */
-        break;
     }
   }
   luaL_pushresult(&b);
@@ -1345,24 +2918,25 @@ static int str_pack (lua_State *L) {
 
 
 static int str_packsize (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
+  PackState ps;
+  PackItem it;
   size_t totalsize = 0;  /* accumulate total size of result */
-  initheader(L, &h);
-  while (*fmt != '\0') {
-    int size, ntoalign;
-    KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
-    size += ntoalign;  /* total space used by option */
+  initpack(L, &ps);
+  while (nextitem(&ps, &it)) {
+    size_t size = ntoalign(totalsize, it.align) + it.size;  /* first one */
+    size_t stride = (it.align == 0) ? (size_t)it.size  /* other ones */
+                  : ((size_t)it.size + it.align - 1) & ~((size_t)it.align - 1);
     luaL_argcheck(L, totalsize <= MAXSIZE - size, 1,
                      "format result too large");
+    if (it.opt == Kstring || it.opt == Kzstr || it.rep == Rall)
+      luaL_argerror(L, 1, "variable-length format");
+    if (it.count == 0)
+      continue;
     totalsize += size;
-    switch (opt) {
-      case Kstring:  /* strings with length count */
-      case Kzstr:    /* zero-terminated string */
-        luaL_argerror(L, 1, "variable-length format");
-        break;
-      default:  break;
-    }
+    luaL_argcheck(L, stride == 0 ||
+                     (size_t)(it.count - 1) <= (MAXSIZE - totalsize) / stride,
+                     1, "format result too large");
+    totalsize += (it.count - 1) * stride;
   }
   lua_pushinteger(L, (lua_Integer)totalsize);
   return 1;
@@ -1403,64 +2977,130 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
+/*
+** Unpack one value for item 'it' at position '*pos' of 'data',
+** updating the position; returns whether it pushed a value.
+*/
+static int unpackone (lua_State *L, const PackItem *it, const char *data,
+                      size_t ld, size_t *pos) {
+  size_t p = *pos;
+  int size = it->size;
+  int nalign = ntoalign(p, it->align);
+  if ((size_t)nalign + size > ~p || p + nalign + size > ld)
+    luaL_argerror(L, 2, "data string too short");
+  p += nalign;  /* skip alignment */
+  *pos = p + size;
+  switch ((KOption)it->opt) {
+    case Kint:
+    case Kuint: {
+      lua_Integer res = unpackint(L, data + p, it->islittle, size,
+                                     (it->opt == Kint));
+      lua_pushinteger(L, res);
+      return 1;
+    }
+    case Kfloat: {
+      Ftypes u;
+      lua_Number num;
+      copywithendian(u.buff, data + p, size, it->islittle);
+      if (size == sizeof(u.f)) num = (lua_Number)u.f;
+      else if (size == sizeof(u.d)) num = (lua_Number)u.d;
+      else num = u.n;
+      lua_pushnumber(L, num);
+      return 1;
+    }
+    case Kchar: {
+      lua_pushlstring(L, data + p, size);
+      return 1;
+    }
+    case Kstring: {
+      size_t len = (size_t)unpackint(L, data + p, it->islittle, size, 0);
+      luaL_argcheck(L, p + len + size <= ld, 2, "data string too short");
+      lua_pushlstring(L, data + p + size, len);
+      *pos += len;  /* skip string */
+      return 1;
+    }
+    case Kzstr: {
+      size_t len = (int)strlen(data + p);
+      lua_pushlstring(L, data + p, len);
+      *pos += len + 1;  /* skip string plus final '\0' */
+      return 1;
+    }
+    default:  /* Kpaddalign, Kpadding, Knop */
+      return 0;
+  }
+}
+
+
+/*
+** Number of values still to be read for an 'opt[*]' item at position
+** 'pos': as many as fit in the data or, for variable-length options,
+** whether there is at least one more.
+*/
+static size_t countall (const PackItem *it, size_t pos, size_t ld) {
+  size_t first = ntoalign(pos, it->align) + (size_t)it->size;
+  size_t stride = (it->align == 0) ? (size_t)it->size
+                : ((size_t)it->size + it->align - 1) & ~((size_t)it->align - 1);
+  if (it->opt == Kzstr)
+    return (pos < ld);
+  else if (first > ld - pos || stride == 0)  /* no room (or 'c0')? */
+    return 0;
+  else if (it->opt == Kstring)
+    return 1;
+  else
+    return (ld - pos - first) / stride + 1;
+}
+
+
 static int str_unpack (lua_State *L) {
-  Header h;
-  const char *fmt = luaL_checkstring(L, 1);
+  PackState ps;
+  PackItem it;
   size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
-  size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
+  const char *data;
+  size_t pos;
   int n = 0;  /* number of results */
+  initpack(L, &ps);
+  data = luaL_checklstring(L, 2, &ld);
+  pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
   luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
-  initheader(L, &h);
-  while (*fmt != '\0') {
-    int size, ntoalign;
-    KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
-    if ((size_t)ntoalign + size > ~pos || pos + ntoalign + size > ld)
-      luaL_argerror(L, 2, "data string too short");
-    pos += ntoalign;  /* skip alignment */
-    /* stack space for item + next position */
-    luaL_checkstack(L, 2, "too many results");
-    n++;
-    switch (opt) {
-      case Kint:
-      case Kuint: {
-        lua_Integer res = unpackint(L, data + pos, h.islittle, size,
-                                       (opt == Kint));
-        lua_pushinteger(L, res);
-        break;
-      }
-      case Kfloat: {
-        volatile Ftypes u;
-        lua_Number num;
-        copywithendian(u.buff, data + pos, size, h.islittle);
-        if (size == sizeof(u.f)) num = (lua_Number)u.f;
-        else if (size == sizeof(u.d)) num = (lua_Number)u.d;
-        else num = u.n;
-        lua_pushnumber(L, num);
-        break;
-      }
-      case Kchar: {
-        lua_pushlstring(L, data + pos, size);
+  while (nextitem(&ps, &it)) {
+    switch ((KRepeat)it.rep) {
+      case Rone: case Rmany: {
+        int k;
+        for (k = 0; k < it.count; k++) {
+          /* stack space for item + next position */
+          luaL_checkstack(L, 2, "too many results");
+          n += unpackone(L, &it, data, ld, &pos);
+        }
         break;
       }
-      case Kstring: {
-        size_t len = (size_t)unpackint(L, data + pos, h.islittle, size, 0);
-        luaL_argcheck(L, pos + len + size <= ld, 2, "data string too short");
-        lua_pushlstring(L, data + pos + size, len);
-        pos += len;  /* skip string */
+      case Rarray: {
+        int i;
+        luaL_checkstack(L, 3, "too many results");
+        /* (a count larger than the data is probably an error) */
+        lua_createtable(L, ((size_t)it.count <= ld - pos) ? it.count
+                                                          : (int)(ld - pos), 0);
+        for (i = 1; i <= it.count; i++) {
+          unpackone(L, &it, data, ld, &pos);
+          lua_rawseti(L, -2, i);
+        }
+        n++;
         break;
       }
-      case Kzstr: {
-        size_t len = (int)strlen(data + pos);
-        lua_pushlstring(L, data + pos, len);
-        pos += len + 1;  /* skip string plus final '\0' */
+      case Rall: {  /* values until the end of the data */
+        int var = (it.opt == Kstring || it.opt == Kzstr);
+        size_t na = countall(&it, pos, ld);
+        lua_Integer i = 0;
+        luaL_checkstack(L, 3, "too many results");
+        lua_createtable(L, (var || na > INT_MAX) ? 0 : (int)na, 0);
+        while (na > 0) {
+          unpackone(L, &it, data, ld, &pos);
+          lua_rawseti(L, -2, ++i);
+          na = (var) ? countall(&it, pos, ld) : na - 1;
+        }
+        n++;
         break;
       }
-      case Kpaddalign: case Kpadding: case Knop:
-        n--;  /* undo increment */
-        break;
     }
-    pos += size;
   }
   lua_pushinteger(L, pos + 1);  /* next position */
   return n + 1;
@@ -1470,23 +3110,48 @@ static int str_unpack (lua_State *L) {
 
 
 static const luaL_Reg strlib[] = {
-  {"byte", str_byte},
-  {"char", str_char},
+  {"buffer", strbuf_new},
   {"dump", str_dump},
-  {"find", str_find},
+  {NULL, NULL}
+};
+
+
+/* functions sharing the format cache */
+static const luaL_Reg strlib_format[] = {
   {"format", str_format},
+  {NULL, NULL}
+};
+
+
+/* functions sharing the pattern cache */
+static const luaL_Reg strlib_pattern[] = {
+  {"find", str_find},
   {"gmatch", gmatch},
   {"gsub", str_gsub},
+  {"match", str_match},
+  {NULL, NULL}
+};
+
+
+/* functions sharing the cache of pack formats */
+static const luaL_Reg strlib_pack[] = {
+  {"pack", str_pack},
+  {"packsize", str_packsize},
+  {"unpack", str_unpack},
+  {NULL, NULL}
+};
+
+
+/* functions that never call back into Lua */
+static const luaL_Reg strlib_fast[] = {
+  {"byte", str_byte},
+  {"char", str_char},
   {"len", str_len},
   {"lower", str_lower},
-  {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
   {"sub", str_sub},
   {"upper", str_upper},
-  {"pack", str_pack},
-  {"packsize", str_packsize},
-  {"unpack", str_unpack},
   {NULL, NULL}
 };
 
@@ -1507,7 +3172,21 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
-  luaL_newlib(L, strlib);
+  luaL_checkversion(L);
+  lua_createtable(L, 0, sizeof(strlib)/sizeof(strlib[0]) +
+                        sizeof(strlib_pattern)/sizeof(strlib_pattern[0]) +
+                        sizeof(strlib_format)/sizeof(strlib_format[0]) +
+                        sizeof(strlib_pack)/sizeof(strlib_pack[0]) +
+                        sizeof(strlib_fast)/sizeof(strlib_fast[0]) - 5);
+  luaL_setfuncs(L, strlib, 0);
+  createcache(L);  /* for patterns */
+  luaL_setfuncs(L, strlib_pattern, 2);
+  createcache(L);  /* for formats */
+  createstrbufmeta(L);  /* 'putf' shares the format cache */
+  luaL_setfuncs(L, strlib_format, 2);
+  createcache(L);  /* for pack formats */
+  luaL_setfuncs(L, strlib_pack, 2);
+  luaL_setfastfuncs(L, strlib_fast);
   createmetatable(L);
   return 1;
 }
@@ -77,8 +77,11 @@
 #define isdummy(n)		((n) == dummynode)
 
 static const Node dummynode_ = {
-  {NILCONSTANT},  /* value */
-  {{NILCONSTANT, 0}}  /* key */
+#if !defined(LUA_NANTRICK)
+  {NILCONSTANT, LUA_TNIL, 0, {NULL}}  /* value, key's type, next, key */
+#else
+  {NILCONSTANT, 0, {NILCONSTANT}}  /* value, next, key */
+#endif
 };
 
 
@@ -136,7 +139,7 @@ static Node *mainposition (const Table *t, const TValue *key) {
       return hashboolean(t, bvalue(key));
     case LUA_TLIGHTUSERDATA:
       return hashpointer(t, pvalue(key));
-    case LUA_TLCF:
+    case LUA_TLCF: case LUA_TFCF:
       return hashpointer(t, fvalue(key));
     default:
       return hashpointer(t, gcvalue(key));
@@ -145,15 +148,32 @@ static Node *mainposition (const Table *t, const TValue *key) {
 
 
 /*
-** returns the index for 'key' if 'key' is an appropriate key to live in
-** the array part of the table, 0 otherwise.
+** returns the 'main' position of the key in node 'n'
 */
-static unsigned int arrayindex (const TValue *key) {
-  if (ttisinteger(key)) {
-    lua_Integer k = ivalue(key);
-    if (0 < k && (lua_Unsigned)k <= MAXASIZE)
-      return cast(unsigned int, k);  /* 'key' is an appropriate array index */
-  }
+static Node *mainpositionfromnode (const Table *t, Node *n) {
+  TValue key;
+  getnodekey(cast(lua_State *, NULL), &key, n);
+  return mainposition(t, &key);
+}
+
+
+/*
+** check whether key 'k1' is equal to the key in node 'n2'
+*/
+static int equalkey (const TValue *k1, const Node *n2) {
+  TValue k2;
+  getnodekey(cast(lua_State *, NULL), &k2, n2);
+  return luaV_rawequalobj(k1, &k2);
+}
+
+
+/*
+** returns the index for integer 'k' if it is an appropriate key to live
+** in the array part of the table, 0 otherwise.
+*/
+static unsigned int arrayindex (lua_Integer k) {
+  if (0 < k && (lua_Unsigned)k <= MAXASIZE)
+    return cast(unsigned int, k);  /* 'key' is an appropriate array index */
   return 0;  /* 'key' did not match some condition */
 }
 
@@ -166,7 +186,7 @@ static unsigned int arrayindex (const TValue *key) {
 static unsigned int findindex (lua_State *L, Table *t, StkId key) {
   unsigned int i;
   if (ttisnil(key)) return 0;  /* first iteration */
-  i = arrayindex(key);
+  i = ttisinteger(key) ? arrayindex(ivalue(key)) : 0;
   if (i != 0 && i <= t->sizearray)  /* is 'key' inside array part? */
     return i;  /* yes; that's the index */
   else {
@@ -174,9 +194,9 @@ static unsigned int findindex (lua_State *L, Table *t, StkId key) {
     Node *n = mainposition(t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
       /* key may be dead already, but it is ok to use it in 'next' */
-      if (luaV_rawequalobj(gkey(n), key) ||
-            (ttisdeadkey(gkey(n)) && iscollectable(key) &&
-             deadvalue(gkey(n)) == gcvalue(key))) {
+      if (equalkey(key, n) ||
+            (keyisdead(n) && iscollectable(key) &&
+             gckey(n) == gcvalue(key))) {
         i = cast_int(n - gnode(t, 0));  /* key index in hash table */
         /* hash elements are numbered after array ones */
         return (i + 1) + t->sizearray;
@@ -201,7 +221,7 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   }
   for (i -= t->sizearray; cast_int(i) < sizenode(t); i++) {  /* hash part */
     if (!ttisnil(gval(gnode(t, i)))) {  /* a non-nil value? */
-      setobj2s(L, key, gkey(gnode(t, i)));
+      getnodekey(L, key, gnode(t, i));
       setobj2s(L, key+1, gval(gnode(t, i)));
       return 1;
     }
@@ -245,7 +265,7 @@ static unsigned int computesizes (unsigned int nums[], unsigned int *pna) {
 }
 
 
-static int countint (const TValue *key, unsigned int *nums) {
+static int countint (lua_Integer key, unsigned int *nums) {
   unsigned int k = arrayindex(key);
   if (k != 0) {  /* is 'key' an appropriate array index? */
     nums[luaO_ceillog2(k)]++;  /* count as such */
@@ -294,7 +314,8 @@ static int numusehash (const Table *t, unsigned int *nums, unsigned int *pna) {
   while (i--) {
     Node *n = &t->node[i];
     if (!ttisnil(gval(n))) {
-      ause += countint(gkey(n), nums);
+      if (keyisinteger(n))
+        ause += countint(keyival(n), nums);
       totaluse++;
     }
   }
@@ -328,7 +349,7 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
     for (i = 0; i < (int)size; i++) {
       Node *n = gnode(t, i);
       gnext(n) = 0;
-      setnilvalue(wgkey(n));
+      setnilkey(n);
       setnilvalue(gval(n));
     }
   }
@@ -364,7 +385,9 @@ void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
     if (!ttisnil(gval(old))) {
       /* doesn't need barrier/invalidate cache, as entry was
          already present in the table */
-      setobjt2t(L, luaH_set(L, t, gkey(old)), gval(old));
+      TValue k;
+      getnodekey(L, &k, old);
+      setobjt2t(L, luaH_set(L, t, &k), gval(old));
     }
   }
   if (!isdummy(nold))
@@ -391,7 +414,8 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   totaluse = na;  /* all those keys are integer keys */
   totaluse += numusehash(t, nums, &na);  /* count keys in hash part */
   /* count extra key */
-  na += countint(ek, nums);
+  if (ttisinteger(ek))
+    na += countint(ivalue(ek), nums);
   totaluse++;
   /* compute new size for array part */
   asize = computesizes(nums, &na);
@@ -422,14 +446,14 @@ void luaH_free (lua_State *L, Table *t) {
   if (!isdummy(t->node))
     luaM_freearray(L, t->node, cast(size_t, sizenode(t)));
   luaM_freearray(L, t->array, t->sizearray);
-  luaM_free(L, t);
+  luaM_freegcobject(L, t, sizeof(Table));
 }
 
 
 static Node *getfreepos (Table *t) {
   while (t->lastfree > t->node) {
     t->lastfree--;
-    if (ttisnil(gkey(t->lastfree)))
+    if (keyisnil(t->lastfree))
       return t->lastfree;
   }
   return NULL;  /* could not find a free place */
@@ -467,7 +491,7 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
       return luaH_set(L, t, key);  /* insert key into grown table */
     }
     lua_assert(!isdummy(f));
-    othern = mainposition(t, gkey(mp));
+    othern = mainpositionfromnode(t, mp);
     if (othern != mp) {  /* is colliding node out of its main position? */
       /* yes; move colliding node into free position */
       while (othern + gnext(othern) != mp)  /* find previous */
@@ -489,7 +513,7 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
       mp = f;
     }
   }
-  setnodekey(L, &mp->i_key, key);
+  setnodekey(L, mp, key);
   luaC_barrierback(L, t, key);
   lua_assert(ttisnil(gval(mp)));
   return gval(mp);
@@ -506,7 +530,7 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
   else {
     Node *n = hashint(t, key);
     for (;;) {  /* check whether 'key' is somewhere in the chain */
-      if (ttisinteger(gkey(n)) && ivalue(gkey(n)) == key)
+      if (keyisinteger(n) && keyival(n) == key)
         return gval(n);  /* that's it */
       else {
         int nx = gnext(n);
@@ -526,8 +550,7 @@ const TValue *luaH_getstr (Table *t, TString *key) {
   Node *n = hashstr(t, key);
   lua_assert(key->tt == LUA_TSHRSTR);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
-    const TValue *k = gkey(n);
-    if (ttisshrstring(k) && eqshrstr(tsvalue(k), key))
+    if (keyisshrstr(n) && eqshrstr(keystrval(n), key))
       return gval(n);  /* that's it */
     else {
       int nx = gnext(n);
@@ -556,7 +579,7 @@ const TValue *luaH_get (Table *t, const TValue *key) {
     default: {
       Node *n = mainposition(t, key);
       for (;;) {  /* check whether 'key' is somewhere in the chain */
-        if (luaV_rawequalobj(gkey(n), key))
+        if (equalkey(key, n))
           return gval(n);  /* that's it */
         else {
           int nx = gnext(n);
@@ -644,12 +667,414 @@ int luaH_getn (Table *t) {
 
 
 
+/*
+** {======================================================
+** Native sort of the array part (pattern-defeating quicksort, after
+** Orson Peters' pdqsort), for arrays whose values have a primitive
+** order: all numbers (but NaN) or all strings.
+** =======================================================
+*/
+
+/* kinds of arrays, each with its own comparison */
+#define SORTINT		0	/* all integers */
+#define SORTFLT		1	/* all floats */
+#define SORTANY		2	/* mixed numbers or strings ('luaV_lessthan') */
+
+/* ranges smaller than this are sorted by insertion */
+#define INSERTLIMIT	24
+
+/* ranges larger than this take the pivot from nine elements */
+#define NINTHERLIMIT	128
+
+/* maximum moves in an optimistic insertion sort */
+#define PARTIALLIMIT	8
+
+
+typedef struct SortState {
+  lua_State *L;
+  TValue *a;
+  int kind;
+  TValue *v;  /* values moved along with 'a' by the stable sort (or NULL) */
+  TValue *abuff, *vbuff;  /* temporary buffers for the stable sort */
+} SortState;
+
+
+static int sortlt (SortState *ss, const TValue *x, const TValue *y) {
+  switch (ss->kind) {
+    case SORTINT: return ivalue(x) < ivalue(y);
+    case SORTFLT: return luai_numlt(fltvalue(x), fltvalue(y));
+    default: return luaV_lessthan(ss->L, x, y);
+  }
+}
+
+#define lt(ss,i,j)	sortlt(ss, &(ss)->a[i], &(ss)->a[j])
+
+
+static void sortswap (SortState *ss, unsigned int i, unsigned int j) {
+  TValue temp;
+  setobj(ss->L, &temp, &ss->a[i]);
+  setobj(ss->L, &ss->a[i], &ss->a[j]);
+  setobj(ss->L, &ss->a[j], &temp);
+}
+
+
+/* sort elements 'i', 'j', and 'k' */
+static void sort3 (SortState *ss, unsigned int i, unsigned int j,
+                                  unsigned int k) {
+  if (lt(ss, j, i)) sortswap(ss, i, j);
+  if (lt(ss, k, j)) {
+    sortswap(ss, j, k);
+    if (lt(ss, j, i)) sortswap(ss, i, j);
+  }
+}
+
+
+static void insertionsort (SortState *ss, unsigned int lo, unsigned int hi) {
+  TValue *a = ss->a;
+  unsigned int i;
+  for (i = lo + 1; i < hi; i++) {
+    if (lt(ss, i, i - 1)) {
+      TValue temp;
+      unsigned int j = i;
+      setobj(ss->L, &temp, &a[i]);
+      do {
+        setobj(ss->L, &a[j], &a[j - 1]);
+        j--;
+      } while (j > lo && sortlt(ss, &temp, &a[j - 1]));
+      setobj(ss->L, &a[j], &temp);
+    }
+  }
+}
+
+
+/*
+** Insertion sort that gives up after PARTIALLIMIT moves; returns
+** whether the range got sorted.
+*/
+static int partialsort (SortState *ss, unsigned int lo, unsigned int hi) {
+  TValue *a = ss->a;
+  unsigned int i, moves = 0;
+  for (i = lo + 1; i < hi; i++) {
+    if (lt(ss, i, i - 1)) {
+      TValue temp;
+      unsigned int j = i;
+      setobj(ss->L, &temp, &a[i]);
+      do {
+        setobj(ss->L, &a[j], &a[j - 1]);
+        j--;
+      } while (j > lo && sortlt(ss, &temp, &a[j - 1]));
+      setobj(ss->L, &a[j], &temp);
+      moves += i - j;
+      if (moves > PARTIALLIMIT) return 0;
+    }
+  }
+  return 1;
+}
+
+
+static void siftdown (SortState *ss, unsigned int lo, unsigned int i,
+                                     unsigned int n) {
+  for (;;) {
+    unsigned int c = 2 * i + 1;  /* first child */
+    if (c >= n) break;
+    if (c + 1 < n && lt(ss, lo + c, lo + c + 1)) c++;
+    if (!lt(ss, lo + i, lo + c)) break;
+    sortswap(ss, lo + i, lo + c);
+    i = c;
+  }
+}
+
+
+static void heapsort (SortState *ss, unsigned int lo, unsigned int hi) {
+  unsigned int n = hi - lo;
+  unsigned int i = n / 2;
+  while (i-- > 0)
+    siftdown(ss, lo, i, n);
+  while (n-- > 1) {
+    sortswap(ss, lo, lo + n);
+    siftdown(ss, lo, 0, n);
+  }
+}
+
+
+/*
+** Partition [lo, hi) around pivot a[lo], with elements equal to it on
+** the right side; returns the final position of the pivot. '*done'
+** tells whether the range was already partitioned (no swaps). (The
+** choice of pivot leaves an element not less than it at the end of
+** the range, so the first scan needs no bound.)
+*/
+static unsigned int partitionright (SortState *ss, unsigned int lo,
+                                    unsigned int hi, int *done) {
+  TValue *a = ss->a;
+  TValue pivot;
+  unsigned int first = lo, last = hi, p;
+  setobj(ss->L, &pivot, &a[lo]);
+  while (sortlt(ss, &a[++first], &pivot)) ;
+  if (first - 1 == lo)
+    while (first < last && !sortlt(ss, &a[--last], &pivot)) ;
+  else
+    while (!sortlt(ss, &a[--last], &pivot)) ;
+  *done = (first >= last);
+  while (first < last) {
+    sortswap(ss, first, last);
+    while (sortlt(ss, &a[++first], &pivot)) ;
+    while (!sortlt(ss, &a[--last], &pivot)) ;
+  }
+  p = first - 1;
+  setobj(ss->L, &a[lo], &a[p]);
+  setobj(ss->L, &a[p], &pivot);
+  return p;
+}
+
+
+/*
+** Partition [lo, hi) around pivot a[lo], with elements equal to it on
+** the left side. Used when the element before the range equals the
+** pivot: the left side is then all equal to it and needs no sorting.
+*/
+static unsigned int partitionleft (SortState *ss, unsigned int lo,
+                                   unsigned int hi) {
+  TValue *a = ss->a;
+  TValue pivot;
+  unsigned int first = lo, last = hi;
+  setobj(ss->L, &pivot, &a[lo]);
+  while (sortlt(ss, &pivot, &a[--last])) ;
+  if (last + 1 == hi)
+    while (first < last && !sortlt(ss, &pivot, &a[++first])) ;
+  else
+    while (!sortlt(ss, &pivot, &a[++first])) ;
+  while (first < last) {
+    sortswap(ss, first, last);
+    while (sortlt(ss, &pivot, &a[--last])) ;
+    while (!sortlt(ss, &pivot, &a[++first])) ;
+  }
+  setobj(ss->L, &a[lo], &a[last]);
+  setobj(ss->L, &a[last], &pivot);
+  return last;
+}
+
+
+/* swap elements to break a pattern in a range of size 'n' */
+static void breakpattern (SortState *ss, unsigned int lo, unsigned int hi,
+                                         unsigned int n) {
+  if (n >= INSERTLIMIT) {
+    sortswap(ss, lo, lo + n / 4);
+    sortswap(ss, hi - 1, hi - n / 4);
+    if (n > NINTHERLIMIT) {
+      sortswap(ss, lo + 1, lo + (n / 4 + 1));
+      sortswap(ss, lo + 2, lo + (n / 4 + 2));
+      sortswap(ss, hi - 2, hi - (n / 4 + 1));
+      sortswap(ss, hi - 3, hi - (n / 4 + 2));
+    }
+  }
+}
+
+
+/*
+** Sort [lo, hi). 'bad' is how many more unbalanced partitions are
+** allowed before falling back to heapsort; 'leftmost' tells whether
+** the range has no elements before it.
+*/
+static void pdqsort (SortState *ss, unsigned int lo, unsigned int hi,
+                                    int bad, int leftmost) {
+  for (;;) {
+    unsigned int n = hi - lo;
+    unsigned int p, ln, rn;
+    int done;
+    if (n < INSERTLIMIT) {
+      insertionsort(ss, lo, hi);
+      return;
+    }
+    if (n > NINTHERLIMIT) {  /* pseudomedian of nine elements */
+      unsigned int m = lo + n / 2;
+      sort3(ss, lo, m, hi - 1);
+      sort3(ss, lo + 1, m - 1, hi - 2);
+      sort3(ss, lo + 2, m + 1, hi - 3);
+      sort3(ss, m - 1, m, m + 1);
+      sortswap(ss, lo, m);
+    }
+    else
+      sort3(ss, lo + n / 2, lo, hi - 1);  /* median of three to 'lo' */
+    /* pivot equal to the element before the range? */
+    if (!leftmost && !lt(ss, lo - 1, lo)) {
+      lo = partitionleft(ss, lo, hi) + 1;  /* skip all equal elements */
+      continue;
+    }
+    p = partitionright(ss, lo, hi, &done);
+    ln = p - lo;
+    rn = hi - (p + 1);
+    if (ln < n / 8 || rn < n / 8) {  /* highly unbalanced? */
+      if (--bad == 0) {
+        heapsort(ss, lo, hi);
+        return;
+      }
+      breakpattern(ss, lo, p, ln);
+      breakpattern(ss, p + 1, hi, rn);
+    }
+    else if (done && partialsort(ss, lo, p) && partialsort(ss, p + 1, hi))
+      return;  /* range was already (almost) sorted */
+    /* recurse into the smaller side; iterate over the larger one */
+    if (ln < rn) {
+      pdqsort(ss, lo, p, bad, leftmost);
+      lo = p + 1;
+      leftmost = 0;
+    }
+    else {
+      pdqsort(ss, p + 1, hi, bad, 0);
+      hi = p;
+    }
+  }
+}
+
+
+/*
+** Kind of comparison for t[1..n], or -1 if they are not all in the
+** array part or not all numbers (other than NaN) or all strings
+*/
+static int sortkind (Table *t, unsigned int n) {
+  unsigned int i, nint = 0, nflt = 0, nstr = 0;
+  if (n > t->sizearray)
+    return -1;
+  for (i = 0; i < n; i++) {
+    const TValue *o = &t->array[i];
+    if (ttisinteger(o)) nint++;
+    else if (ttisfloat(o) && !luai_numisnan(fltvalue(o))) nflt++;
+    else if (ttisstring(o)) nstr++;
+    else return -1;
+  }
+  if (nstr != 0 && nstr != n)
+    return -1;  /* numbers mixed with strings */
+  return (nint == n) ? SORTINT : (nflt == n) ? SORTFLT : SORTANY;
+}
+
+
+/*
+** Sort t[1..n] with the primitive order of their values; returns 0
+** (leaving the table untouched) if 'sortkind' cannot handle them.
+*/
+int luaH_sortarray (lua_State *L, Table *t, unsigned int n) {
+  SortState ss;
+  unsigned int i;
+  int bad = 1;
+  ss.kind = sortkind(t, n);
+  if (ss.kind < 0)
+    return 0;
+  ss.L = L;
+  ss.a = t->array;
+  ss.v = NULL;
+  for (i = n; i > 1; i >>= 1)  /* allow log2(n) unbalanced partitions */
+    bad++;
+  pdqsort(&ss, 0, n, bad, 1);
+  return 1;
+}
+
+
+/*
+** Stable sort: merge sort with a buffer for the left half of each
+** merge. Elements of 'v', when present, follow the moves of their
+** keys in 'a'.
+*/
+
+/* ranges smaller than this are sorted by (stable) insertion */
+#define MERGELIMIT	16
+
+
+/* move element 'j' of 'a1'/'v1' to position 'i' of 'a'/'v' */
+static void moveto (SortState *ss, TValue *a, TValue *v, unsigned int i,
+                    const TValue *a1, const TValue *v1, unsigned int j) {
+  setobj(ss->L, &a[i], &a1[j]);
+  if (v != NULL) setobj(ss->L, &v[i], &v1[j]);
+}
+
+
+static void stableinsertion (SortState *ss, unsigned int lo,
+                                            unsigned int hi) {
+  TValue *a = ss->a, *v = ss->v;
+  unsigned int i;
+  for (i = lo + 1; i < hi; i++) {
+    if (lt(ss, i, i - 1)) {
+      TValue ta, tv;
+      unsigned int j = i;
+      moveto(ss, &ta, (v != NULL) ? &tv : NULL, 0, a, v, i);
+      do {
+        moveto(ss, a, v, j, a, v, j - 1);
+        j--;
+      } while (j > lo && sortlt(ss, &ta, &a[j - 1]));
+      moveto(ss, a, v, j, &ta, &tv, 0);
+    }
+  }
+}
+
+
+/* merge sorted ranges [lo, mid) and [mid, hi) */
+static void merge (SortState *ss, unsigned int lo, unsigned int mid,
+                                  unsigned int hi) {
+  TValue *a = ss->a, *v = ss->v;
+  TValue *ab = ss->abuff, *vb = ss->vbuff;
+  unsigned int n = mid - lo;
+  unsigned int i, j = mid, k = lo;
+  for (i = 0; i < n; i++)  /* move left half to the buffers */
+    moveto(ss, ab, vb, i, a, v, lo + i);
+  i = 0;
+  while (i < n && j < hi) {
+    if (sortlt(ss, &a[j], &ab[i]))  /* right one is smaller? */
+      moveto(ss, a, v, k++, a, v, j++);
+    else  /* on ties, left one goes first */
+      moveto(ss, a, v, k++, ab, vb, i++);
+  }
+  while (i < n)  /* rest of left half (right one is already there) */
+    moveto(ss, a, v, k++, ab, vb, i++);
+}
+
+
+static void mergesort (SortState *ss, unsigned int lo, unsigned int hi) {
+  if (hi - lo < MERGELIMIT)
+    stableinsertion(ss, lo, hi);
+  else {
+    unsigned int mid = lo + (hi - lo) / 2;
+    mergesort(ss, lo, mid);
+    mergesort(ss, mid, hi);
+    if (lt(ss, mid, mid - 1))  /* not already in order? */
+      merge(ss, lo, mid, hi);
+  }
+}
+
+
+/*
+** Stable sort of t[1..n] with the primitive order of their values;
+** if 'v' is not NULL, v[1..n] (also in its array part) are moved
+** along, so that 'v' gets sorted by the keys in 't'. Returns 0
+** (leaving the tables untouched) if 'sortkind' cannot handle 't'.
+*/
+int luaH_stablesort (lua_State *L, Table *t, unsigned int n, Table *v) {
+  SortState ss;
+  unsigned int nb = (n / 2 + 1) * ((v != NULL) ? 2 : 1);  /* buffer size */
+  ss.kind = sortkind(t, n);
+  if (ss.kind < 0 || (v != NULL && n > v->sizearray))
+    return 0;
+  ss.L = L;
+  ss.abuff = luaM_newvector(L, nb, TValue);
+  ss.vbuff = (v != NULL) ? ss.abuff + n / 2 + 1 : NULL;
+  /* no collection can happen from here on; buffers need no marking */
+  ss.a = t->array;
+  ss.v = (v != NULL) ? v->array : NULL;
+  mergesort(&ss, 0, n);
+  luaM_freearray(L, ss.abuff, nb);
+  return 1;
+}
+
+/* }====================================================== */
+
+
+
+int luaH_isdummy (Node *n) { return isdummy(n); }
+
+
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
   return mainposition(t, key);
 }
 
-int luaH_isdummy (Node *n) { return isdummy(n); }
-
 #endif
@@ -12,20 +12,14 @@
 
 #define gnode(t,i)	(&(t)->node[i])
 #define gval(n)		(&(n)->i_val)
-#define gnext(n)	((n)->i_key.nk.next)
+#define gnext(n)	((n)->u.next)
 
 
-/* 'const' to avoid wrong writings that can mess up field 'next' */ 
-#define gkey(n)		cast(const TValue*, (&(n)->i_key.tvk))
-
-#define wgkey(n)		(&(n)->i_key.nk)
-
 #define invalidateTMcache(t)	((t)->flags = 0)
 
 
-/* returns the key, given the value of a table entry */
-#define keyfromval(v) \
-  (gkey(cast(Node *, cast(char *, (v)) - offsetof(Node, i_val))))
+/* returns the Node, given the value of a table entry */
+#define nodefromval(v)	cast(Node *, (v))
 
 
 LUAI_FUNC const TValue *luaH_getint (Table *t, lua_Integer key);
@@ -42,11 +36,14 @@ LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
+LUAI_FUNC int luaH_sortarray (lua_State *L, Table *t, unsigned int n);
+LUAI_FUNC int luaH_stablesort (lua_State *L, Table *t, unsigned int n,
+                                                       Table *v);
+LUAI_FUNC int luaH_isdummy (Node *n);
 
 
 #if defined(LUA_DEBUG)
 LUAI_FUNC Node *luaH_mainposition (const Table *t, const TValue *key);
-LUAI_FUNC int luaH_isdummy (Node *n);
 #endif
 
 
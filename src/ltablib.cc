@@ -12,6 +12,7 @@
 
 #include <limits.h>
 #include <stddef.h>
+#include <string.h>
 
 #include "lua.h"
 
@@ -231,6 +232,11 @@ static int unpack (lua_State *L) {
 ** Quicksort
 ** (based on 'Algorithms in MODULA-3', Robert Sedgewick;
 **  Addison-Wesley, 1993.)
+** Unbalanced partitions get some elements swapped to break patterns in
+** the input; too many of them switch the range to heapsort, so that
+** the worst case is O(n log n) (as in introsort and pdqsort).
+** Arrays of numbers or of strings with no order function are sorted
+** natively by 'lua_rawsort'.
 ** =======================================================
 */
 
@@ -240,6 +246,12 @@ static void set2 (lua_State *L, TabA *ta, int i, int j) {
   (*ta->seti)(L, 1, j);
 }
 
+static void swap2 (lua_State *L, TabA *ta, int i, int j) {
+  (*ta->geti)(L, 1, i);
+  (*ta->geti)(L, 1, j);
+  set2(L, ta, i, j);
+}
+
 static int sort_comp (lua_State *L, int a, int b) {
   if (!lua_isnil(L, 2)) {  /* function? */
     int res;
@@ -255,9 +267,51 @@ static int sort_comp (lua_State *L, int a, int b) {
     return lua_compare(L, a, b, LUA_OPLT);
 }
 
-static void auxsort (lua_State *L, TabA *ta, int l, int u) {
+/* sift element 'i' down the heap with 'n' elements starting at 'l' */
+static void siftdown (lua_State *L, TabA *ta, int l, int i, int n) {
+  for (;;) {
+    int c = 2*i + 1;  /* first child */
+    if (c >= n) break;
+    if (c + 1 < n) {  /* choose the larger child */
+      (*ta->geti)(L, 1, l+c);
+      (*ta->geti)(L, 1, l+c+1);
+      if (sort_comp(L, -2, -1)) c++;
+      lua_pop(L, 2);
+    }
+    (*ta->geti)(L, 1, l+i);
+    (*ta->geti)(L, 1, l+c);
+    if (!sort_comp(L, -2, -1)) {  /* a[i] >= a[c]? */
+      lua_pop(L, 2);
+      break;
+    }
+    set2(L, ta, l+i, l+c);
+    i = c;
+  }
+}
+
+static void heapsort (lua_State *L, TabA *ta, int l, int u) {
+  int n = u-l+1;
+  int i;
+  for (i = n/2 - 1; i >= 0; i--)
+    siftdown(L, ta, l, i, n);
+  for (i = n-1; i > 0; i--) {
+    swap2(L, ta, l, l+i);  /* move largest to the end */
+    siftdown(L, ta, l, 0, i);
+  }
+}
+
+/* swap some elements of a[l..u] to break a pattern */
+static void breakpattern (lua_State *L, TabA *ta, int l, int u) {
+  int q = (u-l+1)/4;
+  if (q >= 2) {
+    swap2(L, ta, l, l+q);
+    swap2(L, ta, u, u-q);
+  }
+}
+
+static void auxsort (lua_State *L, TabA *ta, int l, int u, int bad) {
   while (l < u) {  /* for tail recursion */
-    int i, j;
+    int i, j, n;
     /* sort elements a[l], a[(l+u)/2] and a[u] */
     (*ta->geti)(L, 1, l);
     (*ta->geti)(L, 1, u);
@@ -307,6 +361,15 @@ static void auxsort (lua_State *L, TabA *ta, int l, int u) {
     (*ta->geti)(L, 1, i);
     set2(L, ta, u-1, i);  /* swap pivot (a[u-1]) with a[i] */
     /* a[l..i-1] <= a[i] == P <= a[i+1..u] */
+    n = u-l+1;
+    if (i-l < n/8 || u-i < n/8) {  /* partition too unbalanced? */
+      if (--bad == 0) {  /* too many of them? */
+        heapsort(L, ta, l, u);
+        break;
+      }
+      breakpattern(L, ta, l, i-1);
+      breakpattern(L, ta, i+1, u);
+    }
     /* adjust so that smaller half is in [j..i] and larger one in [l..u] */
     if (i-l < u-i) {
       j=l; i=i-1; l=i+2;
@@ -314,18 +377,178 @@ static void auxsort (lua_State *L, TabA *ta, int l, int u) {
     else {
       j=i+1; i=u; u=j-2;
     }
-    auxsort(L, ta, j, i);  /* call recursively the smaller one */
+    auxsort(L, ta, j, i, bad);  /* call recursively the smaller one */
   }  /* repeat the routine for the larger one */
 }
 
 static int sort (lua_State *L) {
   TabA ta;
-  int n = (int)aux_getn(L, 1, &ta);
+  lua_Integer n = aux_getn(L, 1, &ta);
+  int bad = 1;  /* unbalanced partitions allowed: log2(n) */
+  lua_Integer i;
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
   luaL_checkstack(L, 50, "");  /* assume array is smaller than 2^50 */
   if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
     luaL_checktype(L, 2, LUA_TFUNCTION);
+  else if (ta.geti == lua_rawgeti && ta.seti == lua_rawseti &&
+           lua_rawsort(L, 1, n))  /* sorted natively? */
+    return 0;
   lua_settop(L, 2);  /* make sure there are two arguments */
-  auxsort(L, &ta, 1, n);
+  for (i = n; i > 1; i >>= 1)
+    bad++;
+  auxsort(L, &ta, 1, (int)n, bad);
+  return 0;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Stable sorts
+** The values to compare are copied into a table; a merge sort orders
+** an array of indices into that table, and the result is only written
+** back at the end, so an error in an order or key function leaves the
+** list untouched. Keys that are all numbers or all strings, with no
+** order function, are sorted natively by 'lua_rawstablesort'.
+** =======================================================
+*/
+
+
+/* ranges smaller than this are sorted by insertion */
+#define MERGELIMIT	8
+
+
+typedef struct MergeS {
+  lua_State *L;
+  int comp;  /* true if there is an order function (at index 2) */
+  int v;  /* index of the table with the values to compare */
+  int *perm;  /* indices into 'v' being sorted */
+  int *buff;  /* buffer for merges */
+} MergeS;
+
+
+static int merge_lt (MergeS *ms, int i, int j) {
+  lua_State *L = ms->L;
+  int res;
+  lua_rawgeti(L, ms->v, i);
+  lua_rawgeti(L, ms->v, j);
+  if (ms->comp) {
+    lua_pushvalue(L, 2);
+    lua_insert(L, -3);  /* put function below its arguments */
+    lua_call(L, 2, 1);
+    res = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  else {
+    res = lua_compare(L, -2, -1, LUA_OPLT);
+    lua_pop(L, 2);
+  }
+  return res;
+}
+
+static void mergeinsertion (MergeS *ms, int lo, int hi) {
+  int *p = ms->perm;
+  int i, j;
+  for (i = lo + 1; i < hi; i++) {
+    int x = p[i];
+    for (j = i; j > lo && merge_lt(ms, x, p[j - 1]); j--)
+      p[j] = p[j - 1];
+    p[j] = x;
+  }
+}
+
+static void mergesort (MergeS *ms, int lo, int hi) {
+  if (hi - lo < MERGELIMIT)
+    mergeinsertion(ms, lo, hi);
+  else {
+    int *p = ms->perm;
+    int mid = lo + (hi - lo) / 2;
+    mergesort(ms, lo, mid);
+    mergesort(ms, mid, hi);
+    if (merge_lt(ms, p[mid], p[mid - 1])) {  /* not already in order? */
+      int n = mid - lo;
+      int i = 0, j = mid, k = lo;
+      memcpy(ms->buff, p + lo, n * sizeof(int));  /* save left half */
+      while (i < n && j < hi) {
+        if (merge_lt(ms, p[j], ms->buff[i]))  /* right one is smaller? */
+          p[k++] = p[j++];
+        else  /* on ties, left one goes first */
+          p[k++] = ms->buff[i++];
+      }
+      while (i < n)  /* rest of left half (right one is already there) */
+        p[k++] = ms->buff[i++];
+    }
+  }
+}
+
+/* push a raw copy of list[1..n] */
+static void copylist (lua_State *L, TabA *ta, int n) {
+  int i;
+  lua_createtable(L, n, 0);
+  for (i = 1; i <= n; i++) {
+    (*ta->geti)(L, 1, i);
+    lua_rawseti(L, -2, i);
+  }
+}
+
+/*
+** Sort the values in table at index 'v' (with an order function if
+** 'comp') and set list[1..n] to the values of table at index 'vals'
+** in that order.
+*/
+static void auxstablesort (lua_State *L, TabA *ta, int n, int comp, int v,
+                           int vals) {
+  MergeS ms;
+  int i;
+  ms.L = L;
+  ms.comp = comp;
+  ms.v = v;
+  ms.perm = (int *)lua_newuserdata(L, (n + n/2 + 1) * sizeof(int));
+  ms.buff = ms.perm + n;
+  for (i = 0; i < n; i++)
+    ms.perm[i] = i + 1;
+  mergesort(&ms, 0, n);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, vals, ms.perm[i]);
+    (*ta->seti)(L, 1, i + 1);
+  }
+}
+
+static int stablesort (lua_State *L) {
+  TabA ta;
+  lua_Integer n = aux_getn(L, 1, &ta);
+  int raw = (ta.geti == lua_rawgeti && ta.seti == lua_rawseti);
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+  else if (raw && lua_rawstablesort(L, 1, n, 0))  /* sorted natively? */
+    return 0;
+  lua_settop(L, 2);  /* make sure there are two arguments */
+  copylist(L, &ta, (int)n);  /* values at index 3 */
+  auxstablesort(L, &ta, (int)n, !lua_isnil(L, 2), 3, 3);
+  return 0;
+}
+
+static int sortby (lua_State *L) {
+  TabA ta;
+  lua_Integer n = aux_getn(L, 1, &ta);
+  int raw = (ta.geti == lua_rawgeti && ta.seti == lua_rawseti);
+  int i;
+  luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  lua_settop(L, 2);
+  lua_createtable(L, (int)n, 0);  /* keys at index 3 */
+  for (i = 1; i <= n; i++) {  /* call key function once per element */
+    lua_pushvalue(L, 2);
+    (*ta.geti)(L, 1, i);
+    lua_call(L, 1, 1);
+    lua_rawseti(L, 3, i);
+  }
+  if (raw && lua_rawstablesort(L, 3, n, 1))  /* sorted natively? */
+    return 0;
+  copylist(L, &ta, (int)n);  /* values at index 4 */
+  auxstablesort(L, &ta, (int)n, 0, 3, 4);
   return 0;
 }
 
@@ -343,6 +566,8 @@ static const luaL_Reg tab_funcs[] = {
   {"remove", tremove},
   {"move", tmove},
   {"sort", sort},
+  {"sortby", sortby},
+  {"stablesort", stablesort},
   {NULL, NULL}
 };
 
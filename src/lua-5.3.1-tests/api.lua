@@ -349,6 +349,53 @@ assert(to("func2num", io.read) ~= 0)     -- light C function
 assert(to("func2num", type) ~= 0)  -- "heavy" C function (with upvalue)
 a = to("tocfunction", math.deg)
 assert(a(3) == math.deg(3) and a == math.deg)
+-- 'math.deg' is a fast C function, 'a' a plain one: still the same key
+assert(rawequal(a, math.deg) and ({[a] = 1})[math.deg] == 1 and
+       ({[math.deg] = 2})[a] == 2)
+
+
+print("testing batch raw accesses")
+do
+  local sub = {}
+  local k50 = string.rep("k", 50)    -- a long string key
+  local t = setmetatable({10, 2.5, "x\0y", true, sub, nil, "12", 3.0,
+                          a = 1, b = "bb", [k50] = false},
+                         {__index = function () return 0 end})
+  local n, a, b, c, d, e = T.rawgetfields(t, "a", "b", "c", k50, "d")
+  assert(n == 3 and math.type(a) == "integer" and a == 1 and b == "bb" and
+         c == nil and d == false and e == nil)   -- no metamethods
+  n, a = T.rawgetfields({x = sub}, "x")
+  assert(n == 1 and T.udataval(a) == to("topointer", sub))
+  assert(T.rawgetfields(t) == 0)
+  local r = pack(T.rawgetiv(t, 1, 9))
+  assert(r.n == 10 and r[1] == 7 and r[2] == 10 and r[3] == 2.5 and
+         r[4] == "x\0y" and r[5] == true and T.udataval(r[6]) ~= 0 and
+         r[7] == nil and r[8] == "12" and math.type(r[9]) == "float" and
+         r[10] == nil)
+  assert(T.rawgetiv(t, 2, 1) == 0)
+  -- typed variants stop at the first value of another type; no coercions
+  n, a, b, c = T.rawgetnumbers({1, 2.5, 3, "4", 5}, 1, 5)
+  assert(n == 3 and math.type(a) == "float" and a == 1 and b == 2.5 and c == 3)
+  assert(T.rawgetnumbers({"1"}, 1, 1) == 0)
+  n, a, b, c = T.rawgetintegers({1, 2.0, 3, 4.5}, 1, 4)
+  assert(n == 3 and a == 1 and math.type(b) == "integer" and b == 2 and c == 3)
+  assert(T.rawgetintegers({"1"}, 1, 1) == 0)
+  assert(T.rawgetintegers({2^63}, 1, 1) == 0)
+  n, a, b = T.rawgetstrings({"a\0b", "c", 10}, 1, 3, true)
+  assert(n == 2 and a == "a\0b" and b == "c")
+  n, a = T.rawgetstrings({"a\0b"}, 1, 1)    -- without lengths
+  assert(n == 1 and a == "a")
+  assert(T.rawgetstrings({10}, 1, 1) == 0)
+  assert(T.rawgetstrings({}, 1, 1) == 0)
+  -- ranges ending at 'maxinteger'
+  local maxi = math.maxinteger
+  t = {[maxi - 1] = 1, [maxi] = 2}
+  n, a, b = T.rawgetintegers(t, maxi - 1, maxi)
+  assert(n == 2 and a == 1 and b == 2)
+  assert(T.rawgetnumbers(t, maxi - 1, maxi) == 2)
+  assert(T.rawgetiv(t, maxi - 1, maxi) == 2)
+  assert(T.rawgetstrings({[maxi] = "z"}, maxi, maxi) == 1)
+end
 
 
 print("testing panic function")
@@ -0,0 +1,79 @@
+/*
+** Counts allocations made while a recursive function oscillates in
+** call depth, with some table garbage in between (so that collections
+** run and get a chance to shrink stacks). Blocks whose size is a small
+** multiple of sizeof(CallInfo) are counted as CallInfo allocations;
+** reallocations of blocks of TValues bigger than the initial stack are
+** counted as stack reallocations.
+** usage: calls [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "lstate.h"
+
+
+static unsigned long nalloc, nci, nstack;
+
+
+static void *countalloc (void *ud, void *p, size_t osize, size_t nsize) {
+  (void)ud;
+  if (nsize == 0) {
+    free(p);
+    return NULL;
+  }
+  if (p == NULL) {
+    nalloc++;
+    if (nsize % sizeof(CallInfo) == 0 && nsize <= 16 * sizeof(CallInfo))
+      nci++;
+  }
+  else if (osize % sizeof(TValue) == 0 && nsize % sizeof(TValue) == 0 &&
+           osize >= BASIC_STACK_SIZE * sizeof(TValue))
+    nstack++;
+  return realloc(p, nsize);
+}
+
+
+static const char code[] =
+  "local n = ...\n"
+  "local function rec (d)\n"
+  "  if d == 0 then return {} end\n"
+  "  local t = rec(d - 1)\n"
+  "  return t\n"
+  "end\n"
+  "for i = 1, n do\n"
+  "  rec(i % 200)\n"
+  "  local s = {}\n"
+  "  for j = 1, 10 do s[j] = {} end\n"
+  "end\n";
+
+
+int main (int argc, char **argv) {
+  lua_State *L = lua_newstate(countalloc, NULL);
+  long n = (argc > 1) ? atol(argv[1]) : 20000;
+  clock_t t;
+  luaL_openlibs(L);
+  if (luaL_loadstring(L, code) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  lua_pushinteger(L, n);
+  nalloc = nci = nstack = 0;
+  t = clock();
+  if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  t = clock() - t;
+  printf("allocations:        %lu\n", nalloc);
+  printf("CallInfo allocs:    %lu\n", nci);
+  printf("stack reallocs:     %lu\n", nstack);
+  printf("time:               %.3fs\n", (double)t / CLOCKS_PER_SEC);
+  lua_close(L);
+  return 0;
+}
@@ -0,0 +1,43 @@
+-- Time of a full collection over chains of weak-keyed tables, where the
+-- value stored under each key is the key of the next link. Only the
+-- first key is anchored, so every link is reached through ephemerons.
+-- usage: lua ephemeron.lua [ntables]
+
+local ntables = tonumber(arg and arg[1]) or 1
+
+local function chain (n)
+  local ts = {}
+  for i = 1, ntables do ts[i] = setmetatable({}, {__mode = "k"}) end
+  local first = {}
+  local k = first
+  for i = 1, n do
+    local nk = {}
+    ts[i % ntables + 1][k] = nk
+    k = nk
+  end
+  return first, ts
+end
+
+local function best (f)
+  local b = math.huge
+  for i = 1, 5 do
+    local t = os.clock()
+    f()
+    t = os.clock() - t
+    if t < b then b = t end
+  end
+  return b
+end
+
+for _, n in ipairs{1000, 5000, 20000} do
+  local first, ts = chain(n)
+  collectgarbage(); collectgarbage()
+  local t = best(collectgarbage)
+  local count = 0
+  for i = 1, ntables do
+    for _ in pairs(ts[i]) do count = count + 1 end
+  end
+  assert(count == n)   -- whole chain survived
+  print(string.format("chain of %5d over %d table(s): %8.2f ms per collection",
+                      n, ntables, t * 1000))
+end
@@ -0,0 +1,50 @@
+-- Throughput of protected calls where one in three raises an error,
+-- with the error raised at different call depths. With an argument
+-- ("throw" or "jump"), uses that error mechanism; without one, runs
+-- every mechanism the interpreter supports.
+-- usage: lua errors.lua [throw|jump]
+
+local N = 300000
+
+local function validate (x)
+  if x % 3 == 0 then error("bad value", 0) end
+  return x
+end
+
+local function deep (n, x)
+  if n == 0 then return validate(x) end
+  return (deep(n - 1, x))
+end
+
+local function run (depth)
+  local pcall = pcall
+  local t = os.clock()
+  local fails = 0
+  for i = 1, N do
+    if not pcall(deep, depth, i) then fails = fails + 1 end
+  end
+  assert(fails == N // 3)
+  return os.clock() - t
+end
+
+local function bench (mode)
+  if mode and not debug.seterrormode(mode) then
+    print(mode .. ": not supported")
+    return
+  end
+  io.write(string.format("%-8s", mode or "default"))
+  for _, d in ipairs{0, 10} do
+    local b = math.huge
+    for i = 1, 3 do b = math.min(b, run(d)) end
+    io.write(string.format("  depth %2d: %.3fs", d, b))
+  end
+  print()
+end
+
+if arg and arg[1] then bench(arg[1])
+elseif debug.seterrormode then
+  bench("throw"); bench("jump")
+  debug.seterrormode("throw")
+else
+  bench()
+end
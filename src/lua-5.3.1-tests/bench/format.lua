@@ -0,0 +1,38 @@
+-- string.format over a typical logging mix; each line is the best time
+-- of 5 runs of 200000 calls.
+-- usage: lua format.lua
+
+local fmt = string.format
+local N = 200000
+
+local function best (f)
+  local b = math.huge
+  for i = 1, 5 do
+    local t = os.clock()
+    f()
+    t = os.clock() - t
+    if t < b then b = t end
+  end
+  return b
+end
+
+local cases = {
+  {"log line", function ()
+    for i = 1, N do
+      local s = fmt("[%d] %s: id=%x took %.2f ms", i, "request", i * 7, i / 3)
+    end
+  end},
+  {"integers", function ()
+    for i = 1, N do local s = fmt("%d,%d,%d", i, -i, i * 3) end
+  end},
+  {"strings", function ()
+    for i = 1, N do local s = fmt("%s=%s;", "key", "value") end
+  end},
+  {"widths", function ()
+    for i = 1, N do local s = fmt("%5d %-8s %g", i, "ab", i / 7) end
+  end},
+}
+
+for _, c in ipairs(cases) do
+  print(string.format("%-10s %.3fs", c[1], best(c[2])))
+end
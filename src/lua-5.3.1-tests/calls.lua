@@ -120,6 +120,37 @@ end
 deep(10)
 deep(200)
 
+-- 'ci' list and stack shrink only after some idle collections
+for i = 1, 10 do
+  deep(i * 37 % 300)
+  collectgarbage()
+end
+deep(300)
+
+if T then
+  -- the 'ci' list is made of whole blocks; after it grows, it is kept
+  -- during 'delay' collections, and then each collection frees half of
+  -- its unused blocks (the stack also waits before shrinking)
+  collectgarbage("stop")   -- only explicit collections from here
+  local n, inuse, block, delay = T.callinfo()
+  deep(n + 100)   -- grow the list and the stack
+  n = T.callinfo()
+  assert(n % block == 0 and n >= inuse + 100)
+  local _, size = T.stacklevel()
+  for i = 1, delay do
+    collectgarbage()
+    assert(T.callinfo() == n and select(2, T.stacklevel()) == size)
+  end
+  for i = 1, 2 do
+    local unused = n // block - (inuse + block - 1) // block
+    collectgarbage()
+    n = n - (unused + 1) // 2 * block
+    assert(T.callinfo() == n)
+  end
+  assert(select(2, T.stacklevel()) < size)
+  collectgarbage("restart")
+end
+
 -- testing tail call
 function deep (n) if n>0 then return deep(n-1) else return 101 end end
 assert(deep(30000) == 101)
@@ -130,6 +161,32 @@ assert(a:deep(30000) == 101)
 print('+')
 
 
+-- testing fast C functions (called by OP_CALL with a lighter frame)
+do
+  local floor, byte = math.floor, string.byte
+  assert(floor(3.5) == 3 and select('#', byte("abc", 1, -1)) == 3)
+  local a, b, c, d = byte("ab", 1, -1)
+  assert(a == 97 and b == 98 and c == nil and d == nil)
+  assert(select('#', byte("")) == 0)
+  local st, msg = pcall(function () local x = floor({}); return x end)
+  assert(not st and string.find(msg, "bad argument #1 to 'floor'"))
+  -- many results make the stack grow during the call
+  local t = {byte(string.rep("x", 1000), 1, -1)}
+  assert(#t == 1000 and t[1000] == 120)
+  -- with hooks, they go through the regular path
+  local calls = 0
+  debug.sethook(function () calls = calls + 1 end, "c")
+  a = floor(1)
+  debug.sethook()
+  assert(calls >= 2 and a == 1)
+  -- 'math.min' and 'math.max' may call '__lt', so they are not fast
+  local mt = {__lt = function (x, y) calls = calls + 1; return x[1] < y[1] end}
+  local x, y = setmetatable({1}, mt), setmetatable({2}, mt)
+  calls = 0
+  assert(math.min(y, x) == x and math.max(x, y) == y and calls == 2)
+end
+
+
 a = nil
 (function (x) a=x end)(23)
 assert(a == 23 and (function (x) return x*2 end)(20) == 40)
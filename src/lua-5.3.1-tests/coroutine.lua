@@ -88,6 +88,115 @@ for i=1,10 do
   s = s*i
 end
 
+-- initial stack sizes
+do
+  local function rec (n)
+    if n == 0 then return coroutine.yield(0) end
+    return 1 + rec(n - 1)
+  end
+  for _, size in ipairs{1, 26, 40, 1000, 10^7} do
+    for _, depth in ipairs{0, 10, 3000} do
+      local co = coroutine.create(rec, size)
+      assert(select(2, coroutine.resume(co, depth)) == 0)
+      assert(select(2, coroutine.resume(co, 5)) == depth + 5)
+    end
+    f = coroutine.wrap(rec, size)
+    assert(f(20) == 0 and f(1) == 21)
+  end
+  assert(not pcall(coroutine.create, rec, -1))
+  assert(not pcall(coroutine.create, rec, 2^40))
+  if T then   -- the collector does not shrink below the initial size
+    f = coroutine.wrap(function ()
+      while true do coroutine.yield(select(2, T.stacklevel())) end
+    end, 1000)
+    local size = f()
+    assert(size >= 990)
+    for i = 1, select(4, T.callinfo()) + 3 do collectgarbage() end
+    assert(f() == size)
+  end
+end
+
+-- closing coroutines
+do
+  local x
+  local co = coroutine.create(function ()
+    local y = 10
+    x = function () return y end
+    coroutine.yield()
+    y = 20
+  end)
+  assert(coroutine.close(co) and coroutine.status(co) == "dead")
+  assert(not coroutine.resume(co))
+  co = coroutine.create(function () coroutine.yield() end)
+  coroutine.resume(co)
+  assert(coroutine.close(co) and coroutine.status(co) == "dead")
+  co = coroutine.create(function () local y = 10; x = function () return y end
+                                    coroutine.yield(); error("x") end)
+  coroutine.resume(co)
+  assert(coroutine.close(co) and x() == 10)  -- upvalue was closed
+  co = coroutine.create(error)
+  coroutine.resume(co, {})
+  assert(coroutine.close(co) == false)
+  co = coroutine.wrap(function () return pcall(coroutine.close,
+                                               coroutine.running()) end)
+  local st, msg = co()
+  assert(not st and string.find(msg, "running"))
+end
+
+-- coroutine pool
+do
+  local oldpool = coroutine.pool(0)
+  assert(coroutine.pool(4) == 0 and coroutine.pool() == 4)
+  -- closed coroutines do not go to the pool (the program still has them)
+  local co = coroutine.create(function (a) coroutine.yield(a) end)
+  coroutine.resume(co, 1)
+  assert(coroutine.close(co) and coroutine.close(co))
+  local co1 = coroutine.create(function (a, b) return a + b end)
+  local co2 = coroutine.create(function (a, b) return a * b end)
+  assert(co1 ~= co and co2 ~= co and co1 ~= co2)
+  assert(select(2, coroutine.resume(co1, 1, 2)) == 3)
+  assert(select(2, coroutine.resume(co2, 2, 5)) == 10)
+  -- wrapped coroutines go back to the pool when they finish
+  local f = coroutine.wrap(function (a) coroutine.yield(a); return a * 2 end)
+  assert(f(5) == 5 and f() == 10)
+  local st, msg = pcall(f)
+  assert(not st and string.find(msg, "dead coroutine"))
+  f = coroutine.wrap(function () error("oops") end)
+  st, msg = pcall(f)
+  assert(not st and string.find(msg, "oops"))
+  st, msg = pcall(f)
+  assert(not st and string.find(msg, "dead coroutine"))
+  -- upvalues do not lead to pooled threads
+  assert(select(2, debug.getupvalue(f, 1)) == false)
+  assert(debug.getupvalue(f, 2) == nil)
+  assert(debug.getupvalue(coroutine.create, 1) == nil)
+  assert(debug.getupvalue(coroutine.running, 1) == nil)
+  co = coroutine.create(function (a) coroutine.yield(a); return a + 1 end)
+  assert(select(2, coroutine.resume(co, 7)) == 7)
+  assert(select(2, coroutine.resume(co)) == 8)
+  -- ... except those whose thread the program got from 'running'
+  local seen = {}
+  for i = 1, 100 do
+    f = coroutine.wrap(function (a) return coroutine.running(), a end)
+    local th, a = f(i)
+    assert(a == i and coroutine.status(th) == "dead" and not seen[th])
+    seen[th] = true
+    co = coroutine.create(function () end)
+    assert(not seen[co])
+  end
+  -- pooled threads get the hooks of their creator
+  f = coroutine.wrap(print)
+  f()
+  local n = 0
+  debug.sethook(function () n = n + 1 end, "l")
+  co2 = coroutine.create(function () return 1 end)
+  coroutine.resume(co2)
+  debug.sethook()
+  assert(n > 0)
+  assert(coroutine.pool(oldpool) == 4)
+  assert(not pcall(coroutine.pool, -1))
+end
+
 -- sieve
 function gen (n)
   return coroutine.wrap(function ()
@@ -527,4 +527,35 @@ assert(string.find(b, "line 2") and string.find(b, "too many local variables"))
 
 mt.__index = oldmm
 
+
+-- testing error mechanisms
+do
+  local function check ()
+    local st, msg = pcall(error, {x = 1})
+    assert(not st and msg.x == 1)
+    st, msg = pcall(load, "x = = 1")   -- syntax error
+    assert(st and msg == nil)
+    st, msg = pcall(function () local a = {} .. 1 end)
+    assert(not st and string.find(msg, "concatenate"))
+    local co = coroutine.wrap(function () coroutine.yield(1); error("co") end)
+    assert(co() == 1)
+    st, msg = pcall(co)
+    assert(not st and string.find(msg, "co"))
+    st, msg = pcall(string.rep, "x", -1, {})
+    assert(not st and string.find(msg, "bad argument #3"))
+  end
+  local hasjump = debug.seterrormode("jump")
+  check()
+  -- handlers set up with one mechanism are still used with it
+  local st, msg = pcall(function ()
+    debug.seterrormode("throw")
+    check()
+    error("outer")
+  end)
+  assert(not st and string.find(msg, "outer"))
+  assert(debug.seterrormode("throw") or hasjump)
+  check()
+  checkerr("invalid option", debug.seterrormode, "none")
+end
+
 print('OK')
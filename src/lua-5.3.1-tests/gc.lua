@@ -10,6 +10,17 @@ assert(collectgarbage("isrunning"))
 
 local function gcinfo () return collectgarbage"count" * 1024 end
 
+-- with LUAI_GCPOOL, memory is counted by pool chunk: creating a small
+-- object usually does not change the count, and freeing it never does
+local pooled
+do
+  collectgarbage"stop"
+  local m0 = gcinfo(); local t1 = {}
+  local m1 = gcinfo(); local t2 = {}
+  pooled = (m1 == m0 or gcinfo() == m1)
+  collectgarbage"restart"
+end
+
 
 -- test weird parameters
 do
@@ -34,6 +45,212 @@ do
 end
 
 
+-- test adaptive pacer
+do
+  -- peak overhead (memory above the live data, relative to it) in the
+  -- first quarter and in the second half of a run with a given target
+  local function overhead (target)
+    assert(collectgarbage("target", target) == 0)
+    collectgarbage()
+    local live = {}
+    for i = 1, 20000 do live[i] = {i} end
+    collectgarbage()
+    local base = collectgarbage("count")
+    local first, last = 0, 0
+    for i = 1, 400000 do
+      local t = {i, i}
+      local m = collectgarbage("count")
+      if i <= 100000 then first = math.max(first, m)
+      elseif i > 200000 then last = math.max(last, m) end
+    end
+    local mul = T and T.gcpacer()
+    assert(collectgarbage("target", 0) == target)
+    return first / base - 1, last / base - 1, mul
+  end
+  local _, fixed, stepmul = overhead(0)
+  local _, _, mul20 = overhead(20)
+  for _, target in ipairs{50, 100} do
+    local first, last, mul = overhead(target)
+    target = target / 100
+    -- overhead converges toward the target (not just below it)...
+    -- (with a pool, 'count' also includes free blocks inside chunks)
+    assert(target / 2 < last and (last < target * 1.25 or pooled))
+    assert(math.abs(last - target) <= math.abs(first - target) + 0.01 or
+           pooled)
+    -- ... while the fixed pause lets the heap grow much more
+    assert(last < fixed)
+    -- smaller targets need a larger step multiplier
+    assert(not T or (mul20 > mul and mul >= stepmul))
+  end
+  assert(collectgarbage("target", -1) == 0)
+  assert(collectgarbage("target", 0) == 0)
+
+  -- step size follows the target pause
+  assert(collectgarbage("targetpause", 1) == 0)
+  for i = 1, 100000 do local t = {i} end
+  local small = T and select(2, T.gcpacer())
+  assert(collectgarbage("targetpause", 1000) == 1)
+  for i = 1, 100000 do local t = {i} end
+  local large = T and select(2, T.gcpacer())
+  assert(collectgarbage("targetpause", 0) == 1000)
+  assert(not T or small < large)
+end
+
+
+-- test time-bounded steps and idle collection
+do
+  assert(collectgarbage("setslice", 50) == 0)
+  local a = {}
+  for i = 1, 20000 do a[i % 100] = {i} end
+  assert(collectgarbage("setslice", 0) == 50)
+  assert(not collectgarbage("idle", 0))
+  collectgarbage()
+  for i = 1, 1000 do a[i % 100] = {i} end
+  local x
+  x = setmetatable({}, {__gc = function () x = true end})
+  x = nil
+  local cycles = 0
+  repeat
+    a[1] = {}   -- give the collector something new to do
+    if collectgarbage("idle", 10000) then cycles = cycles + 1 end
+  until x == true
+  assert(cycles >= 1)
+  -- a stopped collector does no idle work
+  collectgarbage("stop")
+  x = setmetatable({}, {__gc = function () x = true end})
+  x = nil
+  for i = 1, 1000 do a[i % 100] = {i} end
+  for i = 1, 10 do assert(not collectgarbage("idle", 10000)) end
+  assert(x == nil)
+  collectgarbage("restart")
+  collectgarbage()
+  assert(x == true)
+end
+
+
+-- test deferred finalizers
+do
+  collectgarbage()
+  assert(collectgarbage("runfinalizers") == 0)
+  assert(not collectgarbage("deferfinalizers", true))
+  local count = 0
+  local mt = {__gc = function () count = count + 1 end}
+  for i = 1, 10 do setmetatable({}, mt) end
+  collectgarbage()
+  for i = 1, 1000 do local t = {i} end
+  assert(count == 0)   -- nothing called yet
+  assert(collectgarbage("runfinalizers", 3) == 3 and count <= 3)
+  assert(collectgarbage("runfinalizers") >= 7 and count == 10)
+  assert(collectgarbage("runfinalizers") == 0)
+  -- finalizers can run from a coroutine
+  setmetatable({}, mt)
+  collectgarbage()
+  local co = coroutine.wrap(function ()
+    while true do coroutine.yield(collectgarbage("runfinalizers", 5)) end
+  end)
+  repeat until co() == 0
+  assert(count == 11)
+  assert(collectgarbage("deferfinalizers", false))
+  setmetatable({}, mt)
+  collectgarbage()
+  assert(count == 12)
+end
+
+
+-- test heap statistics and sampler
+do
+  collectgarbage()
+  local s0 = collectgarbage("stats")
+  local a = {}
+  for i = 1, 1000 do a[i] = {} end
+  local s1 = collectgarbage("stats")
+  assert(s1.table.count >= s0.table.count + 1000)
+  assert(s1.table.bytes > s0.table.bytes)
+  assert(s1.tablearray.bytes > s0.tablearray.bytes)
+  assert(s1.thread.count >= 1 and s1.proto.count >= 1)
+  assert(collectgarbage("sample", 1) == 0)
+  local line = debug.getinfo(1, "l").currentline + 1
+  for i = 1, 100 do a[i] = {} end
+  local sites = collectgarbage("sites")
+  local key = string.format("%s:%d", debug.getinfo(1, "S").short_src, line)
+  assert(sites[key].count == 100)
+  if T then   -- a memory error while building the result keeps sampling on
+    T.totalmem(T.totalmem() + 100)
+    assert(not pcall(collectgarbage, "sites"))
+    T.totalmem(0)
+    assert(collectgarbage("sites")[key].count == 100)
+  end
+  assert(collectgarbage("sample", 0) == 1)
+  assert(next(collectgarbage("sites")) == nil)
+end
+
+
+-- test the small-object pool (memory in it is zero without LUAI_GCPOOL)
+do
+  local function pool () return collectgarbage("stats").pool end
+  collectgarbage()
+  local p0 = pool()
+  local a = {}
+  for i = 1, 100000 do a[i] = {} end
+  local p1 = pool()
+  assert(p1 == 0 or p1 >= p0 + 100000 * 32)
+  for i = 1, 100000, 2 do a[i] = nil end
+  collectgarbage()
+  local p2 = pool()
+  for i = 1, 100000, 2 do a[i] = {} end   -- reuse freed blocks
+  assert(pool() <= p2 + 64 * 1024)
+  a = nil
+  collectgarbage()   -- chunks left without objects go back
+  assert(p1 == 0 or pool() < p0 + (p1 - p0) / 4)
+end
+
+
+-- test heap snapshots
+do
+  local function parse (s)
+    local objs, roots = {}, {}
+    assert(string.sub(s, 1, 6) == "\27LuaH\1")
+    local pos = 7
+    while pos <= #s do
+      local tag = string.sub(s, pos, pos)
+      if tag == "R" then
+        local label, id
+        label, id, pos = string.unpack("<s2c8", s, pos + 1)
+        roots[label] = id
+      else
+        assert(tag == "O")
+        local t, id, size, desc, n
+        t, id, size, desc, n, pos = string.unpack("<Bc8I8s2I4", s, pos + 1)
+        local edges = {}
+        for i = 1, n do
+          local to, label
+          to, label, pos = string.unpack("<c8s2", s, pos)
+          edges[label] = to
+        end
+        objs[id] = {type = t, size = size, desc = desc, edges = edges}
+      end
+    end
+    return objs, roots
+  end
+  snapglobal = {leak = {"some string in a snapshot"}}
+  local snaplocal = setmetatable({}, {__mode = "v"})
+  snaplocal[1] = {}    -- weakly referenced
+  local objs, roots = parse(debug.heapsnapshot())
+  local g = objs[roots.globals]
+  local t = objs[objs[g.edges.snapglobal].edges.leak]
+  assert(t.type == 5 and t.size > 0)
+  assert(objs[t.edges["[1]"]].desc == "some string in a snapshot")
+  assert(objs[roots.registry] and objs[roots.mainthread])
+  assert(objs[roots["metatable(string)"]])
+  local found
+  for _, o in pairs(objs) do
+    if o.edges["local snaplocal"] then found = objs[o.edges["local snaplocal"]] end
+  end
+  assert(found and found.edges.metatable and not found.edges["[1]"])
+  snapglobal = nil
+end
+
+
 _G["while"] = 234
 
 limit = 5000
@@ -174,7 +391,7 @@ local function dosteps (siz)
   repeat   -- do steps until it completes a collection cycle
     i = i+1
   until collectgarbage("step", siz)
-  assert(gcinfo() < x)
+  assert(gcinfo() < x or pooled)
   return i
 end
 
@@ -338,6 +555,24 @@ K = nil
 GC()
 -- assert(next(a) == nil)
 
+-- long chains of ephemerons spread over several tables
+do
+  local ts = {}
+  for i = 1, 10 do ts[i] = setmetatable({}, mt) end
+  local first = {}
+  local k = first
+  for i = 1, 5000 do
+    local nk = {}; ts[i % 10 + 1][k] = {nk}; k = nk
+  end
+  GC()
+  local n, i = first, 0
+  while n do n = ts[(i + 1) % 10 + 1][n]; n = n and n[1]; i = i + 1 end
+  assert(i == 5001)
+  first = nil; k = nil
+  GC()
+  for i = 1, 10 do assert(next(ts[i]) == nil) end
+end
+
 
 -- testing errors during GC
 do
@@ -232,8 +232,10 @@ static void checktable (global_State *g, Table *h) {
     checkvalref(g, hgc, &h->array[i]);
   for (n = gnode(h, 0); n < limit; n++) {
     if (!ttisnil(gval(n))) {
-      lua_assert(!ttisnil(gkey(n)));
-      checkvalref(g, hgc, gkey(n));
+      TValue k;
+      lua_assert(!keyisnil(n));
+      getnodekey(g->mainthread, &k, n);
+      checkvalref(g, hgc, &k);
       checkvalref(g, hgc, gval(n));
     }
   }
@@ -655,6 +657,15 @@ static int gc_state (lua_State *L) {
 }
 
 
+/* step multiplier and basic step size used by the collector */
+static int gc_pacer (lua_State *L) {
+  global_State *g = G(L);
+  lua_pushinteger(L, g->gctarget > 0 ? g->gcpacedmul : g->gcstepmul);
+  lua_pushinteger(L, g->GCstepsize);
+  return 2;
+}
+
+
 static int hash_query (lua_State *L) {
   if (lua_isnone(L, 2)) {
     luaL_argcheck(L, lua_type(L, 1) == LUA_TSTRING, 1, "string expected");
@@ -680,6 +691,27 @@ static int stacklevel (lua_State *L) {
 }
 
 
+/*
+** number of CallInfo entries in the list of the running thread and how
+** many of them are in use (both not counting 'base_ci'), the size of
+** the blocks they are allocated in, and the number of idle collections
+** before the list and the stack shrink
+*/
+static int callinfo (lua_State *L) {
+  CallInfo *ci;
+  int n = 0, inuse = 0;
+  for (ci = L->base_ci.next; ci != NULL; ci = ci->next)
+    n++;
+  for (ci = L->ci; ci != &L->base_ci; ci = ci->previous)
+    inuse++;
+  lua_pushinteger(L, n);
+  lua_pushinteger(L, inuse);
+  lua_pushinteger(L, LUAI_CIBLOCK);
+  lua_pushinteger(L, LUAI_SHRINKDELAY);
+  return 4;
+}
+
+
 static int table_query (lua_State *L) {
   const Table *t;
   int i = cast_int(luaL_optinteger(L, 2, -1));
@@ -696,10 +728,12 @@ static int table_query (lua_State *L) {
     lua_pushnil(L);
   }
   else if ((i -= t->sizearray) < sizenode(t)) {
+    TValue k;
+    getnodekey(L, &k, gnode(t, i));
     if (!ttisnil(gval(gnode(t, i))) ||
-        ttisnil(gkey(gnode(t, i))) ||
-        ttisnumber(gkey(gnode(t, i)))) {
-      pushobject(L, gkey(gnode(t, i)));
+        ttisnil(&k) ||
+        ttisnumber(&k)) {
+      pushobject(L, &k);
     }
     else
       lua_pushliteral(L, "<undef>");
@@ -797,6 +831,114 @@ static int udataval (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Batch raw accesses ('lua_rawgetfields' and friends); each function
+** returns the result of the API call followed by the values copied
+** =======================================================
+*/
+
+#define MAXENTRIES	16
+
+
+static void pushentry (lua_State *L, const lua_Entry *e) {
+  switch (e->type) {
+    case LUA_TNIL: lua_pushnil(L); break;
+    case LUA_TBOOLEAN: lua_pushboolean(L, e->v.b); break;
+    case LUA_TNUMBER: {
+      if (e->isinteger) lua_pushinteger(L, e->v.i);
+      else lua_pushnumber(L, e->v.n);
+      break;
+    }
+    case LUA_TSTRING: lua_pushlstring(L, e->s, e->len); break;
+    default: lua_pushlightuserdata(L, cast(void *, e->v.p)); break;
+  }
+}
+
+
+/* check range [from, to] in arguments 2-3 and return its size */
+static int entryrange (lua_State *L, lua_Integer *from, lua_Integer *to) {
+  *from = luaL_checkinteger(L, 2);
+  *to = luaL_checkinteger(L, 3);
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (*from > *to) return 0;
+  luaL_argcheck(L, l_castS2U(*to) - l_castS2U(*from) < MAXENTRIES, 3,
+                "range too large");
+  return cast_int(*to - *from) + 1;
+}
+
+
+static int rawgetfields (lua_State *L) {
+  const char *keys[MAXENTRIES];
+  lua_Entry out[MAXENTRIES];
+  int n = lua_gettop(L) - 1;
+  int i;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_argcheck(L, n <= MAXENTRIES, 1, "too many keys");
+  for (i = 0; i < n; i++)
+    keys[i] = luaL_checkstring(L, i + 2);
+  lua_pushinteger(L, lua_rawgetfields(L, 1, keys, n, out));
+  for (i = 0; i < n; i++)
+    pushentry(L, &out[i]);
+  return n + 1;
+}
+
+
+static int rawgetiv (lua_State *L) {
+  lua_Entry out[MAXENTRIES];
+  lua_Integer from, to;
+  int n = entryrange(L, &from, &to);
+  int i;
+  lua_pushinteger(L, lua_rawgetiv(L, 1, from, to, out));
+  for (i = 0; i < n; i++)
+    pushentry(L, &out[i]);
+  return n + 1;
+}
+
+
+static int rawgetnumbers (lua_State *L) {
+  lua_Number out[MAXENTRIES];
+  lua_Integer from, to, n, i;
+  entryrange(L, &from, &to);
+  n = lua_rawgetnumbers(L, 1, from, to, out);
+  lua_pushinteger(L, n);
+  for (i = 0; i < n; i++)
+    lua_pushnumber(L, out[i]);
+  return cast_int(n) + 1;
+}
+
+
+static int rawgetintegers (lua_State *L) {
+  lua_Integer out[MAXENTRIES];
+  lua_Integer from, to, n, i;
+  entryrange(L, &from, &to);
+  n = lua_rawgetintegers(L, 1, from, to, out);
+  lua_pushinteger(L, n);
+  for (i = 0; i < n; i++)
+    lua_pushinteger(L, out[i]);
+  return cast_int(n) + 1;
+}
+
+
+/* without a 4th argument, calls 'lua_rawgetstrings' with no lengths */
+static int rawgetstrings (lua_State *L) {
+  const char *out[MAXENTRIES];
+  size_t len[MAXENTRIES];
+  int withlen = !lua_isnone(L, 4);
+  lua_Integer from, to, n, i;
+  entryrange(L, &from, &to);
+  n = lua_rawgetstrings(L, 1, from, to, out, withlen ? len : NULL);
+  lua_pushinteger(L, n);
+  for (i = 0; i < n; i++) {
+    if (withlen) lua_pushlstring(L, out[i], len[i]);
+    else lua_pushstring(L, out[i]);
+  }
+  return cast_int(n) + 1;
+}
+
+/* }====================================================== */
+
+
 static int doonnewstack (lua_State *L) {
   lua_State *L1 = lua_newthread(L);
   size_t l;
@@ -1505,6 +1647,7 @@ static int coresume (lua_State *L) {
 
 
 static const struct luaL_Reg tests_funcs[] = {
+  {"callinfo", callinfo},
   {"checkmemory", lua_checkmemory},
   {"closestate", closestate},
   {"d2s", d2s},
@@ -1512,6 +1655,7 @@ static const struct luaL_Reg tests_funcs[] = {
   {"doremote", doremote},
   {"gccolor", gc_color},
   {"gcstate", gc_state},
+  {"gcpacer", gc_pacer},
   {"getref", getref},
   {"hash", hash_query},
   {"int2fb", int2fb_aux},
@@ -1528,6 +1672,11 @@ static const struct luaL_Reg tests_funcs[] = {
   {"pushuserdata", pushuserdata},
   {"querystr", string_query},
   {"querytab", table_query},
+  {"rawgetfields", rawgetfields},
+  {"rawgetintegers", rawgetintegers},
+  {"rawgetiv", rawgetiv},
+  {"rawgetnumbers", rawgetnumbers},
+  {"rawgetstrings", rawgetstrings},
   {"ref", tref},
   {"resume", coresume},
   {"s2d", s2d},
@@ -338,6 +338,31 @@ assert(tonumber'+ 0.01' == nil and tonumber'+.e1' == nil and
 assert(tonumber('-012') == -010-2)
 assert(tonumber('-1.2e2') == - - -120)
 
+if intbits >= 64 then
+  assert(tonumber("1234567890123456") == 1234567890123456)
+  assert(tonumber(" -12345678901234567 ") == -12345678901234567)
+end
+assert(tonumber("12345678.5") == 24691357 / 2)
+
+-- decimal floats are correctly rounded
+assert(tonumber("0.1") == 1/10 and tonumber("-2.5e-3") == -25/10000)
+assert(tonumber("9007199254740993.0") == 2^53)   -- tie: round to even
+assert(tonumber("9007199254740995.0") == 2^53 + 4)
+assert(tonumber("9007199254740993.00000000000000000001") == 2^53 + 2)
+assert(tonumber("1" .. string.rep("0", 400) .. "e-400") == 1.0)
+assert(tonumber("0." .. string.rep("0", 400) .. "1e401") == 1.0)
+assert(tonumber("1e309") == 1/0 and tonumber("-1e-400") == 0.0)
+-- exponents and digit counts too large for the fast path
+assert(tonumber("0." .. string.rep("0", 1000000) .. "1e1000005") == 10000.0)
+assert(tonumber("1" .. string.rep("0", 200000) .. "e-200002") == 0.01)
+assert(tonumber("1e00000000000000000002") == 100.0)
+assert(tonumber("1e1000000") == 1/0 and tonumber("1e-1000000") == 0.0)
+assert(tonumber("4.9406564584124654e-324") == 2^-1074)
+assert(tonumber("2.4703282292062328e-324") == 2^-1074)
+assert(tonumber("2.4703282292062327e-324") == 0.0)
+assert(tonumber("1.7976931348623157e308") == 0x1.fffffffffffffp1023)
+assert(tonumber("1.2.3") == nil and tonumber("1e5x") == nil)
+
 assert(tonumber("0xffffffffffff") == (1 << (4*12)) - 1)
 assert(tonumber("0x"..string.rep("f", (intbits//4))) == -1)
 assert(tonumber("-0x"..string.rep("f", (intbits//4))) == 1)
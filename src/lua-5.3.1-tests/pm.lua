@@ -354,5 +354,77 @@ assert(string.match("abc\0\0\0", "%\0%\0?") == "\0\0")
 assert(string.find("abc\0\0","\0.") == 4)
 assert(string.find("abcx\0\0abc\0abc","x\0\0abc\0a.") == 4)
 
+-- compiled patterns: malformed parts are only reported when reached
+assert(string.find("abc", "x%") == nil)
+assert(string.match("abc", "^b[") == nil)
+malform("a%", "ends with")
+
+-- compiled patterns: more patterns than cache entries, reused
+do
+  local pats = {}
+  for i = 1, 300 do pats[i] = "(%d+)" .. string.rep("x", i % 7) .. "()" .. i end
+  for r = 1, 3 do
+    for i = 1, #pats do
+      local s = "ab12" .. string.rep("x", i % 7) .. i
+      local a, b = string.match(s, pats[i])
+      assert(a == "12" and b == 5 + i % 7)
+    end
+    collectgarbage()
+  end
+  -- other patterns replace the current one in the cache while in use
+  local n = 0
+  local res = string.gsub("a1b2c3", "(%a)(%d)", function (l, d)
+    for i = 1, #pats do string.find("12x" .. i, pats[i]) end
+    collectgarbage()
+    n = n + 1
+    return d .. l
+  end)
+  assert(res == "1a2b3c" and n == 3)
+  local t = {}
+  for w in string.gmatch("one two three", "%a+") do
+    for i = 1, #pats do string.find("12", pats[i]) end
+    collectgarbage()
+    t[#t + 1] = w
+  end
+  assert(table.concat(t, ",") == "one,two,three")
+end
+
+-- substring search in long subjects (every search strategy)
+do
+  local s = string.rep("<a><b>", 1000)
+  assert(string.find(s .. "<c>", "<c>", 1, true) == #s + 1)
+  assert(string.find(s, "<c>", 1, true) == nil)
+  assert(string.find(s .. "x", "<b>x", 1, true) == #s - 2)
+  assert(string.find(s, "<b><a>", 2, true) == 4)
+  local m = string.rep("<a><b>", 4) .. "!"
+  assert(string.find(s .. m .. s, m, 1, true) == #s + 1)
+  assert(string.find(s .. m, m, -#m) == #s + 1)
+  assert(string.find(s .. m, m, -#m + 1) == nil)
+  local i, e, c = string.find(s .. "<!--x-->", "<!%-%-(.-)%-%->")
+  assert(i == #s + 1 and e == #s + 8 and c == "x")
+end
+
+-- unanchored searches skip positions where no match can start
+do
+  local s = string.rep("abc ", 500) .. "x12 (y) 34"
+  assert(string.find(s, "%d+") == 2002)
+  assert(select(3, string.find(s, "()(%d+)")) == 2002)
+  assert(string.match(s, "(%d)(%d)$") == "3")
+  assert(string.find(s, "%b()") == 2005)
+  assert(string.find(s, "$") == #s + 1)
+  assert(string.find(s, "%d*") == 1)
+  assert(string.find(s, "[xy]-%d") == 2001)
+  local t = {}
+  for w in string.gmatch(s, "%d+") do t[#t + 1] = w end
+  assert(table.concat(t, ",") == "12,34")
+  local r, n = string.gsub(s, "%d+", "#")
+  assert(n == 2 and r == string.rep("abc ", 500) .. "x# (y) #")
+  assert(string.gsub(s, "z+", "#") == s)
+  assert(select(2, string.gsub(s, "%s", "")) == 502)
+  -- too many capture openings before the first item still raise errors
+  local p = string.rep("(", 33) .. "z" .. string.rep(")", 33)
+  assert(not pcall(string.find, s, p))
+end
+
 print('OK')
 
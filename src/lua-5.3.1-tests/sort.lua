@@ -280,4 +280,139 @@ table.sort(a)
 check(a, tt.__lt)
 check(a)
 
+do   -- native sort of numbers and strings, against the generic one
+  local function gen (n, f)
+    local t = {}
+    for i = 1, n do t[i] = f(i, n) end
+    return t
+  end
+  local gens = {
+    function (i) return math.random(-1000, 1000) end,
+    function (i) return math.random() end,
+    function (i) return (i % 3 == 0) and i + 0.5 or -i end,   -- mixed
+    function (i) return math.maxinteger - i end,
+    function (i, n) return i <= n//2 and i or n - i end,   -- organ pipe
+    function (i) return i % 7 end,
+    function (i) return 3 end,
+    function (i) return string.format("%05d", math.random(1000)) end,
+    function (i) return string.rep("a", i % 5) .. "\0" .. i end,
+  }
+  for _, n in ipairs{2, 5, 24, 25, 130, 1000} do
+    for _, f in ipairs(gens) do
+      local t = gen(n, f)
+      local u = table.move(t, 1, n, 1, {})
+      table.sort(t)
+      table.sort(u, function (a, b) return a < b end)
+      for i = 1, n do assert(t[i] == u[i]) end
+      check(t)
+    end
+  end
+  -- integers and floats compare exactly
+  local maxi, mini = math.maxinteger, math.mininteger
+  local t = {maxi, maxi + 0.0, maxi - 1, -1, -1.5, mini, mini + 0.0, 0.5}
+  table.sort(t)
+  check(t)
+  assert(t[1] == mini and t[2] == mini and t[#t] >= maxi)
+  -- values the native sort does not handle
+  checkerror("compare", table.sort, {1, "x", 2, 3})
+  checkerror("compare", table.sort, {1, 2, 3, true})
+  local t = {3, 1, 2, 0/0}   -- NaN goes through the generic sort
+  table.sort(t)
+  local t = {}   -- elements in the hash part
+  for i = 10, 1, -1 do t[i] = i end
+  table.sort(t)
+  check(t)
+  local t = setmetatable({5, 4, 3}, {__index = function () return 0 end})
+  table.sort(t)
+  check(t)
+end
+
+
+do   -- worst cases: an adversary that makes plain quicksort quadratic
+  local n = 5000
+  local gas = n + 1
+  local val, nsolid, candidate, c = {}, 0, nil, 0
+  local t = {}
+  for i = 1, n do val[i] = gas; t[i] = i end
+  table.sort(t, function (x, y)
+    c = c + 1
+    if val[x] == gas and val[y] == gas then
+      if x == candidate then val[x] = nsolid else val[y] = nsolid end
+      nsolid = nsolid + 1
+    end
+    if val[x] == gas then candidate = x
+    elseif val[y] == gas then candidate = y
+    end
+    return val[x] < val[y]
+  end)
+  assert(c < 100 * n)
+  for i = 2, n do assert(val[t[i - 1]] < val[t[i]]) end
+end
+
+
+do   -- stable sorts
+  local function checkstable (t, key)
+    for i = 2, #t do
+      local a, b = key(t[i - 1]), key(t[i])
+      assert(not (b < a))
+      if not (a < b) then assert(t[i - 1].id < t[i].id) end
+    end
+  end
+  local mt = {__lt = function (a, b) return a.x < b.x end}
+  for _, n in ipairs{0, 1, 2, 8, 9, 17, 100, 1000} do
+    local t = {}
+    for i = 1, n do
+      local k = math.random(n // 4 + 1)
+      t[i] = {id = i, k = k, s = tostring(k), o = setmetatable({x = k}, mt)}
+    end
+    local u = table.move(t, 1, n, 1, {})
+    table.stablesort(u, function (a, b) return a.k < b.k end)
+    checkstable(u, function (e) return e.k end)
+    for _, f in ipairs{"k", "s", "o"} do
+      local u = table.move(t, 1, n, 1, {})
+      table.sortby(u, function (e) return e[f] end)
+      checkstable(u, function (e) return e[f] end)
+    end
+  end
+
+  -- equal numbers keep their order (and subtypes)
+  local t = {1, 1.0, -0.0, 0.0, 0, 2.0, 2, -1}
+  table.stablesort(t)
+  assert(t[1] == -1 and 1/t[2] < 0 and math.type(t[3]) == "float" and
+         math.type(t[4]) == "integer" and math.type(t[5]) == "integer" and
+         math.type(t[6]) == "float" and math.type(t[7]) == "float" and
+         math.type(t[8]) == "integer")
+  local t = {"b", "a", "c", "a"}
+  table.stablesort(t, function (a, b) return a > b end)
+  assert(table.concat(t) == "cbaa")
+
+  -- key function is called once per element
+  local t, calls = {}, 0
+  for i = 1, 100 do t[i] = 101 - i end
+  table.sortby(t, function (x) calls = calls + 1; return x end)
+  assert(calls == 100)
+  for i = 1, 100 do assert(t[i] == i) end
+  table.sortby(t, function (x) return -x end)
+  for i = 1, 100 do assert(t[i] == 101 - i) end
+
+  -- errors leave the list untouched
+  local t = {3, 2, 1}
+  checkerror("compare", table.sortby, t, function (x) return x ~= 2 and x or nil end)
+  checkerror("compare", table.stablesort, {1, "x"})
+  assert(not pcall(table.stablesort, t, function (a, b) error("x") end))
+  assert(t[1] == 3 and t[2] == 2 and t[3] == 1)
+  checkerror("function expected", table.sortby, t)
+
+  -- lists with metamethods
+  local t = {}
+  local proxy = setmetatable({}, {__len = function () return #t end,
+    __index = t, __newindex = t})
+  for i = 1, 10 do t[i] = 11 - i end
+  table.stablesort(proxy)
+  for i = 1, 10 do assert(t[i] == i) end
+  table.sortby(proxy, function (x) return -x end)
+  for i = 1, 10 do assert(t[i] == 11 - i) end
+end
+
+
 print"OK"
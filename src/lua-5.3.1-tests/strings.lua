@@ -137,6 +137,27 @@ if 4611686018427387904 > 0 then   -- no overflow? (64 bits)
   assert(tostring(4611686018427387904) == "4611686018427387904")
   assert(tostring(-4611686018427387904) == "-4611686018427387904")
 end
+assert(tostring(math.maxinteger) == string.format("%d", math.maxinteger))
+assert(tostring(math.mininteger) == string.format("%d", math.mininteger))
+
+do   -- floats are written as with "%.14g" or with their shortest form
+  local shortest = (tostring(0.1 + 0.2) ~= "0.3")
+  for _, x in ipairs{0.1, 1/3, -2/3, 0.5, 1e15, 1e14, 1e-5, 1e-4, 123.456,
+                     2^53, 2^63, -2^-1074, 1e100, 1.7976931348623157e308,
+                     99999999999999.5, 999999999999999.0, 9.999999999999999e22,
+                     12345678.901234567, 2^-1022, 0.1 + 0.2,
+                     -7.066198041404146e16, 9.60275487974286e16} do
+    local s = tostring(x)
+    if not shortest then
+      assert(string.gsub(s, "%.0$", "") == string.format("%.14g", x))
+    else
+      assert(tonumber(s) == x and #s <= #string.format("%.17g", x) + 2)
+      -- exponential format as in "%.17g"
+      local ax = math.abs(x)
+      assert((string.find(s, "e") == nil) == (ax >= 1e-4 and ax < 1e17))
+    end
+  end
+end
 
 if tostring(0.0) == "0.0" then   -- "standard" coercion float->string
   assert('' .. 12 == '12' and 12.0 .. '' == '12.0')
@@ -273,6 +294,25 @@ check("%10.1"..aux.."004d", "too long")
 check("%t", "invalid option")
 check("%"..aux.."d", "repeated flags")
 check("%d %d", "no value")
+check("%d %d", "no value")    -- (again, with a cached format)
+checkerror("number has no integer representation", string.format, "%d", 1.5)
+
+
+-- formats without flags or width are done without 'sprintf'
+for _, x in ipairs{0, -0.0, 1, -1, 0.5, 1.5, 2.5, -2.5, 0.125, 0.005, 1.005,
+                   3.14159, 123456.789, 999999999.5, 1e20, -1e-7, 1/0, -1/0} do
+  for _, p in ipairs{"", ".", ".0", ".1", ".2", ".3", ".9"} do
+    local f = "%" .. p .. "f"
+    assert(string.format(f, x) == string.format("%1" .. p .. "f", x))
+  end
+end
+for _, i in ipairs{0, 1, -1, 10, 255, maxi, mini} do
+  assert(string.format("%d|%i", i, i) == string.format("%1d|%1i", i, i))
+  assert(string.format("%x|%X", i, i) == string.format("%1x|%1X", i, i))
+end
+assert(string.format("%s|%s|%s", "a\0b", 10, 1.5) == "a|10|1.5")
+assert(string.format("%s%%", string.rep("x", 200)) == string.rep("x", 200) .. "%")
+assert(string.format("%%%%a%%b%%") == "%%a%b%")
 
 
 assert(load("return 1\n--comment without ending EOL")() == 1)
@@ -304,6 +344,43 @@ assert(table.concat(a, ",", 2) == "b,c")
 assert(table.concat(a, ",", 3) == "c")
 assert(table.concat(a, ",", 4) == "")
 
+-- string buffers
+do
+  local b = string.buffer()
+  assert(#b == 0 and b:len() == 0 and tostring(b) == "")
+  assert(b:put("abc", 1, 2.5, 3.0, -0.0, math.mininteger) == b)
+  assert(tostring(b) == "abc12.53.0-0.0" .. math.mininteger)
+  b:reset():put("x"):put(b, b)
+  assert(b:tostring() == "xxxx")
+  b:reset():putf("%d|%5s|%.1f|%q|%%", 10, "ab", 0.25, "\n")
+  assert(b:tostring() == string.format("%d|%5s|%.1f|%q|%%", 10, "ab", 0.25, "\n"))
+  b:reset():rep("ab", 3, ", "):rep("x", 0):rep("y", 1)
+  assert(b:tostring() == "ab, ab, aby")
+  assert(b:sub(2, 3) == "b," and b:sub(-3) == "aby" and b:sub(5, 2) == "")
+  assert(b:reserve(1000) == b and #b == 11)
+  local big = string.buffer(4)
+  local t = {}
+  for i = 1, 1000 do big:put(i, ","); t[i] = i .. "," end
+  assert(big:tostring() == table.concat(t))
+  checkerror("got table", b.put, b, {})
+  checkerror("number expected", b.putf, b, "%d", "x")
+  checkerror("invalid size", string.buffer, -1)
+  checkerror("too large", b.rep, b, "xx", math.maxinteger)
+  local f = io.tmpfile()
+  assert(big:writeto(f) == big)
+  f:seek("set")
+  assert(f:read("a") == big:tostring())
+  f:close()
+  checkerror("closed file", big.writeto, big, f)
+  -- buffer memory is managed by the collector
+  collectgarbage(); collectgarbage("stop")
+  local m = collectgarbage("count")
+  big = string.buffer(100000)
+  assert(collectgarbage("count") > m + 90)
+  big = nil; collectgarbage(); collectgarbage("restart")
+  assert(collectgarbage("count") < m + 10)
+end
+
 if not _port then
 
   local locales = { "ptb", "ISO-8859-1", "pt_BR" }
@@ -313,5 +313,83 @@ do    -- testing initial position
  
 end
 
+do    -- testing repetitions and arrays
+  assert(pack("i4*3", 1, 2, 3) == pack("i4i4i4", 1, 2, 3))
+  assert(pack(">h*2 x*3 b", 1, 2, 3) == "\0\1\0\2\0\0\0\3")
+  assert(pack("i4*0") == "" and packsize("d*0") == 0)
+  assert(packsize("i4*3") == 12 and packsize("x*5") == 5)
+  assert(packsize("!4 b i4[3]") == 16 and packsize("!2 b i3*3") == 13)
+  assert(#pack("!2 b i3*3", 1, 2, 3, 4) == 13)
+  local a, b, c, p = unpack("<i2*3", pack("<i2*3", 7, -8, 9))
+  assert(a == 7 and b == -8 and c == 9 and p == 7)
+
+  -- fixed-size arrays
+  local s = pack("<d[3]", {1.5, -2, 3e100})
+  assert(s == pack("<ddd", 1.5, -2, 3e100))
+  local t, p = unpack("<d[3]", s)
+  assert(#t == 3 and t[1] == 1.5 and t[2] == -2 and t[3] == 3e100 and p == 25)
+  local n, t, m, p = unpack("!4 b i4[2] b", pack("!4 b i4[2] b", 1, {10, 20}, 2))
+  assert(n == 1 and t[1] == 10 and t[2] == 20 and m == 2 and p == 14)
+  assert(#pack("j[0]", {}) == 0 and next((unpack("j[0]", ""))) == nil)
+  local t = unpack("c2[2]", "abcd")
+  assert(t[1] == "ab" and t[2] == "cd")
+
+  -- variable-size arrays
+  local t = {}
+  for i = 1, 100 do t[i] = i * 2 - 100 end
+  for _, f in ipairs{"<i2", ">j", "=I8", "!8 b", "n", "<f"} do
+    local s = pack(f .. "[*]", t)
+    local t1, p = unpack(f .. "[*]", s)
+    assert(#t1 == #t and p == #s + 1)
+    for i = 1, #t do assert(t1[i] == t[i]) end
+  end
+  assert(pack("<i2[*]", {}) == "" and #unpack("<i2[*]", "\0\0\0") == 1)
+  local t = unpack("z[*]", pack("z[*]", {"ab", "", "c"}))
+  assert(#t == 3 and t[1] == "ab" and t[2] == "" and t[3] == "c")
+  local t = unpack("s1[*]", pack("s1[*]", {"xyz", 10, ""}))
+  assert(#t == 3 and t[1] == "xyz" and t[2] == "10" and t[3] == "")
+  assert(#unpack("c0[*]", "abc") == 0 and #unpack("c2[*]", "abcde") == 2)
+
+  -- errors
+  checkerror("table expected", pack, "i4[*]", 1)
+  checkerror("number expected at index 2, got nil", pack, "i4[2]", {1})
+  checkerror("no integer representation at index 2", pack, "i4[*]", {1, 0.5})
+  checkerror("integer overflow at index 2", pack, "i1[*]", {1, 200})
+  checkerror("string expected at index 2, got table", pack, "z[*]", {"", {}})
+  checkerror("wrong length at index 1", pack, "c2[1]", {"a"})
+  checkerror("data string too short", unpack, "i4[2]", "\0\0\0\0\0")
+  checkerror("data string too short", unpack, "b[100000000]", "abc")
+  checkerror("variable%-length format", packsize, "i4[*]")
+  checkerror("too large", packsize, "i4*600000000")
+  checkerror("missing ']'", pack, "i4[2", {1, 2})
+  checkerror("missing count", pack, "i4*")
+  checkerror("missing count", pack, "i4[]", {})
+  checkerror("invalid repetition", pack, "<*2")
+  checkerror("invalid repetition", pack, "!4[2]", {})
+  checkerror("invalid repetition", pack, "x[2]", {})
+  checkerror("invalid repetition", pack, "Xi4*2")
+end
+
+do   -- finalizers that replace the cached format while it is in use
+  local N = 2000
+  local t = {}
+  for i = 1, N do t[i] = "item" .. i end
+  local fmt = "<s1[" .. N .. "]i4i4"   -- items after the array
+  local data = pack(fmt, t, 1, 2)
+  assert(#unpack(fmt, data) == N)   -- compile and cache 'fmt'
+  local oldpause = collectgarbage("setpause", 0)
+  local oldmul = collectgarbage("setstepmul", 1000)
+  for k = 1, 3 do
+    setmetatable({}, {__gc = function ()
+      for i = 1, 1000 do packsize("i" .. (i % 16 + 1) .. string.rep(" ", i // 16)) end
+      collectgarbage()
+    end})
+    local r, a, b = unpack(fmt, data)
+    for i = 1, N do assert(r[i] == t[i]) end
+    assert(a == 1 and b == 2 and pack(fmt, r, a, b) == data)
+  end
+  collectgarbage("setpause", oldpause); collectgarbage("setstepmul", oldmul)
+end
+
 print "OK"
 
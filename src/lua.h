@@ -30,6 +30,9 @@
 /* mark for precompiled code ('<esc>Lua') */
 #define LUA_SIGNATURE	"\x1bLua"
 
+/* mark for heap snapshots */
+#define LUA_SNAPSHOTSIG	"\x1bLuaH"
+
 /* option for multiple returns in 'lua_pcall' and 'lua_call' */
 #define LUA_MULTRET	(-1)
 
@@ -145,6 +148,8 @@ extern const char lua_ident[];
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
 LUA_API void       (lua_close) (lua_State *L);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
+LUA_API lua_State *(lua_newthreadsize) (lua_State *L, int stacksize);
+LUA_API int        (lua_resetthread) (lua_State *L);
 
 LUA_API lua_CFunction (lua_atpanic) (lua_State *L, lua_CFunction panicf);
 
@@ -230,6 +235,7 @@ LUA_API const char *(lua_pushvfstring) (lua_State *L, const char *fmt,
                                                       va_list argp);
 LUA_API const char *(lua_pushfstring) (lua_State *L, const char *fmt, ...);
 LUA_API void  (lua_pushcclosure) (lua_State *L, lua_CFunction fn, int n);
+LUA_API void  (lua_pushfastcfunction) (lua_State *L, lua_CFunction fn);
 LUA_API void  (lua_pushboolean) (lua_State *L, int b);
 LUA_API void  (lua_pushlightuserdata) (lua_State *L, void *p);
 LUA_API int   (lua_pushthread) (lua_State *L);
@@ -246,6 +252,35 @@ LUA_API int (lua_rawget) (lua_State *L, int idx);
 LUA_API int (lua_rawgeti) (lua_State *L, int idx, lua_Integer n);
 LUA_API int (lua_rawgetp) (lua_State *L, int idx, const void *p);
 
+/* a table entry copied by 'lua_rawgetfields'/'lua_rawgetiv' */
+typedef struct lua_Entry {
+  int type;  /* LUA_TNIL, LUA_TNUMBER, etc. */
+  int isinteger;  /* for numbers, true if 'v.i' holds the value */
+  union {
+    lua_Number n;  /* float numbers */
+    lua_Integer i;  /* integer numbers */
+    int b;  /* booleans */
+    const void *p;  /* other values (as in 'lua_topointer') */
+  } v;
+  const char *s;  /* contents of strings */
+  size_t len;  /* length of strings */
+} lua_Entry;
+
+LUA_API int (lua_rawgetfields) (lua_State *L, int idx, const char *const *keys,
+                                int n, lua_Entry *out);
+LUA_API lua_Integer (lua_rawgetiv) (lua_State *L, int idx, lua_Integer from,
+                                    lua_Integer to, lua_Entry *out);
+/* typed variants: stop at the first value of another type (no coercions) */
+LUA_API lua_Integer (lua_rawgetnumbers) (lua_State *L, int idx,
+                                         lua_Integer from, lua_Integer to,
+                                         lua_Number *out);
+LUA_API lua_Integer (lua_rawgetintegers) (lua_State *L, int idx,
+                                          lua_Integer from, lua_Integer to,
+                                          lua_Integer *out);
+LUA_API lua_Integer (lua_rawgetstrings) (lua_State *L, int idx,
+                                         lua_Integer from, lua_Integer to,
+                                         const char **out, size_t *len);
+
 LUA_API void  (lua_createtable) (lua_State *L, int narr, int nrec);
 LUA_API void *(lua_newuserdata) (lua_State *L, size_t sz);
 LUA_API int   (lua_getmetatable) (lua_State *L, int objindex);
@@ -262,6 +297,9 @@ LUA_API void  (lua_seti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawset) (lua_State *L, int idx);
 LUA_API void  (lua_rawseti) (lua_State *L, int idx, lua_Integer n);
 LUA_API void  (lua_rawsetp) (lua_State *L, int idx, const void *p);
+LUA_API int   (lua_rawsort) (lua_State *L, int idx, lua_Integer n);
+LUA_API int   (lua_rawstablesort) (lua_State *L, int idx, lua_Integer n,
+                                   int vidx);
 LUA_API int   (lua_setmetatable) (lua_State *L, int objindex);
 LUA_API void  (lua_setuservalue) (lua_State *L, int idx);
 
@@ -308,16 +346,56 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
 #define LUA_GCISRUNNING		9
+#define LUA_GCTARGET		10
+#define LUA_GCTARGETPAUSE	11
+#define LUA_GCIDLE		12
+#define LUA_GCSETSLICE		13
+#define LUA_GCDEFERFIN		14
+#define LUA_GCRUNFINALIZERS	15
+#define LUA_GCSAMPLE		16
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
 
+/*
+** heap statistics: kinds of objects
+*/
+#define LUA_HSSHRSTR	0	/* short strings */
+#define LUA_HSLNGSTR	1	/* long strings */
+#define LUA_HSTABLE	2	/* tables (without their parts) */
+#define LUA_HSTABARRAY	3	/* array parts of tables */
+#define LUA_HSTABHASH	4	/* hash parts of tables */
+#define LUA_HSLCL	5	/* Lua closures */
+#define LUA_HSCCL	6	/* C closures */
+#define LUA_HSPROTO	7	/* function prototypes */
+#define LUA_HSUDATA	8	/* full userdata */
+#define LUA_HSTHREAD	9	/* threads */
+
+#define LUA_NUMHS	10
+
+typedef struct lua_HeapStats {
+  size_t count[LUA_NUMHS];  /* number of objects of each kind */
+  size_t bytes[LUA_NUMHS];  /* memory used by objects of each kind */
+  size_t poolbytes;  /* memory held by the small-object pool */
+} lua_HeapStats;
+
+LUA_API void (lua_heapstats) (lua_State *L, lua_HeapStats *hs);
+LUA_API void (lua_allocsites) (lua_State *L);
+LUA_API int (lua_heapsnapshot) (lua_State *L, lua_Writer writer, void *data);
+
+
 /*
 ** miscellaneous functions
 */
 
 LUA_API int   (lua_error) (lua_State *L);
 
+/* error-handling mechanisms */
+#define LUA_ERRMODE_THROW	0	/* C++ exceptions */
+#define LUA_ERRMODE_JUMP	1	/* setjmp/longjmp */
+
+LUA_API int   (lua_seterrormode) (lua_State *L, int mode);
+
 LUA_API int   (lua_next) (lua_State *L, int idx);
 
 LUA_API void  (lua_concat) (lua_State *L, int n);
@@ -325,6 +403,11 @@ LUA_API void  (lua_len)    (lua_State *L, int idx);
 
 LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 
+/* minimum size for the buffer of 'lua_numbertocstring' */
+#define LUA_N2SBUFFSZ	64
+
+LUA_API unsigned (lua_numbertocstring) (lua_State *L, int idx, char *buff);
+
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
 
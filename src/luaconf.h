@@ -36,6 +36,17 @@
 /* #define LUA_32BITS */
 
 
+/*
+@@ LUA_NANTRICK packs each value in 8 bytes instead of 16: a value is
+** a 'double', and all other values live in the payload of NaNs. It
+** needs 64-bit pointers with only their lower 47 bits in use (as in
+** x86-64 and AArch64 user space) and implies 32-bit integers, which
+** fit in that payload. Halves the size of stack slots, array entries
+** and upvalues, and shrinks table nodes from 32 to 24 bytes.
+*/
+/* #define LUA_NANTRICK */
+
+
 /*
 @@ LUA_USE_C89 controls the use of non-ISO-C89 features.
 ** Define it if you want Lua to avoid the use of a few C99 features
@@ -126,6 +137,13 @@
 #endif
 #define LUA_FLOAT_TYPE	LUA_FLOAT_FLOAT
 
+#elif defined(LUA_NANTRICK)	/* }{ */
+/*
+** 32-bit integers (to fit in a NaN) and 'double'
+*/
+#define LUA_INT_TYPE	LUA_INT_INT
+#define LUA_FLOAT_TYPE	LUA_FLOAT_DOUBLE
+
 #elif defined(LUA_C89_NUMBERS)	/* }{ */
 /*
 ** largest types available for C89 ('long' and 'double')
@@ -473,6 +491,15 @@
 #define lua_number2str(s,n)	sprintf((s), LUA_NUMBER_FMT, (n))
 
 
+/*
+@@ LUA_SHORTESTFLOAT makes Lua convert floats to strings with the
+** fewest digits that read back as the same value, instead of with
+** LUA_NUMBER_FMT (e.g., 0.1 + 0.2 becomes "0.30000000000000004",
+** not "0.3"). It works only with IEEE doubles and 64-bit integers.
+*/
+/* #define LUA_SHORTESTFLOAT */
+
+
 /*
 @@ lua_numbertointeger converts a float number to an integer, or
 ** returns 0 if float is not within the range of a lua_Integer.
@@ -668,6 +695,17 @@
 #define luai_apicheck(l,e)	assert(e)
 #endif
 
+
+/*
+@@ LUAI_GCPOOL makes Lua allocate small collectable objects (short
+** strings, tables, closures, small userdata) from a pool of size
+** classes instead of calling the allocation function for each one.
+** Define it if your program creates lots of short-lived objects. Chunks
+** of the pool left without live objects are released at the end of each
+** collection cycle.
+*/
+/* #define LUAI_GCPOOL */
+
 /* }================================================================== */
 
 
@@ -394,7 +394,9 @@ int luaV_lessequal (lua_State *L, const TValue *l, const TValue *r) {
 int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2) {
   const TValue *tm;
   if (ttype(t1) != ttype(t2)) {  /* not the same variant? */
-    if (ttnov(t1) != ttnov(t2) || ttnov(t1) != LUA_TNUMBER)
+    if (ttislcf(t1) && ttislcf(t2))  /* plain and fast light C functions? */
+      return fvalue(t1) == fvalue(t2);  /* variant is not part of identity */
+    else if (ttnov(t1) != ttnov(t2) || ttnov(t1) != LUA_TNUMBER)
       return 0;  /* only numbers can be equal with different variants */
     else {  /* two numbers with different variants */
       lua_Integer i1, i2;  /* compare them as integers */
@@ -408,7 +410,7 @@ int luaV_equalobj (lua_State *L, const TValue *t1, const TValue *t2) {
     case LUA_TNUMFLT: return luai_numeq(fltvalue(t1), fltvalue(t2));
     case LUA_TBOOLEAN: return bvalue(t1) == bvalue(t2);  /* true must be 1 !! */
     case LUA_TLIGHTUSERDATA: return pvalue(t1) == pvalue(t2);
-    case LUA_TLCF: return fvalue(t1) == fvalue(t2);
+    case LUA_TLCF: case LUA_TFCF: return fvalue(t1) == fvalue(t2);
     case LUA_TSHRSTR: return eqshrstr(tsvalue(t1), tsvalue(t2));
     case LUA_TLNGSTR: return luaS_eqlngstr(tsvalue(t1), tsvalue(t2));
     case LUA_TUSERDATA: {
@@ -1081,7 +1083,31 @@ void luaV_execute (lua_State *L) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
-        if (luaD_precall(L, ra, nresults)) {  /* C function? */
+        if (ttisfastcf(ra) && L->hookmask == 0 &&
+            L->stack_last - L->top > LUA_MINSTACK) {  /* fast C function? */
+          CallInfo *fci = next_ci(L);  /* frame with only what the API uses */
+          StkId res, firstres;
+          int n;
+          fci->func = ra;
+          fci->top = L->top + LUA_MINSTACK;
+          fci->nresults = nresults;
+          fci->callstatus = 0;
+          lua_unlock(L);
+          n = (*fvalue(ra))(L);
+          lua_lock(L);
+          lua_assert(n < L->top - fci->func);
+          res = fci->func;  /* stack may have been reallocated */
+          firstres = L->top - n;
+          L->ci = ci;
+          if (nresults < 0) nresults = n;
+          for (b = 0; b < n && b < nresults; b++)
+            setobjs2s(L, res + b, firstres + b);
+          for (; b < nresults; b++)
+            setnilvalue(res + b);
+          L->top = (GETARG_C(i) == 0) ? res + n : ci->top;
+          base = ci->u.l.base;
+        }
+        else if (luaD_precall(L, ra, nresults)) {  /* C function? */
           if (nresults >= 0) L->top = ci->top;  /* adjust results */
           base = ci->u.l.base;
         }